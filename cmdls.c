@@ -41,7 +41,8 @@ cmdls_list(int argc, char **argv, int lopt, int ropt)
 	struct stat st;
 	Dentinfo   *entry;
 
-	if (argc == 1 && (smb_stat(argv[0], &st) == 0 && S_ISDIR(st.st_mode))) {
+	if (argc == 1 && (globmatch(argv[0], &st) != GLM_NONE ||
+	    smb_stat(argv[0], &st) == 0) && S_ISDIR(st.st_mode)) {
 		/* exactly one argument specified which is a directory */
 		listdir(argv[0], lopt, ropt);
 		return;
@@ -138,17 +139,18 @@ filecount(List *entries)
 
 /*
  * Retrieve contents of directory.  On error, NULL is returned.  On success, a
- * list of Dentinfo's is returned (which should be freed by the caller).
+ * list of Dentinfo's is returned (which should be freed by the caller).  The
+ * file information comes with the listing.
  */
 static List *
 statdir(const char *directory)
 {
 	int	dh;
 	List   *entries;
-	Str    *file;
 	Dentinfo  *entry;
-	Smbdirent *dent;
-	
+	const Smbdirent *dent;
+	struct stat st;
+
 	if (int_signal)
 		return NULL;
 
@@ -158,24 +160,19 @@ statdir(const char *directory)
 
 	entries = list_new();
 
-	while (!int_signal && (dent = smb_readdir(dh)) != NULL) {
+	while (!int_signal && (dent = smb_readdirplus(dh, &st)) != NULL) {
 		if (streql(dent->name, ".") || streql(dent->name, ".."))
 			continue;
 
-		entry = xmalloc(sizeof (Dentinfo));
-		entry->name = xstrdup(dent->name);
-
-		file = str_new(directory);
-		str_putcharptr(file, "/");
-		str_putcharptr(file, entry->name);
-
-		if (smb_stat(str_charptr(file), &entry->st) != 0) {
-			cmdwarn("%s", entry->name);
-			dentinfo_free(entry);
-			str_free(file); file = NULL;
+		/* could not be stat'ed, e.g. removed meanwhile */
+		if (st.st_mode == 0) {
+			cmdwarn("%s", dent->name);
 			continue;
 		}
-		str_free(file); file = NULL;
+
+		entry = xmalloc(sizeof (Dentinfo));
+		entry->name = xstrdup(dent->name);
+		entry->st = st;
 		list_add(entries, entry);
 	}
 
@@ -200,7 +197,8 @@ statdir(const char *directory)
  * 0, with argc elements).  This function always succeeds returning a list of
  * Dentinfo's which must be freed by the caller.  For files in argv for which
  * smb_stat() returns an error (e.g. because they do not exist), an error
- * message is printed and the file is ignored.
+ * message is printed and the file is ignored.  Matches of globbing are
+ * not stat'ed again.
  */
 static List *
 statlist(int argc, char **argv)
@@ -213,7 +211,8 @@ statlist(int argc, char **argv)
 	for (i = 0; !int_signal && i < argc; ++i) {
 		entry = xmalloc(sizeof (Dentinfo));
 		entry->name = xstrdup(argv[i]);
-		if (smb_stat(argv[i], &entry->st) != 0) {
+		if (globmatch(argv[i], &entry->st) != GLM_ATTRS &&
+		    smb_stat(argv[i], &entry->st) != 0) {
 			cmdwarn("%s", argv[i]);
 			dentinfo_free(entry);
 			continue;
@@ -8,11 +8,16 @@
  */
 
 
+static void     cmd_cache(int, char **);
+static void     cmd_cat(int, char **);
 static void     cmd_cd(int, char **);
 static void     cmd_chmod(int, char **);
 static void     cmd_close(int, char **);
+static void     cmd_cp(int, char **);
+static void     cmd_find(int, char **);
 static void     cmd_get(int, char **);
 static void     cmd_help(int, char **);
+static void     cmd_index(int, char **);
 static void     cmd_lcd(int, char **);
 static void     cmd_lpwd(int, char **);
 static void     cmd_ls(int, char **);
@@ -27,15 +32,22 @@ static void     cmd_page(int, char **);
 static void     cmd_put(int, char **);
 static void     cmd_pwd(int, char **);
 static void     cmd_quit(int, char **);
+static void     cmd_refresh(int, char **);
 static void     cmd_rm(int, char **);
 static void     cmd_rmdir(int, char **);
 static void     cmd_set(int, char **);
 static void     cmd_umask(int, char **);
+static void     cmd_use(int, char **);
 static void     cmd_version(int, char **);
 
 static void     usage(void);
 static void     usage_command(const char *);
 static void     options(const char *);
+static void     getall(char **, int *, int);
+static void     putall(char **, int *, int);
+static void     putmany(char **, char *, int *);
+static void     copyall(int, char **, SmbSession *, int *, int);
+static int      switchsession(char **, SmbSession **);
 
 
 /*
@@ -44,6 +56,14 @@ static void     options(const char *);
  * fields in cmds.h.
  */
 Cmd	commands[] = {
+    { "cache", cmd_cache, CMD_MUSTCONN,
+      "print statistics of the remote attribute and listing cache",
+      { "cache", NULL },
+      { NULL } },
+    { "cat", cmd_cat, CMD_MUSTCONN,
+      "write remote files to standard output",
+      { "cat [name:]file ...", NULL },
+      { NULL } },
     { "cd", cmd_cd, CMD_MUSTCONN,
       "change current remote directory",
       { "cd directory", NULL },
@@ -52,16 +72,32 @@ Cmd	commands[] = {
       "change mode of remote file or directory",
       { "chmod mode file ...", NULL },
       { NULL } },
-    { "close", cmd_close, CMD_MUSTCONN,
-      "close current connection",
-      { "close", NULL },
+    { "close", cmd_close, CMD_MAYCONN,
+      "close current or named session",
+      { "close [name]", NULL },
       { NULL } },
+    { "cp", cmd_cp, CMD_MUSTCONN,
+      "copy remote files, also to another session",
+      { "cp [-cfrs] [name:]file1 [name:]file2",
+        "cp [-cfrs] [name:]file ... [name:]directory", NULL },
+      { "-c       resume (continue) remote file if it exists",
+        "-f       force overwriting remote file if it exists",
+        "-r       copy recursively",
+        "-s       skip if remote file exists",
+        NULL } },
+    { "find", cmd_find, CMD_MUSTCONN,
+      "find remote files by name in the index of the share",
+      { "find [-l] pattern [directory]", NULL },
+      { "-l print extra information",
+        NULL } },
     { "get", cmd_get, CMD_MUSTCONN,
       "retrieve remote files",
-      { "get [-rcfs] file ...", "get [-rcfs] -o file1 file2", NULL },
+      { "get [-rcdfs] [name:]file ...", "get [-rcdfs] -o file1 [name:]file2",
+        NULL },
       { "-c       resume (continue) local file if it exists",
+        "-d       only rewrite what differs of local file if it exists",
         "-f       force overwrite of local file if it exists",
-        "-o file  give local file specified name",
+        "-o file  give local file specified name, - for standard output",
         "-r       retrieve recursively",
         "-s       skip if local file exists",
         NULL } },
@@ -69,6 +105,10 @@ Cmd	commands[] = {
       "print help information of command",
       { "help [command]", NULL },
       { NULL } },
+    { "index", cmd_index, CMD_MUSTCONN,
+      "make or update the index of the share",
+      { "index", NULL },
+      { NULL } },
     { "lcd", cmd_lcd, CMD_MAYCONN,
       "change current local directory",
       { "lcd directory", NULL },
@@ -113,10 +153,11 @@ Cmd	commands[] = {
       "rename remote file or move remote files to directory",
       { "mv file1 file2", "mv file ... directory", NULL },
       { NULL } },
-    { "open", cmd_open, CMD_MUSTNOTCONN,
+    { "open", cmd_open, CMD_MAYCONN,
       "open connection to host",
-      { "open [-u user] [-P | -p pass] host share [path]", NULL },
-      { "-p pass  login using given password",
+      { "open [-n name] [-u user] [-P | -p pass] host share [path]", NULL },
+      { "-n name  open an additional session called name",
+        "-p pass  login using given password",
         "-P       prompt for password",
         "-u user  login using given username",
         NULL } },
@@ -126,12 +167,16 @@ Cmd	commands[] = {
       { NULL } },
     { "put", cmd_put, CMD_MUSTCONN,
       "write local files and directories to remote host",
-      { "put [-cfrs] file ...", "put [-cfrs] -o file1 file2", NULL },
+      { "put [-cdfrs] file ...", "put [-cdfrs] -o [name:]file1 file2",
+        "put [-cfs] -t name,... file ...", NULL },
       { "-c       resume (continue) remote file if it exists",
+        "-d       only write what differs of remote file if it exists",
         "-f       force overwriting remote file if it exists",
-        "-o file  give remote file specified name",
+        "-o file  give remote file specified name, file2 may be - for",
+        "         standard input",
         "-r       upload recursively",
         "-s       skip if remote file exists",
+        "-t names upload to each of the named sessions at once",
         NULL } },
     { "pwd", cmd_pwd, CMD_MUSTCONN,
       "print current remote working directory",
@@ -141,6 +186,10 @@ Cmd	commands[] = {
       "quit program",
       { "quit", NULL },
       { NULL } },
+    { "refresh", cmd_refresh, CMD_MUSTCONN,
+      "forget cached remote attributes and listings",
+      { "refresh [directory ...]", NULL },
+      { NULL } },
     { "rm", cmd_rm, CMD_MUSTCONN,
       "remove remote files",
       { "rm [-r] file ...", NULL },
@@ -158,6 +207,10 @@ Cmd	commands[] = {
       "change remote umask",
       { "umask mode", NULL },
       { NULL } },
+    { "use", cmd_use, CMD_MAYCONN,
+      "switch to another session, or list sessions",
+      { "use [name]", NULL },
+      { NULL } },
     { "version", cmd_version, CMD_MAYCONN,
       "show version information",
       { "version", NULL },
@@ -219,6 +272,64 @@ options(const char *name)
  * Begin of the commands.
  */
 
+static void
+cmd_cache(int argc, char **argv)
+{
+	Smbcachestats	cs;
+
+	if (argc != 1)
+		cmdwarnx("ignoring arguments");
+
+	smbs_cachestats(smb_getsession(), &cs);
+	printf("attributes: %d entries, %lu hits, %lu misses\n", cs.stats,
+	    cs.stathits, cs.statmisses);
+	printf("listings:   %d entries, %lu hits, %lu misses\n", cs.listings,
+	    cs.dirhits, cs.dirmisses);
+}
+
+
+static void
+cmd_cat(int argc, char **argv)
+{
+	SmbSession     *prev;
+	int	i, fd;
+
+	eoptind = 1;
+	eoptreset = 1;  /* clean egetopt state */
+	if (egetopt(argc, argv, "") != -1) {
+		cmdwarnx("no options accepted");
+		usage();
+		return;
+	}
+	argc -= eoptind;
+	argv += eoptind;
+
+	if (argc == 0) {
+		cmdwarnx("at least one argument expected");
+		usage();
+		return;
+	}
+
+	/* remote files may be on another session */
+	if (!switchsession(argv, &prev))
+		return;
+
+	/* what was printed before must come first */
+	(void)fflush(stdout);
+	for (i = 0; i < argc && !int_signal; ++i) {
+		if ((fd = dup(STDOUT_FILENO)) < 0) {
+			cmdwarn("standard output");
+			break;
+		}
+		if (!transfer_get_fd(argv[i], fd))	/* closes fd */
+			break;
+	}
+
+	if (prev != NULL)
+		(void)smb_setsession(prev);
+}
+
+
 static void
 cmd_cd(int argc, char **argv)
 {
@@ -243,30 +354,146 @@ cmd_chmod(int argc, char **argv)
 static void
 cmd_close(int argc, char **argv)
 {
-	if (argc != 1)
-		cmdwarnx("ignoring arguments");
+	const char     *errmsg;
 
-	/* always succeeds */
-	(void)smb_disconnect();
+	if (argc > 2) {
+		cmdwarnx("wrong number of arguments");
+		usage();
+		return;
+	}
+
+	/* note that when argc is 1 then argv[1] is NULL */
+	errmsg = session_close(argv[1]);
+	if (errmsg != NULL)
+		cmdwarnx("%s", errmsg);
 }
 
 
 static void
-cmd_get(int argc, char **argv)
+cmd_cp(int argc, char **argv)
 {
 	int	ch;
 	int	copt = 0, fopt = 0, ropt = 0, sopt = 0;
+	int	exist, ok;
+	char   *last, *path;
+	SmbSession     *prev, *dest;
+
+	eoptind = 1;
+	eoptreset = 1;  /* clean egetopt state */
+	while ((ch = egetopt(argc, argv, "cfrs")) != -1)
+		switch (ch) {
+		case 'c':
+			copt = 1;
+			break;
+		case 'f':
+			fopt = 1;
+			break;
+		case 'r':
+			ropt = 1;
+			break;
+		case 's':
+			sopt = 1;
+			break;
+		default:
+			usage();
+			return;
+		}
+
+	argc -= eoptind;
+	argv += eoptind;
+
+	if (argc < 2) {
+		cmdwarnx("at least two arguments expected");
+		usage();
+		return;
+	}
+
+	if ((copt && fopt) || (copt && sopt) || (fopt && sopt)) {
+		cmdwarnx("illegal combination of options");
+		usage();
+		return;
+	}
+
+	exist = getvariable_onexist("onexist");
+	if (copt) exist = VAR_RESUME;
+	if (fopt) exist = VAR_OVERWRITE;
+	if (sopt) exist = VAR_SKIP;
+
+	/* the destination may be on another session than the files */
+	last = argv[argc - 1];
+	if ((path = session_path(last, &dest)) == NULL) {
+		cmdwarnx("%s: no such session", last);
+		return;
+	}
+	memmove(last, path, strlen(path) + 1);
+	if (dest == NULL)
+		dest = smb_getsession();
+
+	argv[argc - 1] = NULL;
+	ok = switchsession(argv, &prev);
+	argv[argc - 1] = last;
+	if (!ok)
+		return;
+
+	copyall(argc, argv, (dest != smb_getsession()) ? dest : NULL, &exist,
+	    ropt);
+
+	if (prev != NULL)
+		(void)smb_setsession(prev);
+}
+
+
+static void
+cmd_find(int argc, char **argv)
+{
+	int	ch;
+	int	lopt = 0;
+
+	eoptind = 1;
+	eoptreset = 1;  /* clean egetopt state */
+	while ((ch = egetopt(argc, argv, "l")) != -1)
+		switch (ch) {
+		case 'l':
+			lopt = 1;
+			break;
+		default:
+			usage();
+			return;
+		}
+
+	argc -= eoptind;
+	argv += eoptind;
+
+	if (argc != 1 && argc != 2) {
+		cmdwarnx("wrong number of arguments");
+		usage();
+		return;
+	}
+
+	/* note that when argc is 1 then argv[1] is NULL */
+	index_find(argv[0], argv[1], lopt);
+}
+
+
+static void
+cmd_get(int argc, char **argv)
+{
+	int	ch;
+	int	copt = 0, dopt = 0, fopt = 0, ropt = 0, sopt = 0;
 	char   *oarg = NULL;
-	int	exist;
-	struct stat st;
+	int	exist, fd;
+	SmbSession     *prev;
 
 	eoptind = 1;
 	eoptreset = 1;  /* clean egetopt state */
-	while ((ch = egetopt(argc, argv, "cfo:rs")) != -1)
+	while ((ch = egetopt(argc, argv, "cdfo:rs")) != -1)
 		switch (ch) {
 		case 'c':
 			copt = 1;
 			break;
+		case 'd':
+			dopt = 1;
+			break;
 		case 'f':
 			fopt = 1;
 			break;
@@ -293,7 +520,7 @@ cmd_get(int argc, char **argv)
 		return;
 	}
 
-	if ((copt && fopt) || (copt && sopt) || (fopt && sopt) ||
+	if (copt + dopt + fopt + sopt > 1 ||
 	    (oarg != NULL && argc != 1) || (ropt && (oarg != NULL))) {
 		cmdwarnx("illegal combination of options");
 		usage();
@@ -302,46 +529,33 @@ cmd_get(int argc, char **argv)
 
 	exist = getvariable_onexist("onexist");
 	if (copt) exist = VAR_RESUME;
+	if (dopt) exist = VAR_DELTA;
 	if (fopt) exist = VAR_OVERWRITE;
 	if (sopt) exist = VAR_SKIP;
 	/*
 	 * Note that a pointer to exist is passed to transfer_get below so
-	 * that `{overwrite,resume,skip} all' is kept for all arguments in argv.
+	 * that `{overwrite,resume,delta,skip} all' is kept for all arguments
+	 * in argv.
 	 */
 
-	/* if output file has been specified, get the only argument to it */
-	if (oarg != NULL) {
-		transfer_get(argv[0], oarg, &exist, 0);
+	/* remote files may be on another session */
+	if (!switchsession(argv, &prev))
 		return;
-	}
 
-	/* retrieve each argument */
-	for (;!int_signal && *argv != NULL; ++argv) {
-		/* get attributes to check if it is a file */
-		if (smb_stat(*argv, &st) != 0) {
-			cmdwarn("%s", *argv);
-			continue;
-		}
+	/* if output file has been specified, get the only argument to it */
+	if (oarg != NULL && streql(oarg, "-")) {
+		(void)fflush(stdout);
+		if ((fd = dup(STDOUT_FILENO)) < 0)
+			cmdwarn("standard output");
+		else
+			(void)transfer_get_fd(argv[0], fd);
+	} else if (oarg != NULL)
+		transfer_get(argv[0], oarg, &exist, 0);
+	else
+		getall(argv, &exist, ropt);
 
-		if (!S_ISDIR(st.st_mode)) {
-			/* files do not need directory part locally */
-			if ((oarg = strrchr(*argv, '/')) == NULL)
-				oarg = *argv;
-			else
-				++oarg;
-		} else if (!ropt) {
-			cmdwarnx("cannot retrieve directory non-recursively");
-			continue;
-		} else if (**argv == '/' || streql(*argv, "..") ||
-		    strncmp(*argv, "../", 3) == 0) {
-			/* retrieve to `.' locally */
-			oarg = ".";
-		} else {
-			/* retrieve to same directory locally */
-			oarg = *argv;
-		}
-		transfer_get(*argv, oarg, &exist, ropt);
-	}
+	if (prev != NULL)
+		(void)smb_setsession(prev);
 }
 
 
@@ -383,6 +597,16 @@ cmd_help(int argc, char **argv)
 }
 
 
+static void
+cmd_index(int argc, char **argv)
+{
+	if (argc != 1)
+		cmdwarnx("ignoring arguments");
+
+	(void)index_update();
+}
+
+
 static void
 cmd_lcd(int argc, char **argv)
 {
@@ -644,12 +868,16 @@ cmd_open(int argc, char **argv)
 	int	Popt = 0;
 	char	passinput[SMB_PASS_MAXLEN + 1];
 	const char     *host, *share, *user = NULL, *pass = NULL, *path = NULL;
+	const char     *name = NULL;
 	const char     *errmsg;
 
 	eoptind = 1;
 	eoptreset = 1;  /* clean egetopt state */
-	while ((ch = egetopt(argc, argv, "p:Pu:")) != -1)
+	while ((ch = egetopt(argc, argv, "n:p:Pu:")) != -1)
 		switch (ch) {
+		case 'n':
+			name = eoptarg;
+			break;
 		case 'p':
 			pass = eoptarg;
 			break;
@@ -667,6 +895,12 @@ cmd_open(int argc, char **argv)
 	argc -= eoptind;
 	argv += eoptind;
 
+	/* without a name, only one session can be open */
+	if (name == NULL && connected) {
+		cmdwarnx("already connected");
+		return;
+	}
+
 	if (argc <= 1) {
 		cmdwarnx("need hostname and share");
 		usage();
@@ -698,7 +932,7 @@ cmd_open(int argc, char **argv)
 	path = argv[2];         /* argv[2] could be NULL */
 
 	/* ready for actual opening of connection */
-	errmsg = smb_connect(host, share, user, pass, path);
+	errmsg = session_open(name, host, share, user, pass, path);
 	if (errmsg != NULL)
 		cmdwarnx("%s", errmsg);
 }
@@ -707,11 +941,7 @@ cmd_open(int argc, char **argv)
 static void
 cmd_page(int argc, char **argv)
 {
-	const char *pager;
-	char   *file;
-	char   *tmpdir;
-	size_t	filelen;
-	char   *pagecmd;
+	FILE   *fp;
 	int	fd;
 
 	eoptind = 1;
@@ -730,37 +960,20 @@ cmd_page(int argc, char **argv)
 		return;
 	}
 
-	/* make template, try using $TMPDIR, fall back to /tmp */
-	tmpdir = (getenv("TMPDIR") != NULL) ? getenv("TMPDIR") : "/tmp";
-	filelen = strlen(tmpdir) + strlen("/samblah-XXXXXX");
-	file = xmalloc(filelen + 1);
-	strcpy(file, tmpdir);
-	strcat(file, "/samblah-XXXXXX");
-
-	fd = mkstemp(file);
-	if (fd == -1) {
-		cmdwarn("temporary file");
-		free(file);
+	/* the pager shows the file as it arrives, quitting it stops retrieving */
+	(void)fflush(stdout);
+	if ((fp = popen(getvariable_string("pager"), "w")) == NULL) {
+		cmdwarn("starting pager");
 		return;
 	}
+	if ((fd = dup(fileno(fp))) < 0)
+		cmdwarn("pipe to pager");
+	else
+		(void)transfer_get_fd(argv[0], fd);    /* fd will be always closed */
 
-	if (!transfer_get_fd(argv[0], fd)) {    /* fd will be always closed */
-		(void)unlink(file);
-		free(file);
-		return;         /* error message has already been printed */
-	}
-
-	pager = getvariable_string("pager");
-	pagecmd = xmalloc(strlen(pager) + 1 + filelen + 1);
-	strcpy(pagecmd, getvariable_string("pager"));
-	strcat(pagecmd, " ");
-	strcat(pagecmd, file);
-	(void)system(pagecmd);
-
-	if (unlink(file) != 0)
-		cmdwarn("removing %s", file);
-	free(pagecmd);
-	free(file);
+	/* the pager exits when it read everything or the user quit */
+	if (pclose(fp) == -1)
+		cmdwarn("pager");
 }
 
 
@@ -768,18 +981,22 @@ static void
 cmd_put(int argc, char **argv)
 {
 	int	ch;
-	int	copt = 0, fopt = 0, ropt = 0, sopt = 0;
-	char   *oarg = NULL;
-	int	exist;
-	struct stat st;
+	int	copt = 0, dopt = 0, fopt = 0, ropt = 0, sopt = 0;
+	char   *oarg = NULL, *targ = NULL;
+	char   *remote[2];
+	int	exist, fd;
+	SmbSession     *prev;
 
 	eoptind = 1;
 	eoptreset = 1;  /* clean egetopt state */
-	while ((ch = egetopt(argc, argv, "cfo:rs")) != -1)
+	while ((ch = egetopt(argc, argv, "cdfo:rst:")) != -1)
 		switch (ch) {
 		case 'c':
 			copt = 1;
 			break;
+		case 'd':
+			dopt = 1;
+			break;
 		case 'f':
 			fopt = 1;
 			break;
@@ -792,6 +1009,9 @@ cmd_put(int argc, char **argv)
 		case 's':
 			sopt = 1;
 			break;
+		case 't':
+			targ = eoptarg;
+			break;
 		default:
 			usage();
 			return;
@@ -803,9 +1023,10 @@ cmd_put(int argc, char **argv)
 		return;
 	}
 
-	if ((copt && fopt) || (copt && sopt) || (fopt && sopt) ||
+	if (copt + dopt + fopt + sopt > 1 ||
 	    (oarg != NULL && argc - eoptind != 1) ||
-	    (ropt && (oarg != NULL))) {
+	    (ropt && (oarg != NULL)) ||
+	    (targ != NULL && (ropt || dopt || oarg != NULL))) {
 		cmdwarnx("illegal combination of options");
 		usage();
 		return;
@@ -816,46 +1037,36 @@ cmd_put(int argc, char **argv)
 
 	exist = getvariable_onexist("onexist");
 	if (copt) exist = VAR_RESUME;
+	if (dopt) exist = VAR_DELTA;
 	if (fopt) exist = VAR_OVERWRITE;
 	if (sopt) exist = VAR_SKIP;
 	/*
 	 * Note that a pointer to exist is passed to transfer_get below so
-	 * that `{overwrite,resume,skip} all' is kept for all arguments in argv
+	 * that `{overwrite,resume,delta,skip} all' is kept for all arguments
+	 * in argv
 	 */
 
-	/* if output file has been specified, `put' the only argument to it */
-	if (oarg != NULL) {
-		transfer_put(argv[0], oarg, &exist, 0);
+	/* the remote file may be on another session */
+	remote[0] = oarg;
+	remote[1] = NULL;
+	if (oarg != NULL && !switchsession(remote, &prev))
 		return;
-	}
 
-	/* `put' each argument */
-	for (;*argv != NULL && !int_signal; ++argv) {
-		/* get the attributes for check for file or directory */
-		if (stat(*argv, &st) != 0) {
-			cmdwarn("%s", *argv);
-			continue;
-		}
+	/* if output file has been specified, `put' the only argument to it */
+	if (oarg != NULL && streql(argv[0], "-")) {
+		if ((fd = dup(STDIN_FILENO)) < 0)
+			cmdwarn("standard input");
+		else
+			(void)transfer_put_fd(fd, oarg, exist);
+	} else if (oarg != NULL)
+		transfer_put(argv[0], oarg, &exist, 0);
+	else if (targ != NULL)
+		putmany(argv, targ, &exist);
+	else
+		putall(argv, &exist, ropt);
 
-		if (!S_ISDIR(st.st_mode)) {
-			/* files do not need directory part */
-			if ((oarg = strrchr(*argv, '/')) == NULL)
-				oarg = *argv;
-			else
-				++oarg;
-		} else if (!ropt) {
-			cmdwarnx("cannot put directory non-recursively");
-			continue;
-		} else if (**argv == '/' || streql(*argv, "..") ||
-		    strncmp(*argv, "../", 3) == 0) {
-			/* retrieve to `.' locally */
-			oarg = ".";
-		} else  {
-			/* retrieve to same directory locally */
-			oarg = *argv;
-		}
-		transfer_put(*argv, oarg, &exist, ropt);
-	}
+	if (oarg != NULL && prev != NULL)
+		(void)smb_setsession(prev);
 }
 
 
@@ -882,6 +1093,22 @@ cmd_quit(int argc, char **argv)
 }
 
 
+static void
+cmd_refresh(int argc, char **argv)
+{
+	int	i;
+
+	if (argc == 1) {
+		(void)smb_refresh(NULL);	/* always succeeds */
+		return;
+	}
+
+	for (i = 1; i < argc; ++i)
+		if (smb_refresh(argv[i]) != 0)
+			cmdwarn("%s", argv[i]);
+}
+
+
 static void
 cmd_rm(int argc, char **argv)
 {
@@ -984,6 +1211,27 @@ cmd_umask(int argc, char **argv)
 }
 
 
+static void
+cmd_use(int argc, char **argv)
+{
+	const char     *errmsg;
+
+	switch (argc) {
+	case 1:
+		session_list();
+		break;
+	case 2:
+		errmsg = session_use(argv[1]);
+		if (errmsg != NULL)
+			cmdwarnx("%s: %s", argv[1], errmsg);
+		break;
+	default:
+		cmdwarnx("wrong number of arguments");
+		usage();
+	}
+}
+
+
 static void
 cmd_version(int argc, char **argv)
 {
@@ -991,3 +1239,252 @@ cmd_version(int argc, char **argv)
 		cmdwarnx("ignoring arguments");
 	printf("samblah-%s\n", VERSION);
 }
+
+
+/*
+ * Retrieves each of the remote files in argv to the current local directory,
+ * recursively when ropt is set.  See cmd_get.
+ */
+static void
+getall(char **argv, int *exist, int ropt)
+{
+	char   *oarg;
+	struct stat st;
+
+	/* retrieve each argument, in parallel when so configured */
+	transfer_pool_start();
+	for (;!int_signal && *argv != NULL; ++argv) {
+		/* get attributes to check if it is a file, globbing may know */
+		if (globmatch(*argv, &st) == GLM_NONE && smb_stat(*argv, &st) != 0) {
+			cmdwarn("%s", *argv);
+			continue;
+		}
+
+		if (!S_ISDIR(st.st_mode)) {
+			/* files do not need directory part locally */
+			if ((oarg = strrchr(*argv, '/')) == NULL)
+				oarg = *argv;
+			else
+				++oarg;
+		} else if (!ropt) {
+			cmdwarnx("cannot retrieve directory non-recursively");
+			continue;
+		} else if (**argv == '/' || streql(*argv, "..") ||
+		    strncmp(*argv, "../", 3) == 0) {
+			/* retrieve to `.' locally */
+			oarg = ".";
+		} else {
+			/* retrieve to same directory locally */
+			oarg = *argv;
+		}
+		transfer_get(*argv, oarg, exist, ropt);
+	}
+	transfer_pool_finish();
+}
+
+
+/*
+ * Uploads each of the local files in argv to the current remote directory,
+ * recursively when ropt is set.  See cmd_put.
+ */
+static void
+putall(char **argv, int *exist, int ropt)
+{
+	char   *oarg;
+	struct stat st;
+
+	/* `put' each argument, in parallel when so configured */
+	transfer_pool_start();
+	for (;*argv != NULL && !int_signal; ++argv) {
+		/* get the attributes for check for file or directory */
+		if (globmatch(*argv, &st) == GLM_NONE && stat(*argv, &st) != 0) {
+			cmdwarn("%s", *argv);
+			continue;
+		}
+
+		if (!S_ISDIR(st.st_mode)) {
+			/* files do not need directory part */
+			if ((oarg = strrchr(*argv, '/')) == NULL)
+				oarg = *argv;
+			else
+				++oarg;
+		} else if (!ropt) {
+			cmdwarnx("cannot put directory non-recursively");
+			continue;
+		} else if (**argv == '/' || streql(*argv, "..") ||
+		    strncmp(*argv, "../", 3) == 0) {
+			/* retrieve to `.' locally */
+			oarg = ".";
+		} else  {
+			/* retrieve to same directory locally */
+			oarg = *argv;
+		}
+		transfer_put(*argv, oarg, exist, ropt);
+	}
+	transfer_pool_finish();
+}
+
+
+/*
+ * Uploads each of the local files in argv to the working directory of the
+ * sessions named in names, separated by commas, reading each file once.
+ * See cmd_put.
+ */
+static void
+putmany(char **argv, char *names, int *exist)
+{
+	List   *list;
+	SmbSession    **dests;
+	char   *name, *comma;
+	int	i, j, n;
+
+	list = list_new();
+	for (name = names; name != NULL; name = comma) {
+		if ((comma = strchr(name, ',')) != NULL)
+			*comma++ = '\0';
+		list_add(list, name);
+	}
+
+	n = list_count(list);
+	dests = xmalloc(sizeof dests[0] * n);
+	for (i = 0; i < n; ++i) {
+		name = list_elem(list, i);
+		if ((dests[i] = session_get(name)) == NULL) {
+			cmdwarnx("%s: no such session", name);
+			goto out;
+		}
+		for (j = 0; j < i; ++j)
+			if (dests[j] == dests[i]) {
+				cmdwarnx("%s: session given twice", name);
+				goto out;
+			}
+	}
+
+	for (; *argv != NULL && !int_signal; ++argv)
+		transfer_put_many(*argv, dests, (char **)list_elems(list), n,
+		    exist);
+
+out:
+	free(dests);
+	/* the names point into names, only free the List container */
+	list_free_func(list, NULL);
+}
+
+
+/*
+ * Copies the remote files in argv, argc of them, to the last one,
+ * recursively when ropt is set.  The last is on session dest, or on the
+ * current session when dest is NULL.  When the last is an existing
+ * directory the files are copied into it, otherwise there must be only one
+ * file to copy.  See cmd_cp.
+ */
+static void
+copyall(int argc, char **argv, SmbSession *dest, int *exist, int ropt)
+{
+	char   *last, *name;
+	char	sbuf[SMB_PATH_MAXLEN + 1], dbuf[SMB_PATH_MAXLEN + 1];
+	int	todir, sameshare;
+	Str    *dpath;
+	struct stat st;
+	SmbSession     *s;
+
+	s = smb_getsession();
+	last = argv[argc - 1];
+	if (dest == NULL)
+		todir = (globmatch(last, &st) != GLM_NONE ||
+		    smb_stat(last, &st) == 0) && S_ISDIR(st.st_mode);
+	else
+		todir = smbs_stat(dest, last, &st) == 0 && S_ISDIR(st.st_mode);
+	if (!todir && argc > 2) {
+		cmdwarnx("last argument must be a directory");
+		return;
+	}
+
+	/* two sessions may well be on the same share */
+	sameshare = dest == NULL ||
+	    (streql(smbs_gethost(s), smbs_gethost(dest)) &&
+	    streql(smbs_getshare(s), smbs_getshare(dest)));
+
+	/* copy each argument, in parallel when so configured */
+	transfer_pool_start();
+	for (; !int_signal && argc > 1; ++argv, --argc) {
+		if (globmatch(*argv, &st) == GLM_NONE && smb_stat(*argv, &st) != 0) {
+			cmdwarn("%s", *argv);
+			continue;
+		}
+		if (S_ISDIR(st.st_mode) && !ropt) {
+			cmdwarnx("cannot copy directory non-recursively");
+			continue;
+		}
+
+		dpath = str_new(last);
+		if (todir) {
+			if ((name = strrchr(*argv, '/')) == NULL)
+				name = *argv;
+			else
+				++name;
+			str_putcharptr(dpath, "/");
+			str_putcharptr(dpath, name);
+		}
+
+		/*
+		 * a file copied onto itself would be truncated first, a
+		 * directory copied into itself would never be finished
+		 */
+		if (sameshare && smbs_abspath(s, *argv, sbuf) == 0 &&
+		    smbs_abspath((dest != NULL) ? dest : s, str_charptr(dpath),
+		    dbuf) == 0 &&
+		    (streql(sbuf, dbuf) || (S_ISDIR(st.st_mode) &&
+		    strncmp(sbuf, dbuf, strlen(sbuf)) == 0 &&
+		    (dbuf[strlen(sbuf)] == '/' || streql(sbuf, "/"))))) {
+			cmdwarnx("cannot copy %s onto or into itself", *argv);
+			str_free(dpath); dpath = NULL;
+			continue;
+		}
+
+		transfer_copy(*argv, dest, str_charptr(dpath), exist, ropt);
+		str_free(dpath); dpath = NULL;
+	}
+	transfer_pool_finish();
+}
+
+
+/*
+ * Strips the session names (see session_path) from the remote paths in the
+ * NULL-terminated paths, which must all be on the same session, and makes
+ * that session the current one.  A path without a session name is on the
+ * current session.  The previous session is stored in prev,
+ * NULL when the current session did not change.  On error a warning is
+ * printed and 0 is returned.
+ */
+static int
+switchsession(char **paths, SmbSession **prev)
+{
+	SmbSession     *s, *ps;
+	char   *path;
+
+	s = NULL;
+	for (; *paths != NULL; ++paths) {
+		if ((path = session_path(*paths, &ps)) == NULL) {
+			cmdwarnx("%s: no such session", *paths);
+			return 0;
+		}
+		if (ps == NULL)
+			ps = smb_getsession();
+		if (s != NULL && ps != s) {
+			cmdwarnx("files must be on the same session");
+			return 0;
+		}
+		s = ps;
+
+		/* the arguments are freed by the caller, strip in place */
+		memmove(*paths, path, strlen(path) + 1);
+	}
+
+	*prev = (s != NULL && s != smb_getsession()) ? smb_setsession(s) : NULL;
+
+	/* the matches of globbing were found on the previous session */
+	if (*prev != NULL)
+		globmatch_clear();
+	return 1;
+}
@@ -8,11 +8,46 @@ enum completion_type {
 	CMP_REMOTE      /* remote file completion */
 };
 
+enum {
+	PREFETCH_MAXDIRS = 8	/* directories waiting to be prefetched */
+};
+
+typedef struct Prefetch Prefetch;
+
+/*
+ * Lists remote directories in the background, so completion finds their
+ * listings in the cache.  The prefetcher thread uses a clone of the session
+ * it was started for and is replaced when another session or share is
+ * used.  Paths are absolute, the clone does not follow cd.  Each queued
+ * directory has a sequence number, done is that of the last one listed.
+ */
+struct Prefetch {
+	pthread_mutex_t lock;
+	pthread_cond_t	cond;
+	SmbSession     *s;
+	char	       *dirs[PREFETCH_MAXDIRS];
+	unsigned long	seqs[PREFETCH_MAXDIRS];
+	int	ndirs;
+	char	       *busy;		/* directory being listed */
+	unsigned long	busyseq;
+	unsigned long	seq;		/* last sequence number given out */
+	unsigned long	done;
+	int	stop;			/* set when replaced, thread frees it */
+};
+
+
+static Prefetch *prefetch;
+
 
 static char    *commonlead(const char *, const char *);
 static List    *cmdmatch(const char *);
 static List    *filematch(const char *, enum completion_type);
 static enum completion_type     cmptype(const char *);
+static int      waitlisting(const char *, List *);
+static unsigned long    prefetch_add(const char *);
+static int      prefetch_wait(unsigned long, int);
+static void     prefetch_stop(void);
+static void    *prefetcher(void *);
 
 
 /*
@@ -219,6 +254,13 @@ filematch(const char *token, enum completion_type type)
 	str_putcharptr(pattern, "*");
 
 	remoteglobbing = (type == CMP_REMOTE);
+
+	/* do not keep the user waiting for a slow directory listing */
+	if (remoteglobbing && !waitlisting(token, tokens)) {
+		str_free(pattern);
+		return tokens;
+	}
+
 	if (tokenmatch(str_charptr(pattern), tokens, remoteglobbing) != GLB_OK) {
 		list_free(tokens);
 		tokens = list_new();
@@ -229,6 +271,282 @@ filematch(const char *token, enum completion_type type)
 }
 
 
+/*
+ * Makes sure the remote directory token is in will be completed from a
+ * listing in the cache, by having it prefetched and waiting for that for
+ * at most `completewait' milliseconds.  When the directory is not in the
+ * cache but in the index, matches are taken from the index right away and
+ * added to matches.  Returns zero when matches were generated that way or
+ * when waiting took too long, the user is told so.  When the directory
+ * cannot be cached, completion must list it itself and non-zero is
+ * returned.
+ */
+static int
+waitlisting(const char *token, List *matches)
+{
+	Pattern	       *pat;
+	const char     *base;
+	char   *dir, *lead, *last, *slash;
+	unsigned long	seq;
+	int	ttl, found;
+
+	/* the directory part of token, which is escaped */
+	dir = xstrdup(token);
+	if ((slash = strrchr(dir, '/')) == NULL)
+		strcpy(dir, ".");
+	else
+		slash[slash == dir ? 1 : 0] = '\0';
+
+	/* patterns have to be matched first */
+	if (strpbrk(dir, "*?[") != NULL) {
+		free(dir);
+		return 1;
+	}
+	unescape(dir);
+
+	ttl = getvariable_int("cachettl");
+	if (ttl > 0 && smb_listed(dir)) {
+		free(dir);
+		return 1;
+	}
+	seq = (ttl > 0) ? prefetch_add(dir) : 0;
+
+	/* the index answers at once, meanwhile the listing is fetched */
+	base = strrchr(token, '/');
+	base = (base == NULL) ? token : base + 1;
+	lead = xstrdup(token);
+	lead[base - token] = '\0';
+	unescape(lead);
+	last = xmalloc(strlen(base) + 2);
+	strcpy(last, base);
+	strcat(last, "*");
+	pat = pattern_compile(last);
+	found = index_list(dir, pat, lead, matches);
+	pattern_free(pat);
+	free(last);
+	free(lead);
+	free(dir);
+	if (found)
+		return 0;
+
+	if (seq == 0 || prefetch_wait(seq, getvariable_int("completewait")))
+		return 1;
+	fputs("\n(listing...)\n", rl_outstream);
+	rl_on_new_line();
+	return 0;
+}
+
+
+/*
+ * Has the remote directory dir listed in the background, so its listing is
+ * in the cache when the user starts completing.  Does nothing when not
+ * connected or nothing is cached.
+ */
+void
+complete_prefetch(const char *dir)
+{
+	if (getvariable_int("cachettl") == 0 || smb_listed(dir))
+		return;
+	(void)prefetch_add(dir);
+}
+
+
+/*
+ * Queues dir to be listed by the prefetcher, which is started when
+ * necessary.  A directory already queued is not queued again, when the
+ * queue is full the oldest directory is dropped.  Returns the sequence
+ * number of dir for prefetch_wait, 0 when there is no prefetcher.
+ */
+static unsigned long
+prefetch_add(const char *dir)
+{
+	SmbSession     *cur;
+	Prefetch       *p;
+	pthread_t	thread;
+	sigset_t	set, oset;
+	char	abspath[SMB_PATH_MAXLEN + 1];
+	char	       *path;
+	unsigned long	seq;
+	int	i;
+
+	cur = smb_getsession();
+	if (!smbs_connected(cur))
+		return 0;
+
+	/* the prefetcher is bound to its share */
+	if (prefetch != NULL && !smbs_samecache(prefetch->s, cur))
+		prefetch_stop();
+
+	if (prefetch == NULL) {
+		p = xmalloc(sizeof (Prefetch));
+		if ((p->s = smbs_clone(cur)) == NULL) {
+			free(p);
+			return 0;
+		}
+		(void)pthread_mutex_init(&p->lock, NULL);
+		(void)pthread_cond_init(&p->cond, NULL);
+		p->ndirs = 0;
+		p->busy = NULL;
+		p->busyseq = p->seq = p->done = 0;
+		p->stop = 0;
+
+		/* signals are handled by this thread */
+		sigemptyset(&set);
+		sigaddset(&set, SIGINT);
+		sigaddset(&set, SIGWINCH);
+		sigaddset(&set, SIGALRM);
+		(void)pthread_sigmask(SIG_BLOCK, &set, &oset);
+		i = pthread_create(&thread, NULL, prefetcher, p);
+		(void)pthread_sigmask(SIG_SETMASK, &oset, NULL);
+		if (i != 0) {
+			smbs_free(p->s);
+			(void)pthread_mutex_destroy(&p->lock);
+			(void)pthread_cond_destroy(&p->cond);
+			free(p);
+			return 0;
+		}
+		(void)pthread_detach(thread);
+		prefetch = p;
+	}
+	p = prefetch;
+
+	/* relative to the working directory now, not that of the clone */
+	if (smbs_abspath(cur, dir, abspath) != 0)
+		return 0;
+	path = xstrdup(abspath);
+
+	(void)pthread_mutex_lock(&p->lock);
+	seq = 0;
+	if (p->busy != NULL && streql(p->busy, path))
+		seq = p->busyseq;
+	for (i = 0; seq == 0 && i < p->ndirs; ++i)
+		if (streql(p->dirs[i], path))
+			seq = p->seqs[i];
+	if (seq == 0) {
+		if (p->ndirs == PREFETCH_MAXDIRS) {
+			free(p->dirs[0]);
+			--p->ndirs;
+			memmove(&p->dirs[0], &p->dirs[1], sizeof p->dirs[0] * p->ndirs);
+			memmove(&p->seqs[0], &p->seqs[1], sizeof p->seqs[0] * p->ndirs);
+		}
+		p->dirs[p->ndirs] = path;
+		p->seqs[p->ndirs] = seq = ++p->seq;
+		++p->ndirs;
+		path = NULL;
+		(void)pthread_cond_broadcast(&p->cond);
+	}
+	(void)pthread_mutex_unlock(&p->lock);
+
+	free(path);
+	return seq;
+}
+
+
+/*
+ * Waits at most msec milliseconds for the prefetcher to have listed the
+ * directory with sequence number seq.  Returns non-zero when it did.
+ */
+static int
+prefetch_wait(unsigned long seq, int msec)
+{
+	Prefetch       *p;
+	struct timeval	now;
+	struct timespec	ts;
+	int	done;
+
+	p = prefetch;
+	(void)gettimeofday(&now, NULL);
+	ts.tv_sec = now.tv_sec + msec / 1000;
+	ts.tv_nsec = now.tv_usec * 1000 + (msec % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+	}
+
+	(void)pthread_mutex_lock(&p->lock);
+	while (p->done < seq && !int_signal &&
+	    pthread_cond_timedwait(&p->cond, &p->lock, &ts) == 0)
+		;
+	done = p->done >= seq;
+	(void)pthread_mutex_unlock(&p->lock);
+	return done;
+}
+
+
+/*
+ * Lets the prefetcher quit once it has listed the directory it is busy
+ * with, it frees itself.
+ */
+static void
+prefetch_stop(void)
+{
+	(void)pthread_mutex_lock(&prefetch->lock);
+	prefetch->stop = 1;
+	(void)pthread_cond_broadcast(&prefetch->cond);
+	(void)pthread_mutex_unlock(&prefetch->lock);
+	prefetch = NULL;
+}
+
+
+/*
+ * Start routine of the prefetcher.  Lists queued directories, after
+ * stat'ing the directories leading to them, since completion looks at
+ * those too.  Reading a directory to its end stores it in the cache.
+ */
+static void *
+prefetcher(void *arg)
+{
+	Prefetch       *p;
+	char	       *slash;
+	struct stat	st;
+	int	dh, i;
+
+	p = (Prefetch *)arg;
+
+	(void)pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->stop && p->ndirs == 0)
+			(void)pthread_cond_wait(&p->cond, &p->lock);
+		if (p->stop)
+			break;
+
+		p->busy = p->dirs[0];
+		p->busyseq = p->seqs[0];
+		--p->ndirs;
+		memmove(&p->dirs[0], &p->dirs[1], sizeof p->dirs[0] * p->ndirs);
+		memmove(&p->seqs[0], &p->seqs[1], sizeof p->seqs[0] * p->ndirs);
+		(void)pthread_mutex_unlock(&p->lock);
+
+		for (slash = strchr(p->busy + 1, '/'); slash != NULL;
+		    slash = strchr(slash + 1, '/')) {
+			*slash = '\0';
+			(void)smbs_stat(p->s, p->busy, &st);
+			*slash = '/';
+		}
+		if ((dh = smbs_opendir(p->s, p->busy)) >= 0) {
+			while (smbs_readdir(p->s, dh) != NULL)
+				;
+			(void)smbs_closedir(p->s, dh);
+		}
+
+		(void)pthread_mutex_lock(&p->lock);
+		free(p->busy);
+		p->busy = NULL;
+		p->done = p->busyseq;
+		(void)pthread_cond_broadcast(&p->cond);
+	}
+	(void)pthread_mutex_unlock(&p->lock);
+
+	for (i = 0; i < p->ndirs; ++i)
+		free(p->dirs[i]);
+	smbs_free(p->s);
+	(void)pthread_mutex_destroy(&p->lock);
+	(void)pthread_cond_destroy(&p->cond);
+	free(p);
+	return NULL;
+}
+
+
 /*
  * Determines which completion to do based on command.
  */
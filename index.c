@@ -0,0 +1,668 @@
+/* $Id$ */
+
+/*
+ * The index of a share is a file in $HOME/.samblah/host/share.index with
+ * the path, type, size and modification time of everything on the share,
+ * as of the last `index' command.  It is memory-mapped, so find and
+ * completion use it without reading it first.  The entries are sorted on
+ * path, with `/' sorting before any other character, so everything below
+ * a directory directly follows it.  Updating the index only lists the
+ * directories whose modification time changed since, the entries of the
+ * others are taken from the old index.
+ */
+
+#include "samblah.h"
+
+#define INDEX_MAGIC	"samblahI"
+#define INDEX_SUFFIX	".index"
+
+typedef struct Index Index;
+typedef struct Indexhdr Indexhdr;
+typedef struct Indexent Indexent;
+typedef struct Build Build;
+typedef struct Builddir Builddir;
+
+enum {
+	INDEX_VERSION = 1,
+	INDEX_FILE = 1,		/* types of entries */
+	INDEX_DIR = 2
+};
+
+/* start of the file, followed by the entries and then the paths */
+struct Indexhdr {
+	char	magic[8];
+	uint32_t	version;
+	uint32_t	count;		/* number of entries */
+	uint64_t	names;		/* offset of the paths in the file */
+	int64_t		built;		/* time the index was made */
+};
+
+struct Indexent {
+	int64_t		size;
+	int64_t		mtime;
+	uint64_t	path;		/* offset from the paths, nul-terminated */
+	uint32_t	type;
+	uint32_t	unused;
+};
+
+/* a mapped index file */
+struct Index {
+	char   *file;
+	void   *map;
+	size_t	len;
+	const Indexhdr *hdr;
+	const Indexent *ents;
+	const char     *names;
+};
+
+/* an index being made */
+struct Build {
+	Indexent       *ents;
+	size_t	count, max;
+	char   *names;
+	size_t	nameslen, namesmax;
+	int	listed;			/* directories read from the server */
+	int	kept;			/* directories taken from the old index */
+	int	files;
+};
+
+/* a directory waiting to be indexed */
+struct Builddir {
+	char   *path;
+	time_t	mtime;
+};
+
+
+static Index   *loaded;		/* index of the current share, if any */
+static const char      *sortnames;	/* for entcmp */
+
+
+static char    *indexfile(void);
+static Index   *index_load(void);
+static Index   *index_map(const char *);
+static void     index_unmap(Index *);
+static const char      *entpath(const Index *, size_t);
+static size_t   lowerbound(const Index *, const char *);
+static long     lookup(const Index *, const char *);
+static size_t   skipsubtree(const Index *, size_t);
+static int      pathcmp(const char *, const char *);
+static int      entcmp(const void *, const void *);
+static int      hasprefix(const char *, const char *);
+static void     build_add(Build *, const char *, int, off_t, time_t);
+static void     build_dir(Build *, const Index *, Builddir *, List *);
+static void     build_queue(List *, const char *, time_t);
+static int      build_write(Build *, const char *, time_t);
+static int      mkparents(char *);
+static void     printentry(const Index *, size_t, const char *, const char *,
+		    int);
+
+
+/*
+ * Makes or updates the index of the current share.  Only directories
+ * that changed since the last update are listed, for the others only the
+ * directories in them are stat'ed.  On error or interrupt the old index
+ * is kept.  Returns 0 on success, otherwise -1 and a warning is printed.
+ */
+int
+index_update(void)
+{
+	Index  *old;
+	Build	b;
+	List   *queue;
+	Builddir       *d;
+	struct stat	st;
+	char   *file;
+	time_t	now;
+	int	i, ret;
+
+	if ((file = indexfile()) == NULL) {
+		cmdwarnx("$HOME not set, cannot keep an index");
+		return -1;
+	}
+	if (smb_stat("/", &st) != 0) {
+		cmdwarn("/");
+		free(file);
+		return -1;
+	}
+
+	/* directories changed in the second the index was made may change again */
+	now = time(NULL);
+	old = index_load();
+
+	memset(&b, 0, sizeof b);
+	queue = list_new();
+	build_add(&b, "/", INDEX_DIR, (off_t)0, st.st_mtime);
+	build_queue(queue, "/", st.st_mtime);
+
+	/* breadth-first, the queue grows while it is walked */
+	for (i = 0; !int_signal && i < list_count(queue); ++i)
+		build_dir(&b, old, (Builddir *)list_elem(queue, i), queue);
+
+	for (i = 0; i < list_count(queue); ++i) {
+		d = (Builddir *)list_elem(queue, i);
+		free(d->path);
+	}
+	list_free(queue);
+
+	if (int_signal) {
+		ret = -1;
+	} else if (build_write(&b, file, now) != 0) {
+		cmdwarn("writing %s", file);
+		ret = -1;
+	} else {
+		printf("%d directories (%d listed, %d unchanged), %d files\n",
+		    b.listed + b.kept, b.listed, b.kept, b.files);
+		ret = 0;
+	}
+
+	/* use the new index from now on */
+	if (loaded != NULL && ret == 0) {
+		index_unmap(loaded);
+		loaded = NULL;
+	}
+	free(b.ents);
+	free(b.names);
+	free(file);
+	return ret;
+}
+
+
+/*
+ * Prints what the index has below directory dir (the working directory
+ * when NULL) with a name matching pattern, long when lopt is set.
+ */
+void
+index_find(const char *pattern, const char *dir, int lopt)
+{
+	Index  *ix;
+	Pattern        *pat;
+	char	abspath[SMB_PATH_MAXLEN + 1];
+	char	prefix[SMB_PATH_MAXLEN + 2];
+	const char     *lead, *path, *name;
+	long	pos;
+	size_t	i, skip;
+
+	if ((ix = index_load()) == NULL) {
+		cmdwarnx("no index of this share, see index");
+		return;
+	}
+	if (smbs_abspath(smb_getsession(), (dir == NULL) ? "." : dir,
+	    abspath) != 0) {
+		cmdwarn("%s", dir);
+		return;
+	}
+	if ((pos = lookup(ix, abspath)) < 0 ||
+	    ix->ents[pos].type != INDEX_DIR) {
+		cmdwarnx("%s: no such directory in index",
+		    (dir == NULL) ? "." : dir);
+		return;
+	}
+
+	/* paths are printed relative to dir, as it was given */
+	strcpy(prefix, abspath);
+	if (!streql(abspath, "/"))
+		strcat(prefix, "/");
+	lead = (dir == NULL) ? "" : dir;
+	skip = strlen(prefix);
+	if (dir != NULL && dir[strlen(dir) - 1] != '/')
+		--skip;			/* keep the slash */
+
+	pat = pattern_compile(pattern);
+	for (i = (size_t)pos + 1; !int_signal && i < ix->hdr->count; ++i) {
+		path = entpath(ix, i);
+		if (!hasprefix(path, prefix))
+			break;
+		name = strrchr(path, '/') + 1;
+		if (pattern_match(pat, name))
+			printentry(ix, i, lead, path + skip, lopt);
+	}
+	pattern_free(pat);
+}
+
+
+/*
+ * Adds the entries of directory dir matching pat from the index to
+ * matches, as lead followed by the name and a slash for directories.
+ * Returns 0 when there is no index or dir is not in it.
+ */
+int
+index_list(const char *dir, const Pattern *pat, const char *lead,
+    List *matches)
+{
+	Index  *ix;
+	char	abspath[SMB_PATH_MAXLEN + 1];
+	char	prefix[SMB_PATH_MAXLEN + 2];
+	const char     *path, *name;
+	char   *match;
+	long	pos;
+	size_t	i;
+
+	if ((ix = index_load()) == NULL ||
+	    smbs_abspath(smb_getsession(), dir, abspath) != 0 ||
+	    (pos = lookup(ix, abspath)) < 0 || ix->ents[pos].type != INDEX_DIR)
+		return 0;
+
+	strcpy(prefix, abspath);
+	if (!streql(abspath, "/"))
+		strcat(prefix, "/");
+
+	/* the entries of dir, each followed by what is below it */
+	for (i = (size_t)pos + 1; i < ix->hdr->count; i = skipsubtree(ix, i)) {
+		path = entpath(ix, i);
+		if (!hasprefix(path, prefix))
+			break;
+		name = path + strlen(prefix);
+		if (!pattern_match(pat, name))
+			continue;
+		match = xmalloc(strlen(lead) + strlen(name) + 2);
+		strcpy(match, lead);
+		strcat(match, name);
+		if (ix->ents[i].type == INDEX_DIR)
+			strcat(match, "/");
+		list_add(matches, match);
+	}
+	return 1;
+}
+
+
+/*
+ * Returns the name of the index file of the current share, malloc'ed,
+ * NULL when there is no home directory.
+ */
+static char *
+indexfile(void)
+{
+	SmbSession     *s;
+	const char     *home;
+	char   *file;
+	size_t	len;
+
+	if ((home = getenv("HOME")) == NULL || *home == '\0')
+		return NULL;
+
+	s = smb_getsession();
+	len = strlen(home) + strlen("/.samblah/") + strlen(smbs_gethost(s)) +
+	    1 + strlen(smbs_getshare(s)) + strlen(INDEX_SUFFIX) + 1;
+	file = xmalloc(len);
+	(void)xsnprintf(file, len, "%s/.samblah/%s/%s%s", home,
+	    smbs_gethost(s), smbs_getshare(s), INDEX_SUFFIX);
+	return file;
+}
+
+
+/*
+ * Returns the index of the current share, mapping it when necessary.  NULL
+ * when there is none or it cannot be used.
+ */
+static Index *
+index_load(void)
+{
+	char   *file;
+
+	if (!smbs_connected(smb_getsession()) || (file = indexfile()) == NULL)
+		return NULL;
+
+	if (loaded != NULL && streql(loaded->file, file)) {
+		free(file);
+		return loaded;
+	}
+
+	if (loaded != NULL)
+		index_unmap(loaded);
+	loaded = index_map(file);
+	free(file);
+	return loaded;
+}
+
+
+/* Maps index file, returns NULL when it does not exist or is damaged. */
+static Index *
+index_map(const char *file)
+{
+	Index  *ix;
+	struct stat	st;
+	void   *map;
+	size_t	i, nameslen;
+	const Indexhdr *hdr;
+	int	fd;
+
+	if ((fd = open(file, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof (Indexhdr)) {
+		(void)close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	(void)close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	ix = xmalloc(sizeof (Index));
+	ix->file = xstrdup(file);
+	ix->map = map;
+	ix->len = (size_t)st.st_size;
+	ix->hdr = hdr = (const Indexhdr *)map;
+	ix->ents = (const Indexent *)(hdr + 1);
+
+	/* check everything once, so lookups need not */
+	if (memcmp(hdr->magic, INDEX_MAGIC, sizeof hdr->magic) != 0 ||
+	    hdr->version != INDEX_VERSION || hdr->count == 0 ||
+	    hdr->names != sizeof (Indexhdr) + hdr->count * sizeof (Indexent) ||
+	    hdr->names >= ix->len || ((char *)map)[ix->len - 1] != '\0') {
+		index_unmap(ix);
+		return NULL;
+	}
+	ix->names = (const char *)map + hdr->names;
+	nameslen = ix->len - hdr->names;
+	for (i = 0; i < hdr->count; ++i)
+		if (ix->ents[i].path >= nameslen ||
+		    entpath(ix, i)[0] != '/') {
+			index_unmap(ix);
+			return NULL;
+		}
+	return ix;
+}
+
+
+static void
+index_unmap(Index *ix)
+{
+	(void)munmap(ix->map, ix->len);
+	free(ix->file);
+	free(ix);
+}
+
+
+static const char *
+entpath(const Index *ix, size_t i)
+{
+	return ix->names + ix->ents[i].path;
+}
+
+
+/* Returns the position of the first entry not before path. */
+static size_t
+lowerbound(const Index *ix, const char *path)
+{
+	size_t	lo, hi, mid;
+
+	lo = 0;
+	hi = ix->hdr->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (pathcmp(entpath(ix, mid), path) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+
+/* Returns the position of path in ix, -1 when it is not there. */
+static long
+lookup(const Index *ix, const char *path)
+{
+	size_t	i;
+
+	i = lowerbound(ix, path);
+	if (i < ix->hdr->count && streql(entpath(ix, i), path))
+		return (long)i;
+	return -1;
+}
+
+
+/* Returns the position of the first entry after entry i and all below it. */
+static size_t
+skipsubtree(const Index *ix, size_t i)
+{
+	char	key[SMB_PATH_MAXLEN + 3];
+
+	if (ix->ents[i].type != INDEX_DIR ||
+	    i + 1 >= ix->hdr->count || strlen(entpath(ix, i)) > SMB_PATH_MAXLEN)
+		return i + 1;
+
+	/* beyond anything starting with path/ */
+	strcpy(key, entpath(ix, i));
+	strcat(key, "/\377");
+	return lowerbound(ix, key);
+}
+
+
+/* Compares paths like strcmp, except that `/' comes before anything else. */
+static int
+pathcmp(const char *p1, const char *p2)
+{
+	unsigned char	c1, c2;
+
+	for (; *p1 == *p2; ++p1, ++p2)
+		if (*p1 == '\0')
+			return 0;
+	c1 = (*p1 == '/') ? 1 : (unsigned char)*p1;
+	c2 = (*p2 == '/') ? 1 : (unsigned char)*p2;
+	return (int)c1 - (int)c2;
+}
+
+
+/* Compares Indexent's on path, for qsort while building. */
+static int
+entcmp(const void *a, const void *b)
+{
+	return pathcmp(sortnames + ((const Indexent *)a)->path,
+	    sortnames + ((const Indexent *)b)->path);
+}
+
+
+static int
+hasprefix(const char *s, const char *prefix)
+{
+	return strncmp(s, prefix, strlen(prefix)) == 0;
+}
+
+
+static void
+build_add(Build *b, const char *path, int type, off_t size, time_t mtime)
+{
+	Indexent       *e;
+	size_t	len;
+
+	if (b->count == b->max) {
+		b->max = (b->max == 0) ? 1024 : b->max * 2;
+		b->ents = xrealloc(b->ents, sizeof (Indexent) * b->max);
+	}
+	len = strlen(path) + 1;
+	while (b->nameslen + len > b->namesmax) {
+		b->namesmax = (b->namesmax == 0) ? 65536 : b->namesmax * 2;
+		b->names = xrealloc(b->names, b->namesmax);
+	}
+
+	e = &b->ents[b->count++];
+	e->size = (int64_t)size;
+	e->mtime = (int64_t)mtime;
+	e->path = (uint64_t)b->nameslen;
+	e->type = (uint32_t)type;
+	e->unused = 0;
+	memcpy(b->names + b->nameslen, path, len);
+	b->nameslen += len;
+
+	if (type == INDEX_FILE)
+		++b->files;
+}
+
+
+/*
+ * Adds the entries of directory d to b and queues the directories in it.
+ * When old has d with the same modification time, from before old was made,
+ * its entries are taken from old and only the directories are stat'ed,
+ * for their current modification time.  Otherwise d is listed.
+ */
+static void
+build_dir(Build *b, const Index *old, Builddir *d, List *queue)
+{
+	char	path[SMB_PATH_MAXLEN + 1];
+	char	prefix[SMB_PATH_MAXLEN + 2];
+	const Smbdirent *dent;
+	const Indexent *e;
+	struct stat	st;
+	long	pos;
+	size_t	i;
+	int	dh;
+
+	strcpy(prefix, d->path);
+	if (!streql(d->path, "/"))
+		strcat(prefix, "/");
+
+	if (old != NULL && (pos = lookup(old, d->path)) >= 0 &&
+	    old->ents[pos].type == INDEX_DIR &&
+	    old->ents[pos].mtime == (int64_t)d->mtime &&
+	    d->mtime < (time_t)old->hdr->built) {
+		for (i = (size_t)pos + 1; !int_signal && i < old->hdr->count;
+		    i = skipsubtree(old, i)) {
+			if (!hasprefix(entpath(old, i), prefix))
+				break;
+			e = &old->ents[i];
+			if (e->type != INDEX_DIR) {
+				build_add(b, entpath(old, i), (int)e->type,
+				    (off_t)e->size, (time_t)e->mtime);
+				continue;
+			}
+			/* removed meanwhile is not an error */
+			if (smb_stat(entpath(old, i), &st) != 0 ||
+			    !S_ISDIR(st.st_mode))
+				continue;
+			build_add(b, entpath(old, i), INDEX_DIR, (off_t)0,
+			    st.st_mtime);
+			build_queue(queue, entpath(old, i), st.st_mtime);
+		}
+		++b->kept;
+		return;
+	}
+
+	if ((dh = smb_opendir(d->path)) < 0) {
+		cmdwarn("%s", d->path);
+		return;
+	}
+	while (!int_signal && (dent = smb_readdirplus(dh, &st)) != NULL) {
+		if (streql(dent->name, ".") || streql(dent->name, "..") ||
+		    st.st_mode == 0)
+			continue;
+		if (strlen(prefix) + strlen(dent->name) > SMB_PATH_MAXLEN) {
+			errno = ENAMETOOLONG;
+			cmdwarn("in %s", d->path);
+			continue;
+		}
+		strcpy(path, prefix);
+		strcat(path, dent->name);
+
+		if (S_ISDIR(st.st_mode)) {
+			build_add(b, path, INDEX_DIR, (off_t)0, st.st_mtime);
+			build_queue(queue, path, st.st_mtime);
+		} else
+			build_add(b, path, INDEX_FILE, st.st_size, st.st_mtime);
+	}
+	(void)smb_closedir(dh);
+	++b->listed;
+}
+
+
+static void
+build_queue(List *queue, const char *path, time_t mtime)
+{
+	Builddir       *d;
+
+	d = xmalloc(sizeof (Builddir));
+	d->path = xstrdup(path);
+	d->mtime = mtime;
+	list_add(queue, d);
+}
+
+
+/*
+ * Sorts the entries of b and writes them to file, through a temporary
+ * file so readers never see half an index.  Returns 0, or -1 with errno
+ * set.
+ */
+static int
+build_write(Build *b, const char *file, time_t built)
+{
+	Indexhdr	hdr;
+	char   *tmp;
+	FILE   *fp;
+	int	save_errno;
+	size_t	len;
+
+	sortnames = b->names;
+	qsort(b->ents, b->count, sizeof (Indexent), entcmp);
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, INDEX_MAGIC, sizeof hdr.magic);
+	hdr.version = INDEX_VERSION;
+	hdr.count = (uint32_t)b->count;
+	hdr.names = sizeof (Indexhdr) + b->count * sizeof (Indexent);
+	hdr.built = (int64_t)built;
+
+	len = strlen(file) + 5;
+	tmp = xmalloc(len);
+	(void)xsnprintf(tmp, len, "%s.tmp", file);
+	if (mkparents(tmp) != 0 || (fp = fopen(tmp, "w")) == NULL) {
+		free(tmp);
+		return -1;
+	}
+
+	if (fwrite(&hdr, sizeof hdr, 1, fp) != 1 ||
+	    fwrite(b->ents, sizeof (Indexent), b->count, fp) != b->count ||
+	    fwrite(b->names, 1, b->nameslen, fp) != b->nameslen) {
+		save_errno = errno;
+		(void)fclose(fp);
+		(void)unlink(tmp);
+		free(tmp);
+		errno = save_errno;
+		return -1;
+	}
+	if (fclose(fp) != 0 || rename(tmp, file) != 0) {
+		save_errno = errno;
+		(void)unlink(tmp);
+		free(tmp);
+		errno = save_errno;
+		return -1;
+	}
+	free(tmp);
+	return 0;
+}
+
+
+/* Creates the directories leading to file, which is written in and restored. */
+static int
+mkparents(char *file)
+{
+	char   *slash;
+
+	for (slash = strchr(file + 1, '/'); slash != NULL;
+	    slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if (mkdir(file, (mode_t)S_IRWXU) != 0 && errno != EEXIST) {
+			*slash = '/';
+			return -1;
+		}
+		*slash = '/';
+	}
+	return 0;
+}
+
+
+/* Prints entry i of ix as lead followed by rest, like ls does. */
+static void
+printentry(const Index *ix, size_t i, const char *lead, const char *rest,
+    int lopt)
+{
+	const Indexent *e;
+	const char     *trailing;
+
+	e = &ix->ents[i];
+	trailing = (e->type == INDEX_DIR) ? "/" : "";
+	if (lopt)
+		printf("%s %10lld %s%s%s\n", makedatestr((time_t)e->mtime),
+		    (long long)e->size, lead, rest, trailing);
+	else
+		printf("%s%s%s\n", lead, rest, trailing);
+}
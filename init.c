@@ -8,10 +8,12 @@ static void             parse_config(const char *file, int use_file);
 
 /*
  * Reads environment, parses the command line arguments and reads config file.
- * On error, a message is printed to stderr and exit called.
+ * The script given with -b is written to script and the commands given with
+ * -e to cmds, both NULL when samblah is interactive.  On error, a message is
+ * printed to stderr and exit called.
  */
 void
-do_init(int argc, char **argv)
+do_init(int argc, char **argv, const char **script, const char **cmds)
 {
 	int	ch;
 	int	Popt = 0;
@@ -29,13 +31,20 @@ do_init(int argc, char **argv)
 	}
 
 	carg = user = pass = host = share = path = NULL;
+	*script = *cmds = NULL;
 	eoptind = 1;
 	eoptreset = 1;  /* clean egetopt state */
-	while ((ch = egetopt(argc, argv, "c:p:Pu:")) != -1)
+	while ((ch = egetopt(argc, argv, "b:c:e:p:Pu:")) != -1)
 		switch(ch) {
+		case 'b':
+			*script = eoptarg;      /* batch mode */
+			break;
 		case 'c':
 			carg = eoptarg;         /* config file */
 			break;
+		case 'e':
+			*cmds = eoptarg;        /* batch mode */
+			break;
 		case 'p':
 			pass = eoptarg;
 			break;
@@ -61,6 +70,10 @@ do_init(int argc, char **argv)
 		warnx("missing share");
 		usage();
 	}
+	if (*script != NULL && *cmds != NULL) {
+		warnx("-b and -e are mutually exclusive");
+		usage();
+	}
 
 	if (Popt) {
 		if (!askpass(passinput))
@@ -116,7 +129,7 @@ do_init(int argc, char **argv)
 	}
 
 	/* try to open location passed on command line */
-	errmsg = smb_connect(host, share, user, pass, path);
+	errmsg = session_open(NULL, host, share, user, pass, path);
 	if (errmsg != NULL)
 		errx(1, "%s", errmsg);
 }
@@ -126,7 +139,8 @@ static void
 usage(void)
 {
 	fprintf(stderr,
-"       samblah [-c file] [-u user] [-P | -p pass] [host share [path]]\n");
+"       samblah [-c file] [-b script | -e commands] [-u user] [-P | -p pass]\n"
+"               [host share [path]]\n");
 	exit(1);
 }
 
@@ -3,6 +3,8 @@
 #include "samblah.h"
 
 int	done = 0;			/* when true, samblah will quit */
+int	batch = 0;			/* when true, never use readline or ask */
+int	cmdfailed = 0;			/* set when a command printed a warning */
 const char *cmdname = "samblah";	/* contains running command */
 volatile sig_atomic_t int_signal = 0;	/* set to true on SIGINT */
 volatile sig_atomic_t winch_signal = 0;	/* set to true on SIGWINCH */
@@ -13,6 +15,8 @@ static int lines;       /* unused, needed for setting cols */
 
 
 static void     do_line(void);
+static int      batch_line(const char *, const char *, int);
+static void     exec_line(char *);
 static void     do_command(List *);
 static void     int_handler(int);
 static void     winch_handler(int);
@@ -89,13 +93,14 @@ static void
 do_line(void)
 {
 	char   *line;
-	List   *tokens;
 	char   *prompt = "samblah> ";
-	const char *errmsg;
 
 	/* possibly cleanup from previous command */
 	int_signal = 0;
 
+	/* while the user types, have the directory listed for completion */
+	complete_prefetch(".");
+
 	/* read input, stop on EOF */
 	line = readline(prompt);
 	if (line == NULL) {
@@ -113,10 +118,143 @@ do_line(void)
 	 */
 	add_history(line);
 
+	exec_line(line);
+	free(line); line = NULL;
+}
+
+
+/*
+ * Runs the commands in file script, or standard input when script is "-",
+ * or when script is NULL the commands in cmds.  Readline is not used and
+ * nothing is asked: an existing file is an error when variable `onexist'
+ * is `ask'.  Stops after a command that fails (prints a warning) or is
+ * interrupted, or after `quit'.  Returns the exit status, 0 when all
+ * commands succeeded and 1 otherwise.
+ */
+int
+do_batch(const char *script, const char *cmds)
+{
+	struct sigaction intact;
+	FILE   *in;
+	char	buf[SCRIPT_LINE_MAXLEN + 2];    /* `+ 2' for \n and \0 */
+	char   *cp;
+	int	linenum, ok;
+
+	/* interrupt signal handler, readline does not install it now */
+	intact.sa_handler = int_handler;
+	intact.sa_flags = SA_RESTART;
+	sigemptyset(&intact.sa_mask);
+	if (sigaction(SIGINT, &intact, NULL) != 0)
+		err(1, "setting SIGINT handler");
+
+	batch = 1;
+
+	/* there is no terminal to ask the width, progress meters need one */
+	cp = getenv("COLUMNS");
+	cols = (cp != NULL && atoi(cp) > 0) ? atoi(cp) : 80;
+
+	if (script == NULL)
+		return batch_line(cmds, NULL, 0) ? 0 : 1;
+
+	if (streql(script, "-"))
+		in = stdin;
+	else if ((in = fopen(script, "r")) == NULL) {
+		warn("opening %s", script);
+		return 1;
+	}
+
+	ok = 1;
+	for (linenum = 1; ok && !done && fgets(buf, sizeof buf, in) != NULL;
+	    ++linenum) {
+		if ((cp = strchr(buf, '\n')) != NULL)
+			*cp = '\0';
+		else if (!feof(in)) {
+			warnx("%s:%d: line too long", script, linenum);
+			ok = 0;
+			break;
+		}
+		ok = batch_line(buf, script, linenum);
+	}
+	if (ok && ferror(in)) {
+		warn("reading %s", script);
+		ok = 0;
+	}
+	if (in != stdin)
+		(void)fclose(in);
+	return ok ? 0 : 1;
+}
+
+
+/*
+ * Executes the commands on line, separated by `;' outside quotes, until
+ * one fails.  Lines starting with `#' are comments.  Returns 0 when a
+ * command failed, which is reported with file and linenum unless file is
+ * NULL.
+ */
+static int
+batch_line(const char *line, const char *file, int linenum)
+{
+	char   *copy, *cmd, *cp;
+	int	inquote, last;
+
+	line += strspn(line, " \t");
+	if (*line == '#')
+		return 1;
+
+	copy = xstrdup(line);
+	cmd = copy;
+	inquote = 0;
+	for (cp = copy; !done; ++cp) {
+		if (*cp == '\'') {
+			inquote = !inquote;
+			continue;
+		}
+		if (*cp != '\0' && (*cp != ';' || inquote))
+			continue;
+
+		last = (*cp == '\0');
+		*cp = '\0';
+		cmd += strspn(cmd, " \t");
+		if (*cmd != '\0') {
+			exec_line(cmd);
+			if (cmdfailed || int_signal) {
+				(void)fflush(stdout);
+				if (file != NULL)
+					warnx("%s:%d: failed: %s", file, linenum,
+					    cmd);
+				else
+					warnx("failed: %s", cmd);
+				free(copy);
+				return 0;
+			}
+		}
+		if (last)
+			break;
+		cmd = cp + 1;
+	}
+	free(copy);
+	return 1;
+}
+
+
+/*
+ * Executes line, which is not empty, as a shell command when it starts
+ * with `!' and otherwise as an internal command.  Cmdfailed is set when
+ * it failed.
+ */
+static void
+exec_line(char *line)
+{
+	List   *tokens;
+	const char *errmsg;
+
+	cmdfailed = 0;
+
 	/* see if it is a shell command, i.e. when it starts with `!' */
 	if (line[0] == '!') {
-		(void)system(&line[1]);
-		free(line);
+		(void)fflush(stdout);
+		if (system(&line[1]) != 0)
+			cmdfailed = 1;
 		return;
 	}
 
@@ -139,7 +277,6 @@ do_line(void)
 	}
 
 	list_free(tokens); tokens = NULL;
-	free(line); line = NULL;
 }
 
 
@@ -177,7 +314,11 @@ do_command(List *tokens)
 
 	/* perform globbing, either on remote or on local files */
 	remoteglobbing = cmd->conn == CMD_MUSTCONN && !streql((char *)list_elem(tokens, 0), "put");
-	switch (smbglob(tokens, remoteglobbing)) {
+	if (streql((char *)list_elem(tokens, 0), "find")) {
+		/* the pattern of find is matched against the index by find */
+		for (i = 1; i < list_count(tokens); ++i)
+			unescape((char *)list_elem(tokens, i));
+	} else switch (smbglob(tokens, remoteglobbing)) {
 	case GLB_DIRERR:
 		cmdwarn("handling directories in globbing");
 		return;
@@ -193,6 +334,7 @@ do_command(List *tokens)
 	cmdname = cmd->name;
 	(*(cmd->func))(argc, argv);
 	cmdname = "samblah";
+	globmatch_clear();
 
 	return;
 }
@@ -225,6 +367,10 @@ askpass(char pass[SMB_PASS_MAXLEN + 1])
 	char	buf[SMB_PASS_MAXLEN + 2];     /* +2 because an extra newline is read */
 	struct termios tp;
 
+	/* scripts are never asked anything */
+	if (batch)
+		return 0;
+
 	/* fill tp */
 	if (tcgetattr(STDIN_FILENO, &tp) != 0)
 		return 0;
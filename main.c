@@ -5,6 +5,8 @@
 int
 main(int argc, char *argv[])
 {
+	const char     *script, *cmds;
+
 	(void)setlocale(LC_ALL, "");
 
 	if (!smb_init())
@@ -16,7 +18,11 @@ main(int argc, char *argv[])
 	 * files.  if it returns, everything went fine, otherwise a message was
 	 * printed and exit called.
 	 */
-	do_init(argc, argv);
+	do_init(argc, argv, &script, &cmds);
+
+	/* run the script or commands given and exit with their status */
+	if (script != NULL || cmds != NULL)
+		exit(do_batch(script, cmds));
 
 	/*
 	 * keep reading, parsing and executing commands from the
@@ -224,7 +224,9 @@ vwarnx(const char *fmt, va_list ap)
 /*
  * Cmdwarn and cmdwarnx are like warn and warnx from <err.h> but
  * to be used by the internal/interactive commands.  Global variable
- * `cmdname' is used for printing the command name.
+ * `cmdname' is used for printing the command name, `cmdfailed' is set.
+ * Stdout is locked so messages of worker threads of parallel transfers are
+ * not mixed.
  */
 
 /* PRINTFLIKE1 */
@@ -235,9 +237,12 @@ cmdwarn(const char *fmt, ...)
 
 	/* LINTED [lint: pointer casts may be troublesome] */
 	va_start(ap, fmt);
+	flockfile(stdout);
 	printf("%s: ", cmdname);
 	vprintf(fmt, ap);
 	printf(": %s\n", strerror(errno));
+	cmdfailed = 1;
+	funlockfile(stdout);
 	/* LINTED [lint: expression has null effect] */
 	va_end(ap);
 }
@@ -251,9 +256,12 @@ cmdwarnx(const char *fmt, ...)
 
 	/* LINTED [lint: pointer casts may be troublesome] */
 	va_start(ap, fmt);
+	flockfile(stdout);
 	printf("%s: ", cmdname);
 	vprintf(fmt, ap);
 	printf("\n");
+	cmdfailed = 1;
+	funlockfile(stdout);
 	/* LINTED [lint: expression has null effect] */
 	va_end(ap);
 }
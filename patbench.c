@@ -0,0 +1,198 @@
+/* $Id$ */
+
+/*
+ * Compares the time fnmatch(3) and a compiled Pattern take to match the
+ * names of a large directory, the way smbglob matches a pattern component
+ * against each entry.  Run with `make bench'.  Each pattern is compiled
+ * once per pass over the names, as smbglob does once per directory.  Then
+ * many short random patterns and names, full of the characters that are
+ * special to patterns, are matched both ways.  Exits non-zero when the two
+ * disagree on any name.
+ */
+
+#include "samblah.h"
+
+enum {
+	NAMES  = 100000,	/* entries in the directory */
+	ROUNDS = 20,		/* passes over all names */
+	TRIES  = 1000000	/* random patterns matched both ways */
+};
+
+/* misc.c, which provides xmalloc and friends, needs these of interface.c */
+int	cmdfailed = 0;
+const char *cmdname = "patbench";
+
+static const char *patterns[] = {
+	"*",
+	"*.pdf",
+	"report-*",
+	"IMG_????.JPG",
+	"*[0-9][0-9].txt",
+	"*2019*.pdf",
+	"*-draft-*.doc*",
+	"[!.]*.tar.gz",
+	NULL
+};
+
+static char   **makenames(void);
+static double   elapsed(struct timeval, struct timeval);
+static int      fuzz(void);
+static void     randomstring(char *, size_t, const char *);
+
+
+int
+term_width(void)
+{
+	return 80;
+}
+
+
+int
+main(void)
+{
+	struct timeval	begin, end;
+	Pattern        *pat;
+	char  **names;
+	double	tfn, tpat;
+	long	nfn, npat;
+	int	i, p, r, differ;
+
+	(void)setlocale(LC_ALL, "");
+	names = makenames();
+	differ = 0;
+
+	(void)printf("%d names, %d rounds\n", NAMES, ROUNDS);
+	(void)printf("%-18s %8s %10s %10s %8s\n", "pattern", "matches",
+	    "fnmatch", "compiled", "speedup");
+	for (p = 0; patterns[p] != NULL; ++p) {
+		nfn = npat = 0;
+
+		(void)gettimeofday(&begin, NULL);
+		for (r = 0; r < ROUNDS; ++r)
+			for (i = 0; i < NAMES; ++i)
+				if (fnmatch(patterns[p], names[i],
+				    FNM_PERIOD) == 0)
+					++nfn;
+		(void)gettimeofday(&end, NULL);
+		tfn = elapsed(begin, end);
+
+		(void)gettimeofday(&begin, NULL);
+		for (r = 0; r < ROUNDS; ++r) {
+			pat = pattern_compile(patterns[p]);
+			for (i = 0; i < NAMES; ++i)
+				if (pattern_match(pat, names[i]))
+					++npat;
+			pattern_free(pat);
+		}
+		(void)gettimeofday(&end, NULL);
+		tpat = elapsed(begin, end);
+
+		(void)printf("%-18s %8ld %9.3fs %9.3fs %7.1fx\n", patterns[p],
+		    nfn / ROUNDS, tfn, tpat, (tpat == 0.0) ? 0.0 : tfn / tpat);
+		if (nfn != npat) {
+			warnx("%s: fnmatch matched %ld names, the compiled "
+			    "pattern %ld", patterns[p], nfn / ROUNDS,
+			    npat / ROUNDS);
+			differ = 1;
+		}
+	}
+
+	for (i = 0; i < NAMES; ++i)
+		free(names[i]);
+	free(names);
+
+	if (fuzz() != 0)
+		differ = 1;
+	return differ;
+}
+
+
+/*
+ * Matches TRIES random patterns against as many random names with fnmatch
+ * and pattern_match, printing the first disagreements.  Returns the number
+ * of disagreements.
+ */
+static int
+fuzz(void)
+{
+	Pattern        *pat;
+	char	pattern[12], name[10];
+	long	t;
+	int	bad;
+
+	bad = 0;
+	for (t = 0; t < TRIES; ++t) {
+		randomstring(pattern, sizeof pattern, "ab.*?[]!^-\\c]");
+		randomstring(name, sizeof name, "ab.c-]^!\\*?[");
+
+		pat = pattern_compile(pattern);
+		if (pattern_match(pat, name) !=
+		    (fnmatch(pattern, name, FNM_PERIOD) == 0) && bad++ < 10)
+			warnx("pattern `%s', name `%s': fnmatch and the compiled "
+			    "pattern disagree", pattern, name);
+		pattern_free(pat);
+	}
+	(void)printf("%d random patterns, %d disagreements\n", TRIES, bad);
+	return bad;
+}
+
+
+/*
+ * Fills buf, of size bytes, with a string of random length made of the
+ * characters in chars.  The same strings are made on every run.
+ */
+static void
+randomstring(char *buf, size_t size, const char *chars)
+{
+	static unsigned long	seed = 1;
+	size_t	i, len, n;
+
+	n = strlen(chars);
+	seed = seed * 1103515245 + 12345;
+	len = (seed >> 16) % size;
+	for (i = 0; i < len; ++i) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = chars[(seed >> 16) % n];
+	}
+	buf[len] = '\0';
+}
+
+
+/*
+ * Returns NAMES names resembling those of a large share: documents, photos,
+ * archives and some hidden files.
+ */
+static char **
+makenames(void)
+{
+	static const char      *forms[] = {
+		"report-%d.pdf",
+		"IMG_%04d.JPG",
+		"notes%d.txt",
+		"minutes-%d-2019-q3.pdf",
+		"proposal-draft-%d.docx",
+		"backup-%d.tar.gz",
+		".cache%d",
+		"Quarterly Figures %d.xlsx"
+	};
+	char	buf[64];
+	char  **names;
+	int	i;
+
+	names = xmalloc(sizeof names[0] * NAMES);
+	for (i = 0; i < NAMES; ++i) {
+		(void)xsnprintf(buf, sizeof buf,
+		    forms[i % (sizeof forms / sizeof forms[0])], i % 10000);
+		names[i] = xstrdup(buf);
+	}
+	return names;
+}
+
+
+/* Returns the number of seconds from begin to end. */
+static double
+elapsed(struct timeval begin, struct timeval end)
+{
+	return (double)(end.tv_sec - begin.tv_sec) +
+	    (double)(end.tv_usec - begin.tv_usec) / 1e6;
+}
@@ -0,0 +1,380 @@
+/* $Id$ */
+
+/*
+ * Patterns compiled for matching many names, as when globbing a directory.
+ * A pattern is cut at its `*'s into segments of fixed length, each a series
+ * of atoms matching one byte: a literal character, `?' or a bracket
+ * expression, kept as a bitmap.  The first segment must match at the
+ * start of a name, the last one at its end and those in between are looked
+ * for from left to right, by memchr when they start with a literal.  The
+ * result is that of fnmatch(3) with FNM_PERIOD, which is called for
+ * constructs not handled here.
+ */
+
+#include "samblah.h"
+
+typedef struct Atom Atom;
+typedef struct Segment Segment;
+
+enum {
+	ATOM_CHAR,		/* the byte c */
+	ATOM_ANY,		/* any byte, `?' */
+	ATOM_CLASS		/* a byte in classes[c] */
+};
+
+struct Atom {
+	unsigned char	type;
+	unsigned char	c;
+};
+
+struct Segment {
+	int	first;		/* index of first atom */
+	int	count;		/* number of atoms */
+	int	literal;	/* all atoms are ATOM_CHAR */
+	const char     *lit;	/* the characters when literal */
+};
+
+struct Pattern {
+	char   *source;		/* the pattern, for fnmatch */
+	int	fallback;	/* always use fnmatch */
+	int	bytewise;	/* has `?' or brackets, which match characters */
+	int	multibyte;	/* characters may be several bytes */
+	Atom   *atoms;
+	char   *chars;		/* characters of the literal segments */
+	int	nsegs;		/* number of `*'s plus one */
+	Segment *segs;
+	unsigned char (*classes)[32];
+	int	nclasses;
+};
+
+
+static int      compile(Pattern *);
+static int      compileclass(Pattern *, const char **);
+static int      segmatch(const Pattern *, const Segment *, const char *);
+static int      segprefix(const Pattern *, const Segment *, const char *);
+static const char      *segfind(const Pattern *, const Segment *, const char *,
+		    size_t);
+static int      hashigh(const char *);
+static int      onlyany(const Pattern *, const Segment *);
+
+
+/*
+ * Compiles pattern, which is as for fnmatch(3), for use with pattern_match.
+ * The result must be freed with pattern_free.
+ */
+Pattern *
+pattern_compile(const char *pattern)
+{
+	Pattern	*p;
+	size_t	len;
+
+	len = strlen(pattern);
+	p = xmalloc(sizeof (Pattern));
+	p->source = xstrdup(pattern);
+	p->bytewise = 0;
+	p->multibyte = MB_CUR_MAX > 1;
+	p->atoms = xmalloc(sizeof (Atom) * (len + 1));
+	p->chars = xmalloc(len + 1);
+	p->nsegs = 0;
+	p->segs = xmalloc(sizeof (Segment) * (len + 1));
+	p->classes = NULL;
+	p->nclasses = 0;
+	p->fallback = !compile(p);
+	return p;
+}
+
+
+void
+pattern_free(Pattern *p)
+{
+	free(p->source);
+	free(p->atoms);
+	free(p->chars);
+	free(p->segs);
+	free(p->classes);
+	free(p);
+}
+
+
+/*
+ * Returns whether name matches p like fnmatch(3) with FNM_PERIOD would
+ * decide.
+ */
+int
+pattern_match(const Pattern *p, const char *name)
+{
+	const Segment	*seg, *last;
+	const Atom	*a;
+	const char	*pos, *end;
+	size_t	len;
+
+	/* `?' and brackets match a character, which may be several bytes */
+	if (p->fallback || (p->bytewise && p->multibyte && hashigh(name)))
+		return fnmatch(p->source, name, FNM_PERIOD) == 0;
+
+	/* a leading period only matches a period */
+	seg = &p->segs[0];
+	if (*name == '.') {
+		a = &p->atoms[seg->first];
+		if (seg->count == 0 || a->type != ATOM_CHAR || a->c != '.')
+			return 0;
+	}
+
+	/* the first segment is a prefix, most names fail here */
+	if (!segprefix(p, seg, name))
+		return 0;
+	if (p->nsegs == 1)
+		return name[seg->count] == '\0';
+
+	/* the last segment is a suffix, unless a trailing `*' takes the rest */
+	last = &p->segs[p->nsegs - 1];
+	if (p->nsegs == 2 && last->count == 0)
+		return 1;
+	len = (size_t)seg->count + strlen(name + seg->count);
+	if (len < (size_t)(seg->count + last->count))
+		return 0;
+	pos = name + seg->count;
+	end = name + len - last->count;
+
+	/* the segments in between, leftmost first since they have fixed length */
+	for (++seg; seg < last; ++seg) {
+		if ((pos = segfind(p, seg, pos, (size_t)(end - pos))) == NULL)
+			return 0;
+		pos += seg->count;
+	}
+	return segmatch(p, last, end);
+}
+
+
+/*
+ * Fills p from p->source.  Returns 0 when the pattern has something only
+ * fnmatch(3) knows how to handle: character classes like [:alpha:],
+ * collating elements, non-ASCII characters in brackets, an unterminated
+ * bracket, a trailing backslash or a bracket right after `*?'.
+ */
+static int
+compile(Pattern *p)
+{
+	const char *cp;
+	Segment *seg;
+	Atom   *a;
+	char   *chars;
+	int	natoms;
+
+	natoms = 0;
+	chars = p->chars;
+	seg = &p->segs[0];
+	seg->first = 0;
+	seg->count = 0;
+	seg->literal = 1;
+	seg->lit = chars;
+	p->nsegs = 1;
+
+	for (cp = p->source; *cp != '\0'; ++cp) {
+		if (*cp == '*') {
+			/* consecutive stars are one */
+			if (seg->count == 0 && p->nsegs > 1)
+				continue;
+			seg = &p->segs[p->nsegs++];
+			seg->first = natoms;
+			seg->count = 0;
+			seg->literal = 1;
+			seg->lit = chars;
+			continue;
+		}
+
+		a = &p->atoms[natoms++];
+		++seg->count;
+		switch (*cp) {
+		case '?':
+			a->type = ATOM_ANY;
+			seg->literal = 0;
+			p->bytewise = 1;
+			break;
+		case '[':
+			/*
+			 * glibc's fnmatch never matches a period with a bracket
+			 * right after `*?', it is left to decide those.
+			 */
+			if (p->nsegs > 1 && seg->count > 1 && onlyany(p, seg))
+				return 0;
+			a->type = ATOM_CLASS;
+			a->c = (unsigned char)p->nclasses;
+			seg->literal = 0;
+			p->bytewise = 1;
+			if (!compileclass(p, &cp))
+				return 0;
+			break;
+		case '\\':
+			if (*++cp == '\0')
+				return 0;
+			/* FALLTHROUGH */
+		default:
+			a->type = ATOM_CHAR;
+			a->c = (unsigned char)*cp;
+			*chars++ = *cp;
+			break;
+		}
+	}
+	return 1;
+}
+
+
+/*
+ * Compiles the bracket expression starting at *cpp into the next bitmap
+ * of p and leaves *cpp at its closing bracket.  Returns 0 when it must be
+ * left to fnmatch(3).
+ */
+static int
+compileclass(Pattern *p, const char **cpp)
+{
+	const char *cp;
+	unsigned char *bits;
+	int	negate, lo, hi, c, i;
+
+	p->classes = xrealloc(p->classes, sizeof p->classes[0] * (p->nclasses + 1));
+	bits = p->classes[p->nclasses++];
+	memset(bits, 0, sizeof p->classes[0]);
+
+	cp = *cpp + 1;
+	negate = (*cp == '!' || *cp == '^');
+	if (negate)
+		++cp;
+
+	/* a `]' right at the start is a member */
+	for (i = 0; *cp != ']' || i == 0; ++i) {
+		if (*cp == '[' && (cp[1] == ':' || cp[1] == '=' || cp[1] == '.'))
+			return 0;
+		if (*cp == '\\')
+			++cp;
+		if (*cp == '\0' || (unsigned char)*cp >= 0x80)
+			return 0;
+		lo = hi = (unsigned char)*cp++;
+
+		if (*cp == '-' && cp[1] != ']') {
+			/* a range may end in a class or collating element */
+			if (*++cp == '[' && (cp[1] == ':' || cp[1] == '=' ||
+			    cp[1] == '.'))
+				return 0;
+			if (*cp == '\\')
+				++cp;
+			if (*cp == '\0' || (unsigned char)*cp >= 0x80)
+				return 0;
+			hi = (unsigned char)*cp++;
+			if (hi < lo)
+				return 0;
+		}
+		for (c = lo; c <= hi; ++c)
+			bits[c / 8] |= 1 << (c % 8);
+	}
+
+	if (negate)
+		for (i = 0; i < 32; ++i)
+			bits[i] = ~bits[i];
+	bits[0] &= ~1;			/* never the terminating nul */
+
+	*cpp = cp;
+	return 1;
+}
+
+
+/* Returns whether seg matches the seg->count bytes at s. */
+static int
+segmatch(const Pattern *p, const Segment *seg, const char *s)
+{
+	const Atom     *a, *end;
+	unsigned char	c;
+
+	if (seg->literal)
+		return memcmp(seg->lit, s, (size_t)seg->count) == 0;
+
+	end = &p->atoms[seg->first + seg->count];
+	for (a = &p->atoms[seg->first]; a < end; ++a, ++s) {
+		c = (unsigned char)*s;
+		switch (a->type) {
+		case ATOM_ANY:
+			if (c == '\0')
+				return 0;
+			break;
+		case ATOM_CHAR:
+			if (c != a->c)
+				return 0;
+			break;
+		case ATOM_CLASS:
+			if (!(p->classes[a->c][c / 8] & (1 << (c % 8))))
+				return 0;
+			break;
+		}
+	}
+	return 1;
+}
+
+
+/*
+ * Returns whether name starts with seg.  Unlike segmatch, name may be
+ * shorter than seg, no byte after its terminating nul is read.
+ */
+static int
+segprefix(const Pattern *p, const Segment *seg, const char *name)
+{
+	/* segmatch stops at the nul, which never matches an atom */
+	if (seg->literal)
+		return strncmp(seg->lit, name, (size_t)seg->count) == 0;
+	return segmatch(p, seg, name);
+}
+
+
+/*
+ * Returns the first place in the n bytes at s where seg matches, NULL when
+ * there is none.
+ */
+static const char *
+segfind(const Pattern *p, const Segment *seg, const char *s, size_t n)
+{
+	const Atom     *a;
+	const char     *last;
+
+	if (n < (size_t)seg->count)
+		return NULL;
+	last = s + n - seg->count;
+
+	a = &p->atoms[seg->first];
+	if (a->type != ATOM_CHAR) {
+		for (; s <= last; ++s)
+			if (segmatch(p, seg, s))
+				return s;
+		return NULL;
+	}
+
+	while ((s = memchr(s, a->c, (size_t)(last - s) + 1)) != NULL) {
+		if (segmatch(p, seg, s))
+			return s;
+		if (s++ == last)
+			break;
+	}
+	return NULL;
+}
+
+
+/* Returns whether s has bytes outside ASCII. */
+static int
+hashigh(const char *s)
+{
+	for (; *s != '\0'; ++s)
+		if ((unsigned char)*s >= 0x80)
+			return 1;
+	return 0;
+}
+
+
+/* Returns whether the atoms of seg but the last one are all `?'. */
+static int
+onlyany(const Pattern *p, const Segment *seg)
+{
+	int	i;
+
+	for (i = seg->first; i < seg->first + seg->count - 1; ++i)
+		if (p->atoms[i].type != ATOM_ANY)
+			return 0;
+	return 1;
+}
@@ -4,6 +4,7 @@
 #define _BSD_SOURCE
 #define _XOPEN_SOURCE 600
 
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -15,9 +16,11 @@
 #include <fnmatch.h>
 #include <limits.h>
 #include <locale.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,9 +42,19 @@
 
 enum {
 	SAMBLAHRC_LINE_MAXLEN   = 1024,   /* max length of line in samblahrc */
+	SCRIPT_LINE_MAXLEN      = 4096,   /* max length of line in a script */
 	VAR_STRING_MAXLEN       =  512,   /* max length of a string variable */
 	FALLBACK_PATH_MAXLEN    = 1024,   /* to use when pathconf fails */
-	RESUME_ROLLBACK         = 8192    /* bytes to retransfer of file */
+	RESUME_ROLLBACK         = 8192,   /* bytes to retransfer of file */
+	DELTA_CHUNK             = 4096,   /* smallest range a delta rewrites */
+	BLOCKSIZE_MIN           =   64,   /* min value of variable blocksize */
+	BLOCKSIZE_MAX           = 8192,   /* max value of variable blocksize */
+	BUFFERS_MAX             =   16,   /* max value of variable buffers */
+	CACHETTL_MAX            = 3600,   /* max value of variable cachettl */
+	COMPLETEWAIT_MAX        = 10000,  /* max value of variable completewait */
+	PARALLEL_MAX            =   32,   /* max value of variable parallel */
+	SEGMENTS_MAX            =   16,   /* max value of variable segments */
+	SESSION_NAME_MAXLEN     =   31    /* max length of name of session */
 };
 
 #define streql(s1, s2)  (strcmp(s1, s2) == 0)
@@ -70,18 +83,19 @@ void    cmdwarnx(const char *, ...);
 
 
 /* variables, vars.c */
-enum    { VAR_ASK, VAR_RESUME, VAR_OVERWRITE, VAR_SKIP };
+enum    { VAR_ASK, VAR_RESUME, VAR_OVERWRITE, VAR_SKIP, VAR_DELTA };
 
 const char    **listvariables(void);
 const char     *setvariable(const char *, const char *);
 char   *getvariable(const char *);
 int	getvariable_bool(const char *);
+int	getvariable_int(const char *);
 int	getvariable_onexist(const char *);
 char   *getvariable_string(const char *);
 
 
 /* initialization, init.c */
-void do_init(int, char **);
+void do_init(int, char **, const char **, const char **);
 
 
 /* ls command, interactive, cmdls.c */
@@ -117,14 +131,32 @@ extern int	commandcount;
 /* generating and displaying matches, complete.c  */
 char  **complete(const char *, int, int);
 void    displaymatches(char **, int, int);
+void    complete_prefetch(const char *);
+
+
+/* compiled patterns, pattern.c */
+typedef struct Pattern Pattern;
+
+Pattern *pattern_compile(const char *);
+int     pattern_match(const Pattern *, const char *);
+void    pattern_free(Pattern *);
+
+
+/* persistent index of the current share, index.c */
+int     index_update(void);
+void    index_find(const char *, const char *, int);
+int     index_list(const char *, const Pattern *, const char *, List *);
 
 
 /* functions for interface to user, interface.c */
 void    do_interface(void);
+int     do_batch(const char *, const char *);
 int     term_width(void);
 int     askpass(char [SMB_PASS_MAXLEN + 1]);
 
 extern int done;
+extern int batch;
+extern int cmdfailed;
 extern const char *cmdname;
 extern volatile sig_atomic_t int_signal;
 
@@ -143,14 +175,35 @@ int             isquoted(char *, int);
 #define GLB_DIRERR      -1      /* error opening/reading/closing directory */
 #define GLB_INTR        -2      /* interrupted */
 
+/* What globmatch knows about a path. */
+#define GLM_NONE         0      /* not a match of the last smbglob */
+#define GLM_TYPE         1      /* whether it is a directory */
+#define GLM_ATTRS        2      /* also mode, size and modification time */
+
 int     smbglob(List *, int);
 int     tokenmatch(const char *, List *, int);
+int     globmatch(const char *, struct stat *);
+void    globmatch_clear(void);
 
 
 /* transfer data from/to smb files or file descriptors, transfer.c */
 void    transfer_get(const char *, const char *, int *, int);
 int     transfer_get_fd(const char *, int);
 void    transfer_put(const char *, const char *, int *, int);
+void    transfer_copy(const char *, SmbSession *, const char *, int *, int);
+int     transfer_put_fd(int, const char *, int);
+void    transfer_put_many(const char *, SmbSession **, char **, int, int *);
+void    transfer_pool_start(void);
+void    transfer_pool_finish(void);
+
+
+/* named sessions, session.c */
+const char     *session_open(const char *, const char *, const char *, const char *, const char *, const char *);
+const char     *session_use(const char *);
+const char     *session_close(const char *);
+void    session_list(void);
+char   *session_path(char *, SmbSession **);
+SmbSession     *session_get(const char *);
 
 
 /* help functions doing much of the actual work for the internal commands, smbhlp.c */
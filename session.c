@@ -0,0 +1,210 @@
+/* $Id$ */
+
+#include "samblah.h"
+
+/*
+ * Sessions opened with `open', by name.  The default session of smbwrap
+ * (see smb_setsession) is the current session, it is either one of these
+ * or a session which is not connected.  Connections of sessions which are
+ * not current are kept, so switching back with `use' needs no reconnect.
+ */
+typedef struct Session Session;
+
+struct Session {
+	char	name[SESSION_NAME_MAXLEN + 1];
+	SmbSession     *s;
+	Session        *next;
+};
+
+static Session *sessions;
+
+
+static Session *findsession(const char *);
+static Session *cursession(void);
+static int      validname(const char *);
+
+
+/*
+ * Opens a session called name, or `default' when name is NULL, to host
+ * and share and changes to path.  user, pass and path may be NULL.  When
+ * not connected, the new session becomes the current session.  On success
+ * NULL is returned, otherwise a string describing the error is returned.
+ */
+const char *
+session_open(const char *name, const char *host, const char *share,
+    const char *user, const char *pass, const char *path)
+{
+	Session        *ses;
+	SmbSession     *s;
+	const char     *errmsg;
+
+	if (name == NULL)
+		name = "default";
+	if (!validname(name))
+		return "invalid session name";
+	if (findsession(name) != NULL)
+		return "session already open";
+
+	/* the current session is reused when it is not connected */
+	if (!connected)
+		s = smb_getsession();
+	else if ((s = smbs_new()) == NULL)
+		return strerror(errno);
+
+	errmsg = smbs_connect(s, host, share, user, pass, path);
+	if (errmsg != NULL) {
+		if (s != smb_getsession())
+			smbs_free(s);
+		return errmsg;
+	}
+
+	ses = xmalloc(sizeof (Session));
+	strcpy(ses->name, name);
+	ses->s = s;
+	ses->next = sessions;
+	sessions = ses;
+
+	if (s == smb_getsession())
+		(void)smb_setsession(s);	/* updates `connected' */
+	return NULL;
+}
+
+
+/*
+ * Makes the session called name the current session.  On success NULL is
+ * returned, otherwise a string describing the error is returned.
+ */
+const char *
+session_use(const char *name)
+{
+	Session        *ses;
+	SmbSession     *prev;
+
+	if ((ses = findsession(name)) == NULL)
+		return "no such session";
+
+	prev = smb_setsession(ses->s);
+
+	/* a current session which is not connected belongs to no one */
+	if (prev != ses->s && !smbs_connected(prev))
+		smbs_free(prev);
+	return NULL;
+}
+
+
+/*
+ * Closes the session called name, or the current session when name is
+ * NULL.  When it is the current session, there is no current session
+ * afterwards.  On success NULL is returned, otherwise a string describing
+ * the error is returned.
+ */
+const char *
+session_close(const char *name)
+{
+	Session        *ses, **sesp;
+
+	ses = (name == NULL) ? cursession() : findsession(name);
+	if (ses == NULL)
+		return (name == NULL) ? "not connected" : "no such session";
+
+	for (sesp = &sessions; *sesp != ses; sesp = &(*sesp)->next)
+		;
+	*sesp = ses->next;
+
+	if (ses->s == smb_getsession())
+		(void)smb_disconnect();	/* keep it as current session */
+	else
+		smbs_free(ses->s);
+	free(ses);
+	return NULL;
+}
+
+
+/* Prints the open sessions, the current session is marked with a `*'. */
+void
+session_list(void)
+{
+	Session        *ses;
+
+	for (ses = sessions; ses != NULL && !int_signal; ses = ses->next)
+		printf("%c %-12s %s\n", (ses->s == smb_getsession()) ? '*' : ' ',
+		    ses->name, smbs_getcwd(ses->s));
+}
+
+
+/*
+ * Splits a remote path of the form name:path.  When arg starts with the
+ * name of a session followed by a colon, the session is stored in s and
+ * the path after the colon is returned.  Without such a prefix, s is set to
+ * NULL and arg is returned.  When the prefix names no open session, NULL is
+ * returned.
+ */
+char *
+session_path(char *arg, SmbSession **s)
+{
+	Session        *ses;
+	char   *colon;
+	size_t	len;
+
+	*s = NULL;
+
+	/* a colon after a slash is part of the path */
+	colon = strchr(arg, ':');
+	if (colon == NULL || memchr(arg, '/', (size_t)(colon - arg)) != NULL)
+		return arg;
+
+	len = (size_t)(colon - arg);
+	for (ses = sessions; ses != NULL; ses = ses->next)
+		if (strlen(ses->name) == len &&
+		    strncmp(ses->name, arg, len) == 0) {
+			*s = ses->s;
+			return colon + 1;
+		}
+	return NULL;
+}
+
+
+/* Returns the session called name, NULL if there is none. */
+SmbSession *
+session_get(const char *name)
+{
+	Session        *ses;
+
+	return ((ses = findsession(name)) != NULL) ? ses->s : NULL;
+}
+
+
+/* Returns the session called name, NULL if there is none. */
+static Session *
+findsession(const char *name)
+{
+	Session        *ses;
+
+	for (ses = sessions; ses != NULL; ses = ses->next)
+		if (streql(ses->name, name))
+			return ses;
+	return NULL;
+}
+
+
+/* Returns the current session, NULL when not connected. */
+static Session *
+cursession(void)
+{
+	Session        *ses;
+
+	for (ses = sessions; ses != NULL; ses = ses->next)
+		if (ses->s == smb_getsession())
+			return ses;
+	return NULL;
+}
+
+
+/* Names consist of letters, digits, `-' and `_'. */
+static int
+validname(const char *name)
+{
+	return *name != '\0' && strlen(name) <= SESSION_NAME_MAXLEN &&
+	    strspn(name, "abcdefghijklmnopqrstuvwxyz"
+	    "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_") == strlen(name);
+}
@@ -3,6 +3,23 @@
 #include "samblah.h"
 
 typedef struct Dir Dir;
+typedef struct Match Match;
+typedef struct Walk Walk;
+typedef struct Walkdir Walkdir;
+typedef struct Walkent Walkent;
+
+/* what a path is, as far as globbing needs to know */
+enum {
+	ENT_NONE,		/* does not exist */
+	ENT_FILE,
+	ENT_DIR,
+	ENT_UNKNOWN		/* exists, type not known without a stat */
+};
+
+enum {
+	MATCH_BUCKETS = 1024,	/* hash buckets of the match table */
+	WALK_WAITMSEC = 100	/* int_signal is checked this often */
+};
 
 struct Dir {
 	union {
@@ -15,15 +32,72 @@ struct Dir {
 	} dirent;
 };
 
+/* a match of the last smbglob, with what globbing learned about it */
+struct Match {
+	char   *path;		/* the match, as in the token list */
+	int	known;		/* GLM_TYPE or GLM_ATTRS */
+	struct	stat st;
+	Match  *next;
+};
+
+
+/* a directory the walker for `**' still has to read */
+struct Walkdir {
+	char   *path;
+	Walkdir *next;
+};
+
+/* an entry found by the walker, for the globbing thread */
+struct Walkent {
+	char   *path;
+	const char *name;	/* last component of path */
+	int	type;		/* ENT_* */
+	int	hasst;		/* whether st holds its attributes */
+	struct	stat st;
+	Walkent *next;
+};
+
+/*
+ * Breadth-first walk below a directory for `**'.  Workers, each with a
+ * session of their own, read the queued directories; the globbing thread
+ * matches the entries they find while they read on.
+ */
+struct Walk {
+	pthread_mutex_t lock;
+	pthread_cond_t	cond;
+	int	remote;
+	Walkdir *dirs, *dirstail;	/* directories still to read */
+	Walkent *ents, *entstail;	/* entries not yet matched */
+	int	busy;			/* directories being read */
+	int	nworkers;		/* workers still running */
+	int	stop;			/* workers must quit */
+};
+
+
+static Match   *matches[MATCH_BUCKETS];
+static int	walking;	/* a walk with workers is going on */
+
 
 static int      tokenglob(int, List *, int);
 static int      globbable(const char *);
-static int	tokenmatch2(char *, const char *, List *, int);
+static int	tokenmatch2(char *, int, const struct stat *, const char *,
+		    List *, int, int);
+static void     addmatch(const char *, int, const struct stat *, List *, int);
+static unsigned int	hashmatch(const char *);
+static int	hasglobstar(const char *);
+static int	globstar(const char *, char *, List *, int, int);
+static int	walk_start(Walk *, pthread_t *, int);
+static void	walk_finish(Walk *, pthread_t *, int);
+static void    *walk_worker(void *);
+static void	walk_readdir(Walk *, Walkdir *);
+static void	walk_adddir(Walk *, char *);
+static void	walk_wait(Walk *);
+static char    *catpath(const char *, const char *);
 static int      uni_opendir(const char *, Dir *, int);
 static int      uni_readdir(Dir *, int);
 static int      uni_closedir(Dir *, int);
-static int      uni_exists(const char *, int);
-static int      uni_isdir(const char *, int);
+static int      uni_direnttype(Dir *, int, struct stat *);
+static int      uni_type(const char *, int, struct stat *);
 
 
 /*
@@ -31,7 +105,8 @@ static int      uni_isdir(const char *, int);
  * matches.  Remoteglobbing indicates if the files are local or remote.  On
  * success GLB_OK is returned, on error GLB_DIRERR or GLB_INTR is returned and
  * errno set.  Memory is not freed on error, the caller must always free the
- * memory.
+ * memory.  What was learned about the matches is kept for globmatch until
+ * the next smbglob or globmatch_clear.
  */
 int
 smbglob(List *tokens, int remoteglobbing)
@@ -39,6 +114,8 @@ smbglob(List *tokens, int remoteglobbing)
 	int	i;
 	int	ret;
 
+	globmatch_clear();
+
 	/*
 	 * tokenglob expands the element in tokens at position i.  On success
 	 * it returns the index of the next element to be expanded (which may
@@ -75,7 +152,8 @@ tokenglob(int pos, List *tokens, int remoteglobbing)
 		tokencpy = xstrdup((char *)list_elem(tokens, pos));
 
 		newtokens = list_new();
-		ret = tokenmatch(tokencpy, newtokens, remoteglobbing);
+		ret = tokenmatch2("", ENT_DIR, NULL, tokencpy, newtokens,
+		    remoteglobbing, 1);
 		free(tokencpy);
 
 		if (ret != GLB_OK) {
@@ -97,7 +175,9 @@ tokenglob(int pos, List *tokens, int remoteglobbing)
 		return pos + 1;
 	}
 
-	list_sort(newtokens, qstrcmp);
+	/* matches of `**' are kept in the order the walk found them */
+	if (!hasglobstar((char *)list_elem(tokens, pos)))
+		list_sort(newtokens, qstrcmp);
 
 	/*
 	 * replace the one token with the matches, makes copies of arguments so
@@ -115,8 +195,11 @@ tokenglob(int pos, List *tokens, int remoteglobbing)
  * Generates matches for token which is in path.  Matches are placed in tokens.
  * remoteglobbing denotes if token is remote or local.  When not called
  * recursively from within tokenmatch, path must be "" (path is only used for
- * recursion).  On success GLB_OK is returned, on error GLB_DIRERR or GLB_INTR
- * is returned and errno set.  Caller should free tokens, even on error.
+ * recursion).  Whether a match is a directory is taken from the type in its
+ * directory entry, a file is only stat'ed when that type is unknown or for
+ * components of token without pattern characters.  On success GLB_OK is
+ * returned, on error GLB_DIRERR or GLB_INTR is returned and errno set.
+ * Caller should free tokens, even on error.
  *
  * Note that on success but without having generated matches, tokens need not
  * be freed.
@@ -124,11 +207,17 @@ tokenglob(int pos, List *tokens, int remoteglobbing)
 int
 tokenmatch(const char *token, List *tokens, int remoteglobbing)
 {
-	return tokenmatch2("", token, tokens, remoteglobbing);
+	return tokenmatch2("", ENT_DIR, NULL, token, tokens, remoteglobbing, 0);
 }
 
+/*
+ * type is one of ENT_* for path, st its attributes when known (NULL
+ * otherwise).  When record is set, matches are also entered in the match
+ * table for globmatch.
+ */
 static int
-tokenmatch2(char *path, const char *token, List *tokens, int remoteglobbing)
+tokenmatch2(char *path, int type, const struct stat *st, const char *token,
+    List *tokens, int remoteglobbing, int record)
 {
 	int ret;
 	char *ntoken;
@@ -138,7 +227,8 @@ tokenmatch2(char *path, const char *token, List *tokens, int remoteglobbing)
 	int dnamelen;
 	int pathlen;
 	int save_errno;
-	char   *newtoken;
+	struct stat nst;
+	Pattern *pat;
 
 	/* because of recursion, this is a good place to check for interrupt */
 	if (int_signal) {
@@ -146,22 +236,25 @@ tokenmatch2(char *path, const char *token, List *tokens, int remoteglobbing)
 		return GLB_INTR;
 	}
 
+	if (type == ENT_UNKNOWN) {
+		type = uni_type(path, remoteglobbing, &nst);
+		st = &nst;
+	}
+
 	/* token == NULL is the sign to stop the recursion and return */
 	if (token == NULL) {
-		/* + 2 because token could be a directory and get an extra / */
-		newtoken = xmalloc(strlen(path) + 2);
-		strcpy(newtoken, path);
-
-		if (uni_isdir(path, remoteglobbing))
-			strcat(newtoken, "/");
-		
-		list_add(tokens, newtoken);
+		addmatch(path, type == ENT_DIR, st, tokens, record);
 		return GLB_OK;
 	}
 
+	/* a file cannot match the rest of the pattern */
+	if (type != ENT_DIR)
+		return GLB_OK;
+
 	/* for matching something in / */
 	if (*token == '/')
-		return tokenmatch2("/", token + strspn(token, "/"), tokens, remoteglobbing);
+		return tokenmatch2("/", ENT_DIR, NULL, token + strspn(token, "/"),
+		    tokens, remoteglobbing, record);
 
 	/* component to match is token, token for next call is ntoken */
 	ntoken = strchr(token, '/');
@@ -176,6 +269,10 @@ tokenmatch2(char *path, const char *token, List *tokens, int remoteglobbing)
 	 * definitely add the token and return
 	 */
 
+	/* `**' matches any number of directories */
+	if (streql(token, "**"))
+		return globstar(path, ntoken, tokens, remoteglobbing, record);
+
 	/* path + slash when path is non-empty */
 	pathlen = (*path == '\0') ? 0 : strlen(path) + 1;
 
@@ -192,20 +289,24 @@ tokenmatch2(char *path, const char *token, List *tokens, int remoteglobbing)
 		strcat(npath, token);
 
 		/* npath not existing is a dead end but not an error */
-		if (!uni_exists(npath, remoteglobbing))
+		type = uni_type(npath, remoteglobbing, &nst);
+		if (type == ENT_NONE)
 			ret = GLB_OK;
 		else
-			ret = tokenmatch2(npath, ntoken, tokens, remoteglobbing);
+			ret = tokenmatch2(npath, type, &nst, ntoken, tokens,
+			    remoteglobbing, record);
 		free(npath);
 	} else {
 		if (uni_opendir((*path == '\0') ? "." : path, &d, remoteglobbing) < 0)
 			return GLB_OK;
 
+		/* the pattern is compiled once for all entries */
+		pat = pattern_compile(token);
 		while (!int_signal && uni_readdir(&d, remoteglobbing) != -1) {
 			dname = remoteglobbing ? d.dirent.sdent->name : d.dirent.dent->d_name;
 			dnamelen = strlen(dname);
 
-			if (fnmatch(token, dname, FNM_PERIOD) == FNM_NOMATCH)
+			if (!pattern_match(pat, dname))
 				continue;
 
 			npath = xmalloc((size_t)(pathlen + dnamelen + 1));
@@ -217,15 +318,20 @@ tokenmatch2(char *path, const char *token, List *tokens, int remoteglobbing)
 			}
 			strcat(npath, dname);
 
-			ret = tokenmatch2(npath, ntoken, tokens, remoteglobbing);
+			type = uni_direnttype(&d, remoteglobbing, &nst);
+			ret = tokenmatch2(npath, type,
+			    (nst.st_mode != 0) ? &nst : NULL, ntoken, tokens,
+			    remoteglobbing, record);
 			free(npath);
 			if (ret != GLB_OK) {
 				save_errno = errno;
+				pattern_free(pat);
 				(void)uni_closedir(&d, remoteglobbing);
 				errno = save_errno;
 				return ret;
 			}
 		}
+		pattern_free(pat);
 
 		if (int_signal) {
 			(void)uni_closedir(&d, remoteglobbing);
@@ -242,6 +348,455 @@ tokenmatch2(char *path, const char *token, List *tokens, int remoteglobbing)
 }
 
 
+/*
+ * Matches token, which followed a `**' component, against everything below
+ * path: each entry of path and of the directories below it is matched
+ * against the first component of token like in tokenmatch2, and the rest
+ * of token against the entries that match.  When token is NULL, every
+ * entry below path matches.  As with `*', names starting with a dot are not
+ * matched and such directories are not entered, neither are symbolic links.
+ *
+ * The directories are read breadth-first.  For remote globbing and
+ * variable `parallel' larger than one, that many workers read them, so
+ * several directories are being listed at once; the entries they find are
+ * matched meanwhile.  The matches thus come in the order they were found.
+ * Returns like tokenmatch2.
+ */
+static int
+globstar(const char *path, char *token, List *tokens, int remoteglobbing,
+    int record)
+{
+	Walk	w;
+	Walkent *ent, *next;
+	Walkdir *d;
+	char   *ntoken;
+	Pattern *pat;
+	pthread_t      *threads;
+	int	nthreads;
+	int	ret;
+
+	/* component to match is token, token for the matches is ntoken */
+	ntoken = NULL;
+	if (token != NULL && (ntoken = strchr(token, '/')) != NULL) {
+		*ntoken = '\0';
+		if (*++ntoken == '/')
+			ntoken += strspn(ntoken, "/");
+	}
+	pat = (token != NULL) ? pattern_compile(token) : NULL;
+
+	(void)pthread_mutex_init(&w.lock, NULL);
+	(void)pthread_cond_init(&w.cond, NULL);
+	w.remote = remoteglobbing;
+	w.dirs = w.dirstail = NULL;
+	w.ents = w.entstail = NULL;
+	w.busy = 0;
+	w.nworkers = 0;
+	w.stop = 0;
+	walk_adddir(&w, xstrdup(path));
+
+	/* a `**' below a `**' is walked by this thread alone */
+	threads = NULL;
+	nthreads = 0;
+	if (remoteglobbing && !walking && getvariable_int("parallel") > 1) {
+		nthreads = getvariable_int("parallel");
+		threads = xmalloc(sizeof threads[0] * nthreads);
+		nthreads = walk_start(&w, threads, nthreads);
+		walking = nthreads > 0;
+	}
+
+	ret = GLB_OK;
+	while (ret == GLB_OK) {
+		(void)pthread_mutex_lock(&w.lock);
+		while (!int_signal && w.ents == NULL && w.nworkers > 0 &&
+		    (w.dirs != NULL || w.busy > 0))
+			walk_wait(&w);
+		if (int_signal) {
+			(void)pthread_mutex_unlock(&w.lock);
+			errno = EINTR;
+			ret = GLB_INTR;
+			break;
+		}
+
+		/* take all entries found, or read a directory when alone */
+		ent = w.ents;
+		w.ents = w.entstail = NULL;
+		d = NULL;
+		if (ent == NULL && w.dirs != NULL) {
+			d = w.dirs;
+			if ((w.dirs = d->next) == NULL)
+				w.dirstail = NULL;
+			++w.busy;
+		}
+		(void)pthread_mutex_unlock(&w.lock);
+
+		if (ent == NULL && d == NULL)
+			break;		/* nothing left to read */
+		if (d != NULL)
+			walk_readdir(&w, d);
+
+		for (; ent != NULL; ent = next) {
+			next = ent->next;
+			if (ret == GLB_OK && (pat == NULL ? *ent->name != '.' :
+			    pattern_match(pat, ent->name)))
+				ret = tokenmatch2(ent->path, ent->type,
+				    ent->hasst ? &ent->st : NULL, ntoken, tokens,
+				    remoteglobbing, record);
+			free(ent->path);
+			free(ent);
+		}
+	}
+
+	walk_finish(&w, threads, nthreads);
+	if (pat != NULL)
+		pattern_free(pat);
+	if (nthreads > 0)
+		walking = 0;
+	free(threads);
+	return ret;
+}
+
+
+/*
+ * Starts at most n workers for w, stored in threads, and returns how many
+ * were started.  Signals are handled by the calling thread, the workers
+ * only check int_signal.
+ */
+static int
+walk_start(Walk *w, pthread_t *threads, int n)
+{
+	int	i;
+	sigset_t	set, oset;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGWINCH);
+	sigaddset(&set, SIGALRM);
+	(void)pthread_sigmask(SIG_BLOCK, &set, &oset);
+
+	/* counted before they run, a worker that cannot attach stops at once */
+	(void)pthread_mutex_lock(&w->lock);
+	for (i = 0; i < n; ++i) {
+		if (pthread_create(&threads[i], NULL, walk_worker, w) != 0)
+			break;
+		++w->nworkers;
+	}
+	(void)pthread_mutex_unlock(&w->lock);
+
+	(void)pthread_sigmask(SIG_SETMASK, &oset, NULL);
+	return i;
+}
+
+
+/*
+ * Stops the nthreads workers of w (threads may be NULL when there are
+ * none) and frees what is left of the walk.
+ */
+static void
+walk_finish(Walk *w, pthread_t *threads, int nthreads)
+{
+	int	i;
+	Walkdir *d;
+	Walkent *ent;
+
+	(void)pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	(void)pthread_cond_broadcast(&w->cond);
+	(void)pthread_mutex_unlock(&w->lock);
+
+	for (i = 0; i < nthreads; ++i)
+		(void)pthread_join(threads[i], NULL);
+
+	while ((d = w->dirs) != NULL) {
+		w->dirs = d->next;
+		free(d->path);
+		free(d);
+	}
+	while ((ent = w->ents) != NULL) {
+		w->ents = ent->next;
+		free(ent->path);
+		free(ent);
+	}
+	(void)pthread_mutex_destroy(&w->lock);
+	(void)pthread_cond_destroy(&w->cond);
+}
+
+
+/*
+ * Start routine of the workers of a walk.  Reads queued directories until
+ * none are left and none are being read, or until the walk is stopped.
+ */
+static void *
+walk_worker(void *arg)
+{
+	Walk   *w;
+	Walkdir *d;
+	int	attached;
+
+	w = (Walk *)arg;
+	attached = smb_worker_attach() == 0;
+
+	(void)pthread_mutex_lock(&w->lock);
+	while (attached) {
+		while (!w->stop && !int_signal && w->dirs == NULL && w->busy > 0)
+			walk_wait(w);
+		if (w->stop || int_signal || (d = w->dirs) == NULL)
+			break;
+		if ((w->dirs = d->next) == NULL)
+			w->dirstail = NULL;
+		++w->busy;
+		(void)pthread_mutex_unlock(&w->lock);
+
+		walk_readdir(w, d);
+
+		(void)pthread_mutex_lock(&w->lock);
+	}
+	--w->nworkers;
+	(void)pthread_cond_broadcast(&w->cond);
+	(void)pthread_mutex_unlock(&w->lock);
+
+	if (attached)
+		smb_worker_detach();
+	return NULL;
+}
+
+
+/*
+ * Reads directory d, which was taken from the queue of w, queues the
+ * directories in it and hands its entries to the globbing thread.  A
+ * directory that cannot be read is a dead end, like in tokenmatch2.
+ */
+static void
+walk_readdir(Walk *w, Walkdir *d)
+{
+	Dir	dir;
+	Walkent *ent, *head, *last;
+	const char *dname;
+	int	(*lstatptr)(const char *, struct stat *);
+
+	head = last = NULL;
+	lstatptr = w->remote ? smb_stat : lstat;
+
+	if (uni_opendir((*d->path == '\0') ? "." : d->path, &dir, w->remote) > 0) {
+		while (!int_signal && uni_readdir(&dir, w->remote) != -1) {
+			dname = w->remote ? dir.dirent.sdent->name :
+			    dir.dirent.dent->d_name;
+			if (streql(dname, ".") || streql(dname, ".."))
+				continue;
+
+			ent = xmalloc(sizeof (Walkent));
+			ent->path = catpath(d->path, dname);
+			ent->name = ent->path + strlen(ent->path) - strlen(dname);
+			ent->type = uni_direnttype(&dir, w->remote, &ent->st);
+			ent->hasst = ent->st.st_mode != 0;
+
+			/* whether to enter it must be known, do not follow links */
+			if (ent->type == ENT_UNKNOWN && *dname != '.') {
+				if ((*lstatptr)(ent->path, &ent->st) == 0) {
+					ent->hasst = !S_ISLNK(ent->st.st_mode);
+					if (S_ISDIR(ent->st.st_mode))
+						ent->type = ENT_DIR;
+					else if (S_ISREG(ent->st.st_mode))
+						ent->type = ENT_FILE;
+				}
+			}
+			if (ent->type == ENT_DIR && *dname != '.')
+				walk_adddir(w, xstrdup(ent->path));
+
+			ent->next = NULL;
+			if (last == NULL)
+				head = ent;
+			else
+				last->next = ent;
+			last = ent;
+		}
+		(void)uni_closedir(&dir, w->remote);
+	}
+
+	(void)pthread_mutex_lock(&w->lock);
+	if (head != NULL) {
+		if (w->entstail == NULL)
+			w->ents = head;
+		else
+			w->entstail->next = head;
+		w->entstail = last;
+	}
+	--w->busy;
+	(void)pthread_cond_broadcast(&w->cond);
+	(void)pthread_mutex_unlock(&w->lock);
+
+	free(d->path);
+	free(d);
+}
+
+
+/* Queues directory path, which is taken over, to be read by the walk w. */
+static void
+walk_adddir(Walk *w, char *path)
+{
+	Walkdir *d;
+
+	d = xmalloc(sizeof (Walkdir));
+	d->path = path;
+	d->next = NULL;
+
+	(void)pthread_mutex_lock(&w->lock);
+	if (w->dirstail == NULL)
+		w->dirs = d;
+	else
+		w->dirstail->next = d;
+	w->dirstail = d;
+	(void)pthread_cond_broadcast(&w->cond);
+	(void)pthread_mutex_unlock(&w->lock);
+}
+
+
+/*
+ * Waits for a change of w, with w->lock held.  Returns after WALK_WAITMSEC
+ * at the latest, so int_signal is noticed.
+ */
+static void
+walk_wait(Walk *w)
+{
+	struct timeval	now;
+	struct timespec	ts;
+
+	(void)gettimeofday(&now, NULL);
+	ts.tv_sec = now.tv_sec;
+	ts.tv_nsec = now.tv_usec * 1000 + WALK_WAITMSEC * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+	}
+	(void)pthread_cond_timedwait(&w->cond, &w->lock, &ts);
+}
+
+
+/* Returns name in directory path (which may be "" or "/"), malloc'ed. */
+static char *
+catpath(const char *path, const char *name)
+{
+	char   *npath;
+
+	npath = xmalloc(strlen(path) + 1 + strlen(name) + 1);
+	*npath = '\0';
+	if (*path != '\0') {
+		strcat(npath, path);
+		if (!streql(path, "/"))
+			strcat(npath, "/");
+	}
+	strcat(npath, name);
+	return npath;
+}
+
+
+/* Returns whether token has a `**' component. */
+static int
+hasglobstar(const char *token)
+{
+	const char *cp;
+
+	for (cp = token; (cp = strstr(cp, "**")) != NULL; cp += 2)
+		if ((cp == token || cp[-1] == '/') &&
+		    (cp[2] == '\0' || cp[2] == '/'))
+			return 1;
+	return 0;
+}
+
+
+/*
+ * Adds path to tokens as a match, with a trailing slash when isdir.  When
+ * record is set it is entered in the match table, with its attributes st
+ * when known (st may be NULL).
+ */
+static void
+addmatch(const char *path, int isdir, const struct stat *st, List *tokens,
+    int record)
+{
+	char   *newtoken;
+	Match  *m;
+	unsigned int	h;
+
+	/* + 2 because token could be a directory and get an extra / */
+	newtoken = xmalloc(strlen(path) + 2);
+	strcpy(newtoken, path);
+
+	if (isdir)
+		strcat(newtoken, "/");
+
+	list_add(tokens, newtoken);
+
+	if (!record)
+		return;
+
+	m = xmalloc(sizeof (Match));
+	m->path = xstrdup(newtoken);
+	if (st != NULL) {
+		m->known = GLM_ATTRS;
+		m->st = *st;
+	} else {
+		m->known = GLM_TYPE;
+		memset(&m->st, 0, sizeof m->st);
+		m->st.st_mode = isdir ? S_IFDIR : S_IFREG;
+	}
+	h = hashmatch(newtoken);
+	m->next = matches[h];
+	matches[h] = m;
+}
+
+
+/*
+ * Looks up path among the matches of the last smbglob.  When it is one,
+ * what globbing learned about it is stored in st and GLM_TYPE or GLM_ATTRS
+ * is returned.  With GLM_TYPE only the file type bits of st_mode are
+ * valid, with GLM_ATTRS also the permissions, size and modification time,
+ * as a directory entry would have them.  Otherwise GLM_NONE is returned.
+ * Commands use this to avoid stat'ing their arguments once more.
+ */
+int
+globmatch(const char *path, struct stat *st)
+{
+	Match  *m;
+
+	for (m = matches[hashmatch(path)]; m != NULL; m = m->next)
+		if (streql(m->path, path)) {
+			*st = m->st;
+			return m->known;
+		}
+	return GLM_NONE;
+}
+
+
+/* Forgets the matches of the last smbglob. */
+void
+globmatch_clear(void)
+{
+	int	i;
+	Match  *m, *next;
+
+	for (i = 0; i < MATCH_BUCKETS; ++i) {
+		for (m = matches[i]; m != NULL; m = next) {
+			next = m->next;
+			free(m->path);
+			free(m);
+		}
+		matches[i] = NULL;
+	}
+}
+
+
+/* Returns the bucket of path in the match table. */
+static unsigned int
+hashmatch(const char *path)
+{
+	unsigned int	h;
+
+	h = 5381;
+	while (*path != '\0')
+		h = h * 33 + (unsigned char)*path++;
+	return h % MATCH_BUCKETS;
+}
+
+
 /* Returns whether argument contains globbable characters */
 static int
 globbable(const char *pattern)
@@ -284,23 +839,53 @@ uni_closedir(Dir *dp, int remoteglobbing)
 }
 
 
+/*
+ * Returns the type of the entry last read from dp, one of ENT_*.  Its
+ * attributes are stored in st when the entry has them, otherwise
+ * st_mode is 0.
+ */
 static int
-uni_exists(const char *path, int remoteglobbing)
+uni_direnttype(Dir *dp, int remoteglobbing, struct stat *st)
 {
-	struct stat st;
-	int (*statptr)(const char *, struct stat *);
+	const Smbdirent *sdent;
+
+	memset(st, 0, sizeof *st);
+	if (remoteglobbing) {
+		sdent = dp->dirent.sdent;
+		st->st_mode = sdent->mode;
+		st->st_size = sdent->size;
+		st->st_mtime = sdent->mtime;
+		switch (sdent->type) {
+		case SMB_DIR:	return ENT_DIR;
+		case SMB_FILE:	return ENT_FILE;
+		default:	return ENT_UNKNOWN;
+		}
+	}
 
-	statptr = remoteglobbing ? smb_stat : stat;
-	return ((*statptr)(path, &st) == 0) ? 1 : 0;
+#ifdef DT_UNKNOWN
+	/* symbolic links are followed, so they need a stat */
+	switch (dp->dirent.dent->d_type) {
+	case DT_DIR:	return ENT_DIR;
+	case DT_REG:	return ENT_FILE;
+	default:	return ENT_UNKNOWN;
+	}
+#else
+	return ENT_UNKNOWN;
+#endif
 }
 
 
+/*
+ * Returns the type of path, one of ENT_* except ENT_UNKNOWN, its attributes
+ * are stored in st.
+ */
 static int
-uni_isdir(const char *path, int remoteglobbing)
+uni_type(const char *path, int remoteglobbing, struct stat *st)
 {
-	struct stat st;
 	int (*statptr)(const char *, struct stat *);
 
 	statptr = remoteglobbing ? smb_stat : stat;
-	return ((*statptr)(path, &st) == 0 && S_ISDIR(st.st_mode)) ? 1 : 0;
+	if ((*statptr)(path, st) != 0)
+		return ENT_NONE;
+	return S_ISDIR(st->st_mode) ? ENT_DIR : ENT_FILE;
 }
@@ -2,7 +2,7 @@
 
 #include "samblah.h"
 
-static void     printlist(List *, int[], int);
+static void     printlist(Smblisting *, int[], int, int);
 
 
 /*
@@ -12,12 +12,11 @@ static void     printlist(List *, int[], int);
 void
 smbhlp_list_hosts(const char *workgroup, int lopt)
 {
-	List   *list;
+	Smblisting     *list;
 	int	types[] = { SMB_SERVER, -1 };
 	const char     *errmsg;
 
-	list = list_new();
-	errmsg = smb_hosts(workgroup, list);
+	errmsg = smb_hosts(workgroup, &list);
 	if (errmsg != NULL) {
 		if (workgroup == NULL)
 			cmdwarnx("listing all hosts: %s", errmsg);
@@ -26,8 +25,8 @@ smbhlp_list_hosts(const char *workgroup, int lopt)
 		return;
 	}
 
-	printlist(list, types, lopt);
-	list_free(list);
+	printlist(list, types, lopt, 1);
+	smblisting_free(list);
 }
 
 
@@ -40,43 +39,26 @@ void
 smbhlp_list_shares(const char *user, const char *pass, const char *host,
     int aopt, int lopt)
 {
-	int	i;
 	int	types[] = { SMB_FILE_SHARE, SMB_PRINTER_SHARE,
 			    SMB_COMMS_SHARE, SMB_IPC_SHARE, -1 };
-	List   *list;
-	List   *newlist;
-	Smbdirent  *share;
+	Smblisting     *list;
 	const char *errmsg;
 
-	list = list_new();
-	errmsg = smb_shares(user, pass, host, list);
+	errmsg = smb_shares(user, pass, host, &list);
 	if (errmsg != NULL) {
 		cmdwarnx("listing shares on %s: %s", host, errmsg);
 		return;
 	}
 
-	if (!aopt) {
-		/*
-		 * when not printing `hidden' shares, truncate accepted share
-		 * types.  also remove all shares with a name ending with `$'
-		 */
+	/*
+	 * when not printing `hidden' shares, truncate accepted share
+	 * types.  printlist also skips shares with a name ending with `$'
+	 */
+	if (!aopt)
 		types[1] = -1;
 
-		newlist = list_new();
-		for (i = 0; i < list_count(list); ++i) {
-			share = (Smbdirent *)list_elem(list, i);
-			if (strlen(share->name) > 0 && share->name[strlen(share->name) - 1] != '$')
-				list_add(newlist, share);
-			else
-				free(share);
-		}
-		/* don't free shares, only free List container */
-		list_free_func(list, NULL);
-		list = newlist; newlist = NULL;
-	}
-
-	printlist(list, types, lopt);
-	list_free(list);
+	printlist(list, types, lopt, aopt);
+	smblisting_free(list);
 }
 
 
@@ -85,18 +67,17 @@ void
 smbhlp_list_workgroups(void)
 {
 	int	types[] = { SMB_WORKGROUP, -1 };
-	List   *list;
+	Smblisting     *list;
 	const char *errmsg;
 
-	list = list_new();
-	errmsg = smb_workgroups(list);
+	errmsg = smb_workgroups(&list);
 	if (errmsg != NULL) {
 		cmdwarnx("listing workgroups: %s", errmsg);
 		return;
 	}
 
-	printlist(list, types, 0);
-	list_free(list);
+	printlist(list, types, 0, 1);
+	smblisting_free(list);
 }
 
 
@@ -206,7 +187,7 @@ smbhlp_remove(const char *path, int ropt)
 	int	dh;
 	Str    *nextpath;
 	struct stat	st;
-	Smbdirent      *dent;
+	const Smbdirent *dent;
 
 	/* only remove one file */
 	if (!ropt)  {
@@ -270,19 +251,25 @@ smbhlp_remove(const char *path, int ropt)
 }
 
 
+/*
+ * Prints the entries in list of one of types, the names only unless lopt
+ * is set.  Unless hidden is set, entries with a name ending in `$' are
+ * skipped.
+ */
 static void
-printlist(List *list, int types[], int lopt)
+printlist(Smblisting *list, int types[], int lopt, int hidden)
 {
 	int	i;
 	int	typeindex;
+	size_t	len;
 	List   *strlist;
-	Smbdirent      *dirent;
+	const Smbdirent *dirent;
 
 	if (!lopt)
 		strlist = list_new();
 
-	for (i = 0; i < list_count(list); ++i) {
-		dirent = (Smbdirent *)list_elem(list, i);
+	for (i = 0; i < smblisting_count(list); ++i) {
+		dirent = smblisting_entry(list, i);
 
 		for (typeindex = 0; types[typeindex] != -1; ++typeindex) {
 			if (dirent->type == types[typeindex])
@@ -291,6 +278,10 @@ printlist(List *list, int types[], int lopt)
 		if (types[typeindex] == -1)
 			continue;
 
+		len = strlen(dirent->name);
+		if (!hidden && (len == 0 || dirent->name[len - 1] == '$'))
+			continue;
+
 		if (lopt)
 			printf("%-28s%s\n", dirent->name, dirent->comment);
 		else
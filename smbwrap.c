@@ -1,5 +1,6 @@
 /* $Id$ */
 
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -8,52 +9,214 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <libsmbclient.h>
 
-#include "list.h"
 #include "smbwrap.h"
 
 #define streql(s1, s2)  (strcmp(s1, s2) == 0)
 
+enum {
+	SESSION_MAXFILES = 256,	/* open files and directories per session */
+	STATCACHE_BUCKETS = 1024,
+	STATCACHE_MAXENTRIES = 8192,	/* attributes are dropped when full */
+	DIRCACHE_BUCKETS = 64,
+	DIRCACHE_MAXLISTINGS = 256,	/* listings are dropped when full */
+	DIRCACHE_MAXBYTES = 128 * 1024 * 1024,
+	ARENA_BLOCKSIZE = 64 * 1024,	/* for names and comments of listings */
+	LISTING_MINENTRIES = 64
+};
 
-/* Non-zero if connected to a share, not connected by default. */
+/* DOS attribute of directories, as in libsmb_file_info.attrs */
+#define FILE_ATTRIBUTE_DIRECTORY	0x10
+
+
+/* Non-zero if the default session is connected to a share. */
 int	connected = 0;
 
 
 /*
- * These variables contain information about the current connection
- * as initiated using smb_connect.
- * smb_user may be the empty string, in which case authentication
- * is done as `guest' which seems to be what some Windows versions
- * accept.
+ * Attributes of remote files and listings of remote directories, keyed by
+ * the path within the share as produced by canonpath, so the many smb_stat
+ * calls for the same file and the many listings of the same directory (ls,
+ * globbing, completion) during one command cost one round trip.  Entries
+ * expire after cachettl seconds and are removed when the file or directory
+ * is changed through a session using the cache.  A session and its clones
+ * share one cache, lock protects it.
+ */
+typedef struct Statentry Statentry;
+typedef struct Dirlisting Dirlisting;
+typedef struct Cache Cache;
+
+struct Statentry {
+	char   *path;
+	struct stat	st;
+	time_t	expires;
+	Statentry      *next;
+};
+
+/*
+ * A listing of a directory, or of workgroups, hosts or shares.  The
+ * entries are kept in one array, their names and comments in an arena of
+ * blocks that never move, so the entries can point into it.  Entries
+ * without a comment point to an empty string outside the arena.
+ */
+typedef struct Arenablock Arenablock;
+
+struct Arenablock {
+	Arenablock     *next;
+	size_t	used, size;
+	/* size bytes of data follow */
+};
+
+struct Smblisting {
+	Smbdirent      *ents;
+	int	count, max;
+	Arenablock     *arena;		/* block being filled first */
+	size_t	bytes;			/* memory used by the listing */
+};
+
+/*
+ * The listing of a directory as read by smbs_readdir.  A listing is shared
+ * by the cache and the handles reading it, refs counts them and is
+ * protected by the lock of the cache.
+ */
+struct Dirlisting {
+	char   *path;
+	int	refs;
+	time_t	expires;
+	Smblisting     *list;
+	Dirlisting     *next;
+};
+
+struct Cache {
+	pthread_mutex_t lock;
+	int	refs;			/* sessions using the cache */
+
+	int	stats;
+	unsigned long	stathits, statmisses;
+	Statentry      *statbuckets[STATCACHE_BUCKETS];
+
+	int	listings;
+	size_t	listingbytes;
+	unsigned long	dirhits, dirmisses;
+	unsigned long	generation;	/* changed when names come or go */
+	Dirlisting     *dirbuckets[DIRCACHE_BUCKETS];
+};
+
+/*
+ * An open file or directory of a session.  A directory is read either from
+ * the server through f, while its listing is collected in fill, or from the
+ * cached listing list, in which case f is NULL.
  */
-static char smb_user[SMB_USER_MAXLEN + 1];
-static char smb_pass[SMB_PASS_MAXLEN + 1];
-static char smb_host[SMB_HOST_MAXLEN + 1];
-static char smb_share[SMB_SHARE_MAXLEN + 1];
-static char smb_path[SMB_PATH_MAXLEN + 1];
+typedef struct Handle Handle;
+
+struct Handle {
+	int	used;
+	int	isdir;
+	SMBCFILE       *f;
+	char   *path;
+	int	writable;
+	Dirlisting     *list;		/* cached listing being read */
+	int	pos;			/* index of next entry in list */
+	Dirlisting     *fill;		/* listing being read from server */
+	unsigned long	generation;	/* of the cache when fill started */
+};
+
 
-/* Username and password to use when doing a listing. */
-static int  doing_listing;
-static char list_user[SMB_USER_MAXLEN + 1];
-static char list_pass[SMB_PASS_MAXLEN + 1];
+/*
+ * A session is a libsmbclient context together with the connection it is
+ * used for, as initiated by smbs_connect, and its working directory.
+ * The file and directory handles returned by the smbs_* functions are
+ * indices in files.  A session must only be used by one thread at a time,
+ * different sessions may be used concurrently.
+ * user may be the empty string, in which case authentication is done as
+ * `guest' which seems to be what some Windows versions accept.
+ */
+struct SmbSession {
+	SMBCCTX	       *ctx;
+	int	connected;
+	char	user[SMB_USER_MAXLEN + 1];
+	char	pass[SMB_PASS_MAXLEN + 1];
+	char	host[SMB_HOST_MAXLEN + 1];
+	char	share[SMB_SHARE_MAXLEN + 1];
+	char	path[SMB_PATH_MAXLEN + 1];
+
+	/* username and password to use when doing a listing */
+	int	doing_listing;
+	char	list_user[SMB_USER_MAXLEN + 1];
+	char	list_pass[SMB_PASS_MAXLEN + 1];
+
+	Handle	files[SESSION_MAXFILES];
+	Cache  *cache;			/* NULL when not connected */
+	Smbdirent	dent;		/* returned by smbs_readdir */
+	char	errbuf[SMB_ERRMSG_MAXLEN];
+
+	/*
+	 * the uri of the share, which each uri passed to libsmbclient
+	 * starts with, and that of the working directory without the
+	 * password, for smbs_getcwd.  Set on connect and chdir.
+	 */
+	char	prefix[SMB_URI_MAXLEN + 1];
+	size_t	prefixlen;
+	char	cwdbuf[SMB_URI_MAXLEN + 1];
+};
 
 
-static int      listuri(const char *, List *);
-static void     smbc_dirent2Smbdirent(const struct smbc_dirent *from, Smbdirent *to);
-static void     auth_callback(const char *, const char *, char *, int, char *, int, char *, int);
-static void     makeuri(char *);
-static void     makecwduri(char *);
-static void     makeuri_generic(char *, int);
-static int      evaluri(char *, const char *);
-static int      evalpath(char *, const char *);
-static char    *strrslash(char *, char *);
+/*
+ * The smb_* functions use the session of the calling thread: its worker
+ * session when it has one (see smb_worker_attach), otherwise the default
+ * session.
+ */
+static SmbSession      *defsession;
+static pthread_key_t	workerkey;
+
+/* Lifetime of entries in the stat cache in seconds, 0 disables the cache. */
+static int	cachettl = 5;
+
+
+static int      listuri(SmbSession *, const char *, Smblisting **);
+static Smblisting      *smblisting_new(void);
+static int      smblisting_add(Smblisting *, const Smbdirent *);
+static const char      *smblisting_strdup(Smblisting *, const char *);
+static void     auth_callback(SMBCCTX *, const char *, const char *, char *, int, char *, int, char *, int);
+static SmbSession      *cursession(void);
+static int      addhandle(SmbSession *, const char *);
+static int      addfile(SmbSession *, SMBCFILE *, const char *, int, int);
+static Handle  *gethandle(SmbSession *, int);
+static SMBCFILE        *getfile(SmbSession *, int);
+static void     releasehandle(SmbSession *, int);
+static void     closeall(SmbSession *);
+static Cache   *cache_new(void);
+static void     cache_release(Cache *);
+static unsigned int     hashpath(const char *);
+static int      insubtree(const char *, const char *);
+static int      statcache_get(Cache *, const char *, struct stat *);
+static void     statcache_put(Cache *, const char *, const struct stat *);
+static void     statcache_remove(Cache *, const char *, int);
+static void     statcache_clear(Cache *);
+static Dirlisting      *dirlisting_new(const char *);
+static void     dirlisting_free(Dirlisting *);
+static void     dirlisting_release(Cache *, Dirlisting *);
+static Dirlisting      *dircache_get(Cache *, const char *);
+static Dirlisting      *dircache_find(Cache *, const char *);
+static void     dircache_put(Cache *, Dirlisting *, unsigned long);
+static void     dircache_remove(Cache *, const char *, int, int);
+static void     dircache_clear(Cache *);
+static void     invalidate(SmbSession *, const char *, int);
+static void     invalidate_contents(SmbSession *, const char *);
+static const Smbdirent *nextdirent(SmbSession *, Handle *);
+static size_t   makeprefix(SmbSession *, char *, const char *);
+static void     makecwduri(SmbSession *);
+static const char      *evaluri(SmbSession *, char *, const char *);
+static int      canonpath(char *, const char *, const char *);
 static int      validhost(const char *);
 static int      validshare(const char *);
 static int      validuser(const char *);
@@ -63,32 +226,265 @@ static int      validpath(const char *);
 
 
 /*
- * Initializes the samba library.  On success returns non-zero,
- * otherwise returns zero.
+ * Initializes the samba library and the default session.  On success
+ * returns non-zero, otherwise returns zero.
  */
 int
 smb_init(void)
 {
-	doing_listing = 0;
+	if (pthread_key_create(&workerkey, NULL) != 0)
+		return 0;
+
+	/* sessions of worker threads may be used concurrently */
+	smbc_thread_posix();
+
+	defsession = smbs_new();
+	return defsession != NULL;
+}
+
+
+/*
+ * Creates a session which is not connected.  On failure NULL is returned
+ * and errno is set.
+ */
+SmbSession *
+smbs_new(void)
+{
+	SmbSession     *s;
+	int	save_errno;
+
+	s = calloc(1, sizeof (SmbSession));
+	if (s == NULL)
+		return NULL;
+
+	s->ctx = smbc_new_context();
+	if (s->ctx == NULL) {
+		free(s);
+		return NULL;
+	}
+	smbc_setDebug(s->ctx, 0);
+	smbc_setOptionUserData(s->ctx, s);
+	smbc_setFunctionAuthDataWithContext(s->ctx, auth_callback);
+
+	if (smbc_init_context(s->ctx) == NULL) {
+		save_errno = errno;
+		(void)smbc_free_context(s->ctx, 1);
+		free(s);
+		errno = save_errno;
+		return NULL;
+	}
+	strcpy(s->path, "/");
+	return s;
+}
+
+
+/*
+ * Creates a session connected to the same share with the same credentials
+ * and working directory as s, without checking the connection.  The stat
+ * cache of s is shared.  On failure NULL is returned and errno is set.
+ */
+SmbSession *
+smbs_clone(const SmbSession *s)
+{
+	SmbSession     *c;
+
+	if ((c = smbs_new()) == NULL)
+		return NULL;
+
+	c->connected = s->connected;
+	if ((c->cache = s->cache) != NULL) {
+		(void)pthread_mutex_lock(&c->cache->lock);
+		++c->cache->refs;
+		(void)pthread_mutex_unlock(&c->cache->lock);
+	}
+	strcpy(c->user, s->user);
+	strcpy(c->pass, s->pass);
+	strcpy(c->host, s->host);
+	strcpy(c->share, s->share);
+	strcpy(c->path, s->path);
+	strcpy(c->prefix, s->prefix);
+	c->prefixlen = s->prefixlen;
+	strcpy(c->cwdbuf, s->cwdbuf);
+	return c;
+}
+
+
+/* Closes the files and directories still open in s and frees it. */
+void
+smbs_free(SmbSession *s)
+{
+	if (s == NULL)
+		return;
+
+	(void)smbs_disconnect(s);
+	(void)smbc_free_context(s->ctx, 1);
+	free(s);
+}
+
+
+/*
+ * Sets the lifetime of entries in the stat caches to seconds, 0 disables
+ * caching.  Must not be called while workers exist.
+ */
+void
+smb_setcachettl(int seconds)
+{
+	cachettl = seconds;
+}
+
+
+/*
+ * Stores the statistics of the cache of s in cs.  All are 0 when s is not
+ * connected.
+ */
+void
+smbs_cachestats(SmbSession *s, Smbcachestats *cs)
+{
+	memset(cs, 0, sizeof *cs);
+	if (s->cache == NULL)
+		return;
+
+	(void)pthread_mutex_lock(&s->cache->lock);
+	cs->stats = s->cache->stats;
+	cs->stathits = s->cache->stathits;
+	cs->statmisses = s->cache->statmisses;
+	cs->listings = s->cache->listings;
+	cs->dirhits = s->cache->dirhits;
+	cs->dirmisses = s->cache->dirmisses;
+	(void)pthread_mutex_unlock(&s->cache->lock);
+}
+
+
+/*
+ * Forgets the cached attributes and listings of path and everything below
+ * it, or everything when path is NULL.
+ * Possible errno values: ENAMETOOLONG.
+ */
+int
+smbs_refresh(SmbSession *s, const char *path)
+{
+	char	uribuf[SMB_URI_MAXLEN + 1];
+	const char     *rpath;
+
+	if ((rpath = evaluri(s, uribuf, (path == NULL) ? "/" : path)) == NULL)
+		return -1;
+
+	statcache_remove(s->cache, rpath, 1);
+	dircache_remove(s->cache, rpath, 1, 1);
+	return 0;
+}
+
+
+/*
+ * Returns whether a and b are connected to the same share and share their
+ * cache, as a session and its clones do until one of them reconnects.
+ */
+int
+smbs_samecache(const SmbSession *a, const SmbSession *b)
+{
+	return a->cache != NULL && a->cache == b->cache;
+}
+
+
+/*
+ * Returns whether a listing of directory path is cached, so reading it
+ * takes no round trip.  Does not count as a hit or miss.
+ */
+int
+smbs_listed(SmbSession *s, const char *path)
+{
+	char	uribuf[SMB_URI_MAXLEN + 1];
+	const char     *rpath;
+	int	listed;
+
+	if (s->cache == NULL || cachettl == 0 ||
+	    (rpath = evaluri(s, uribuf, path)) == NULL)
+		return 0;
+
+	(void)pthread_mutex_lock(&s->cache->lock);
+	listed = dircache_find(s->cache, rpath) != NULL;
+	(void)pthread_mutex_unlock(&s->cache->lock);
+	return listed;
+}
+
+/* Returns the default session. */
+SmbSession *
+smb_getsession(void)
+{
+	return defsession;
+}
+
+
+/*
+ * Makes s the default session, the session used by the smb_* functions of
+ * threads without a worker session, and returns the previous one.  Must not
+ * be called while workers exist.
+ */
+SmbSession *
+smb_setsession(SmbSession *s)
+{
+	SmbSession     *prev;
+
+	prev = defsession;
+	defsession = s;
+	connected = s->connected;
+	return prev;
+}
+
+
+/*
+ * Gives the calling thread a session of its own, a clone of the default
+ * session, all smb_* calls by this thread will use it instead of the
+ * default session.  Changes to the default session after the call are not
+ * seen by the worker.  On success 0 is returned, otherwise -1 with errno
+ * set.
+ */
+int
+smb_worker_attach(void)
+{
+	SmbSession     *s;
+	int	save_errno;
+
+	if ((s = smbs_clone(defsession)) == NULL)
+		return -1;
 
-	/* initialize libsmbclient, second argument is debug level */
-	if (smbc_init(auth_callback, 0) == 0)
-		return 1;
+	if ((errno = pthread_setspecific(workerkey, s)) != 0) {
+		save_errno = errno;
+		smbs_free(s);
+		errno = save_errno;
+		return -1;
+	}
 	return 0;
 }
 
 
 /*
- * Connects to host and share, change to path.  user, pass and path
- * may be NULL.  Must only be called when `connected' is false.
+ * Closes the files still open by the calling thread and frees its
+ * session.  Does nothing when smb_worker_attach was not called.
+ */
+void
+smb_worker_detach(void)
+{
+	SmbSession     *s;
+
+	if ((s = pthread_getspecific(workerkey)) == NULL)
+		return;
+
+	smbs_free(s);
+	(void)pthread_setspecific(workerkey, NULL);
+}
+
+
+/*
+ * Connects s to host and share, change to path.  user, pass and path
+ * may be NULL.  Must only be called when s is not connected.
  * On success NULL is returned, otherwise a string describing the
  * error is returned.
  */
 char *
-smb_connect(const char *host, const char *share, const char *user,
-    const char *pass, const char *path)
+smbs_connect(SmbSession *s, const char *host, const char *share,
+    const char *user, const char *pass, const char *path)
 {
-	static char errbuf[SMB_ERRMSG_MAXLEN];
 	int	r;
 	const char *errmsg;
 
@@ -97,14 +493,19 @@ smb_connect(const char *host, const char *share, const char *user,
 		errno = EINVAL;
 	} else {
 		/* fill buffers */
-		strcpy(smb_host, host);
-		strcpy(smb_share, share);
-		strcpy(smb_user, (user != NULL) ? user : "");
-		strcpy(smb_pass, (pass != NULL) ? pass : "");
-		strcpy(smb_path, "/");
-
-		if (smb_chdir((path == NULL) ? "." : path) == 0) {
-			connected = 1;
+		strcpy(s->host, host);
+		strcpy(s->share, share);
+		strcpy(s->user, (user != NULL) ? user : "");
+		strcpy(s->pass, (pass != NULL) ? pass : "");
+		strcpy(s->path, "/");
+		s->prefixlen = makeprefix(s, s->prefix, s->pass);
+		makecwduri(s);
+
+		/* a new connection, attributes may have changed meanwhile */
+		cache_release(s->cache);
+		if ((s->cache = cache_new()) != NULL &&
+		    smbs_chdir(s, (path == NULL) ? "." : path) == 0) {
+			s->connected = 1;
 			return NULL;
 		}
 	}
@@ -117,58 +518,66 @@ smb_connect(const char *host, const char *share, const char *user,
 	default:        errmsg = strerror(errno);
 	}
 
-	/* XXX use makeuri and friends for this */
-	r = snprintf(errbuf, sizeof errbuf, "smb://%s/%s%s%s: %s", host,
+	/* XXX use makeprefix and friends for this */
+	r = snprintf(s->errbuf, sizeof s->errbuf, "smb://%s/%s%s%s: %s", host,
 	    share, (path == NULL) ? "" : ((*path == '/') ? "" : "/"),
 	    (path == NULL) ? "" : path, errmsg);
 	assert(r != -1);
 
-	return errbuf;
+	return s->errbuf;
 }
 
 
 /*
- * Disconnects.  Always succeeds since libsmbclient has no interface for
- * opening and closing connections, that is all handled internally.
+ * Disconnects s and closes the files and directories still open in it.
+ * Always succeeds since libsmbclient has no interface for opening and
+ * closing connections, that is all handled internally.
  */
 int
-smb_disconnect(void)
+smbs_disconnect(SmbSession *s)
 {
-	connected = 0;
+	closeall(s);
+	cache_release(s->cache);
+	s->cache = NULL;
+	s->connected = 0;
 	return 0;
 }
 
 
+/* Returns non-zero when s is connected to a share. */
+int
+smbs_connected(const SmbSession *s)
+{
+	return s->connected;
+}
+
+
 /*
  * Like chdir(2).  Dot-dot, leading slashes and double slashes are
  * handled appropriately.
  * Possible errno values: any of smbc_opendir or ENAMETOOLONG.
- * - 
  */
 int
-smb_chdir(const char *path)
+smbs_chdir(SmbSession *s, const char *path)
 {
+	char uribuf[SMB_URI_MAXLEN + 1];
+	const char *rpath;
 	int dh;
 	int save_errno;
-	int r;
 
-	/* check if buffer is big enough */
-	if (strlen(path) > SMB_PATH_MAXLEN) {
-		errno = ENAMETOOLONG;
+	if ((rpath = evaluri(s, uribuf, path)) == NULL)
 		return -1;
-	}
 
 	/* TODO a smb_stat with a S_ISDIR() should be enough */
-	dh = smb_opendir(path);
+	dh = smbs_opendir(s, rpath);
 	if (dh < 0)
 		return -1;
 
 	save_errno = errno;
-	(void)smb_close(dh);
+	(void)smbs_closedir(s, dh);
 
-	/* this will succeed since path will fit */
-	r = evalpath(smb_path, path);
-	assert(r);
+	strcpy(s->path, rpath);
+	makecwduri(s);
 
 	errno = save_errno;
 	return 0;
@@ -176,17 +585,51 @@ smb_chdir(const char *path)
 
 
 /*
- * Returns the string representation of the remote working directory.
+ * Returns the string representation of the remote working directory of s.
  * It is a smburi with host, share and user.  Always succeeds.
  */
 const char *
-smb_getcwd(void)
+smbs_getcwd(SmbSession *s)
+{
+	return s->cwdbuf;
+}
+
+
+/* Returns the name of the host s is connected to. */
+const char *
+smbs_gethost(SmbSession *s)
+{
+	return s->host;
+}
+
+
+/* Returns the name of the share s is connected to. */
+const char *
+smbs_getshare(SmbSession *s)
 {
-	static char buf[SMB_URI_MAXLEN + 1];
+	return s->share;
+}
 
-	makecwduri(buf);
 
-	return buf;
+/*
+ * Stores path, relative to the working directory of s, in buf as an
+ * absolute path within the share.  Returns 0, or -1 with errno set.
+ * Possible errno values: ENAMETOOLONG.
+ */
+int
+smbs_abspath(SmbSession *s, const char *path, char buf[SMB_PATH_MAXLEN + 1])
+{
+	char	uribuf[SMB_URI_MAXLEN + 1];
+	const char     *rpath;
+
+	if ((rpath = evaluri(s, uribuf, path)) == NULL)
+		return -1;
+	if (strlen(rpath) > SMB_PATH_MAXLEN) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(buf, rpath);
+	return 0;
 }
 
 
@@ -195,14 +638,18 @@ smb_getcwd(void)
  * Possible errno value: any of smbc_mkdir or ENAMETOOLONG.
  */
 int
-smb_mkdir(const char *path, mode_t mode)
+smbs_mkdir(SmbSession *s, const char *path, mode_t mode)
 {
 	char uribuf[SMB_URI_MAXLEN + 1];
+	const char *rpath;
+	int r;
 
-	if (!evaluri(uribuf, path))
+	if ((rpath = evaluri(s, uribuf, path)) == NULL)
 		return -1;
 
-	return smbc_mkdir(uribuf, mode);
+	r = smbc_getFunctionMkdir(s->ctx)(s->ctx, uribuf, mode);
+	invalidate(s, rpath, 0);
+	return r;
 }
 
 
@@ -211,29 +658,46 @@ smb_mkdir(const char *path, mode_t mode)
  * Possible errno values: any of smbc_rmdir or ENAMETOOLONG.
  */
 int
-smb_rmdir(const char *path)
+smbs_rmdir(SmbSession *s, const char *path)
 {
 	char uribuf[SMB_URI_MAXLEN + 1];
+	const char *rpath;
+	int r;
 
-	if (!evaluri(uribuf, path))
+	if ((rpath = evaluri(s, uribuf, path)) == NULL)
 		return -1;
-	return smbc_rmdir(uribuf);
+
+	r = smbc_getFunctionRmdir(s->ctx)(s->ctx, uribuf);
+	invalidate(s, rpath, 1);
+	return r;
 }
 
 
 /*
  * Like open(2).  Note that mode is currently not used.
- * Possible errno values:  any of smbc_open or ENAMETOOLONG.
+ * Possible errno values:  any of smbc_open, ENAMETOOLONG or EMFILE.
  */
 int
-smb_open(const char *path, int flags, mode_t mode)
+smbs_open(SmbSession *s, const char *path, int flags, mode_t mode)
 {
 	char uribuf[SMB_URI_MAXLEN + 1];
+	const char *rpath;
+	int writable;
+	int fh;
 
-	if (!evaluri(uribuf, path))
+	if ((rpath = evaluri(s, uribuf, path)) == NULL)
 		return -1;
 
-	return smbc_open(uribuf, flags, mode);
+	writable = (flags & (O_WRONLY|O_RDWR|O_CREAT|O_TRUNC)) != 0;
+	fh = addfile(s, smbc_getFunctionOpen(s->ctx)(s->ctx, uribuf, flags,
+	    mode), rpath, 0, writable);
+
+	/* writes are accounted for once more on close, not one by one */
+	if (flags & O_CREAT)
+		invalidate(s, rpath, 0);
+	else if (writable)
+		invalidate_contents(s, rpath);
+	return fh;
 }
 
 
@@ -242,9 +706,13 @@ smb_open(const char *path, int flags, mode_t mode)
  * Possible errno values: any of smbc_read.
  */
 ssize_t
-smb_read(int fh, void *buf, size_t bufsize)
+smbs_read(SmbSession *s, int fh, void *buf, size_t bufsize)
 {
-	return smbc_read(fh, buf, bufsize);
+	SMBCFILE *f;
+
+	if ((f = getfile(s, fh)) == NULL)
+		return -1;
+	return smbc_getFunctionRead(s->ctx)(s->ctx, f, buf, bufsize);
 }
 
 
@@ -253,11 +721,50 @@ smb_read(int fh, void *buf, size_t bufsize)
  * Possible errno values: any of smbc_write.
  */
 ssize_t
-smb_write(int fh, const void *buf, size_t bufsize)
+smbs_write(SmbSession *s, int fh, const void *buf, size_t bufsize)
 {
+	SMBCFILE *f;
+
+	if ((f = getfile(s, fh)) == NULL)
+		return -1;
 
 	/* TODO check why smbc_write's buffer to write is not const */
-	return smbc_write(fh, (void *)buf, bufsize);
+	return smbc_getFunctionWrite(s->ctx)(s->ctx, f, (void *)buf, bufsize);
+}
+
+
+/*
+ * Like ftruncate(2).
+ * Possible errno values: any of smbc_ftruncate.
+ */
+int
+smbs_ftruncate(SmbSession *s, int fh, off_t length)
+{
+	SMBCFILE *f;
+
+	if ((f = getfile(s, fh)) == NULL)
+		return -1;
+	return smbc_getFunctionFtruncate(s->ctx)(s->ctx, f, length);
+}
+
+
+/*
+ * Copies count bytes from the current offset of file from to the current
+ * offset of file to, both of s, on the server when it supports that
+ * (server-side copy), and advances both offsets.  cb is called with the
+ * number of bytes copied so far, copying stops when it returns 0.  Returns
+ * the number of bytes copied.
+ * Possible errno values: any of smbc_splice.
+ */
+off_t
+smbs_splice(SmbSession *s, int from, int to, off_t count,
+    int (*cb)(off_t, void *), void *priv)
+{
+	SMBCFILE *ff, *tf;
+
+	if ((ff = getfile(s, from)) == NULL || (tf = getfile(s, to)) == NULL)
+		return -1;
+	return smbc_getFunctionSplice(s->ctx)(s->ctx, ff, tf, count, cb, priv);
 }
 
 
@@ -266,9 +773,13 @@ smb_write(int fh, const void *buf, size_t bufsize)
  * Possible errno values: any of smbc_lseek.
  */
 off_t
-smb_lseek(int fh, off_t offset, int base)
+smbs_lseek(SmbSession *s, int fh, off_t offset, int base)
 {
-	return smbc_lseek(fh, offset, base);
+	SMBCFILE *f;
+
+	if ((f = getfile(s, fh)) == NULL)
+		return -1;
+	return smbc_getFunctionLseek(s->ctx)(s->ctx, f, offset, base);
 }
 
 
@@ -277,36 +788,68 @@ smb_lseek(int fh, off_t offset, int base)
  * Possible errno values: any of smbc_close.
  */
 int
-smb_close(int fh)
+smbs_close(SmbSession *s, int fh)
 {
-	return smbc_close(fh);
+	SMBCFILE *f;
+	int r;
+
+	if ((f = getfile(s, fh)) == NULL)
+		return -1;
+	r = smbc_getFunctionClose(s->ctx)(s->ctx, f);
+
+	/* the server may update the modification time on close */
+	if (s->files[fh].writable)
+		invalidate_contents(s, s->files[fh].path);
+	releasehandle(s, fh);
+	return r;
 }
 
 
 /*
- * Like stat(2).
+ * Like stat(2), answered from the stat cache when possible.
  * Possible errno values: any of smbc_stat or ENAMETOOLONG.
  */
 int
-smb_stat(const char *path, struct stat *st)
+smbs_stat(SmbSession *s, const char *path, struct stat *st)
 {
 	char uribuf[SMB_URI_MAXLEN + 1];
+	const char *rpath;
 
-	if (!evaluri(uribuf, path))
+	if ((rpath = evaluri(s, uribuf, path)) == NULL)
 		return -1;
+	if (statcache_get(s->cache, rpath, st))
+		return 0;
 
-	return smbc_stat(uribuf, st);
+	if (smbc_getFunctionStat(s->ctx)(s->ctx, uribuf, st) != 0)
+		return -1;
+	statcache_put(s->cache, rpath, st);
+	return 0;
 }
 
 
 /*
- * Like fstat(2).
+ * Like fstat(2).  For files opened read-only, answered from the stat cache
+ * when possible.
  * Possible errno values: any of smbc_fstat.
  */
 int
-smb_fstat(int fh, struct stat *st)
+smbs_fstat(SmbSession *s, int fh, struct stat *st)
 {
-	return smbc_fstat(fh, st);
+	SMBCFILE *f;
+	Handle *h;
+
+	if ((f = getfile(s, fh)) == NULL)
+		return -1;
+
+	h = &s->files[fh];
+	if (h->writable)
+		return smbc_getFunctionFstat(s->ctx)(s->ctx, f, st);
+	if (statcache_get(s->cache, h->path, st))
+		return 0;
+	if (smbc_getFunctionFstat(s->ctx)(s->ctx, f, st) != 0)
+		return -1;
+	statcache_put(s->cache, h->path, st);
+	return 0;
 }
 
 
@@ -315,15 +858,22 @@ smb_fstat(int fh, struct stat *st)
  * Possible errno values: any of smbc_rename or ENAMETOOLONG.
  */
 int
-smb_rename(const char *frompath, const char *topath)
+smbs_rename(SmbSession *s, const char *frompath, const char *topath)
 {
 	char fromuribuf[SMB_URI_MAXLEN + 1];
 	char touribuf[SMB_URI_MAXLEN + 1];
+	const char *rfrompath, *rtopath;
+	int r;
 
-	if (!evaluri(fromuribuf, frompath)|| !evaluri(touribuf, topath))
+	if ((rfrompath = evaluri(s, fromuribuf, frompath)) == NULL ||
+	    (rtopath = evaluri(s, touribuf, topath)) == NULL)
 		return -1;
 
-	return smbc_rename(fromuribuf, touribuf);
+	r = smbc_getFunctionRename(s->ctx)(s->ctx, fromuribuf,
+	    s->ctx, touribuf);
+	invalidate(s, rfrompath, 1);
+	invalidate(s, rtopath, 1);
+	return r;
 }
 
 
@@ -332,51 +882,135 @@ smb_rename(const char *frompath, const char *topath)
  * Possible errno values: any of smbc_unlink or ENAMETOOLONG.
  */
 int
-smb_unlink(const char *path)
+smbs_unlink(SmbSession *s, const char *path)
+{
+	char uribuf[SMB_URI_MAXLEN + 1];
+	const char *rpath;
+	int r;
+
+	if ((rpath = evaluri(s, uribuf, path)) == NULL)
+		return -1;
+
+	r = smbc_getFunctionUnlink(s->ctx)(s->ctx, uribuf);
+	invalidate(s, rpath, 0);
+	return r;
+}
+
+
+/*
+ * Like utimes(2).
+ * Possible errno values: any of smbc_utimes or ENAMETOOLONG.
+ */
+int
+smbs_utimes(SmbSession *s, const char *path, struct timeval *tv)
 {
 	char uribuf[SMB_URI_MAXLEN + 1];
+	const char *rpath;
+	int r;
 
-	if (!evaluri(uribuf, path))
+	if ((rpath = evaluri(s, uribuf, path)) == NULL)
 		return -1;
 
-	return smbc_unlink(uribuf);
+	r = smbc_getFunctionUtimes(s->ctx)(s->ctx, uribuf, tv);
+	invalidate(s, rpath, 0);
+	return r;
 }
 
 
 /*
  * Like opendir(2), with return value as directory handle/descriptor.
- * Possible errno values: any of smbc_opendir or ENAMETOOLONG.
+ * Possible errno values: any of smbc_opendir, ENAMETOOLONG or EMFILE.
  */
 int
-smb_opendir(const char *path)
+smbs_opendir(SmbSession *s, const char *path)
 {
 	char uribuf[SMB_URI_MAXLEN + 1];
+	const char *rpath;
+	Dirlisting *l;
+	int dh;
 
-	if (!evaluri(uribuf, path))
+	if ((rpath = evaluri(s, uribuf, path)) == NULL)
 		return -1;
 
-	return smbc_opendir(uribuf);
+	if ((l = dircache_get(s->cache, rpath)) != NULL) {
+		if ((dh = addhandle(s, rpath)) < 0) {
+			dirlisting_release(s->cache, l);
+			return -1;
+		}
+		s->files[dh].isdir = 1;
+		s->files[dh].list = l;
+		return dh;
+	}
+
+	dh = addfile(s, smbc_getFunctionOpendir(s->ctx)(s->ctx, uribuf),
+	    rpath, 1, 0);
+	if (dh >= 0 && s->cache != NULL && cachettl > 0) {
+		/* collect the listing, without one it is not cached */
+		(void)pthread_mutex_lock(&s->cache->lock);
+		s->files[dh].generation = s->cache->generation;
+		(void)pthread_mutex_unlock(&s->cache->lock);
+		s->files[dh].fill = dirlisting_new(rpath);
+	}
+	return dh;
 }
 
 
 /*
  * Reads next file/directory for dh.  On failure or end of list
- * NULL is returned, otherwise a pointer to a Smbdirent is returned.
+ * NULL is returned, otherwise a pointer to a Smbdirent is returned
+ * which, like the name and comment it points to, is valid until the
+ * next call for dh.  Nothing is copied, an entry of a cached listing is
+ * returned as is.
  * Note that it is not possible to detect difference between failure
  * and end of directory.
  */
-Smbdirent *
-smb_readdir(int dh)
+const Smbdirent *
+smbs_readdir(SmbSession *s, int dh)
+{
+	Handle *h;
+
+	if ((h = gethandle(s, dh)) == NULL || !h->isdir)
+		return NULL;
+	return nextdirent(s, h);
+}
+
+
+/*
+ * Like smbs_readdir, also stores the mode, size and modification time of
+ * the entry in st, the other fields are 0.  The attributes come with the
+ * listing, only when the server does not supply them the entry is stat'ed.
+ * When that fails too, st_mode is 0 and errno is set.
+ */
+const Smbdirent *
+smbs_readdirplus(SmbSession *s, int dh, struct stat *st)
 {
-	static Smbdirent dent;
-	const struct smbc_dirent *cdent;
+	char path[SMB_PATH_MAXLEN + 1];
+	const Smbdirent *dent;
+	Handle *h;
 
-	/* TODO check why smbc_readdir has unsigned int for directory handle */
-	cdent = smbc_readdir((unsigned int)dh);
-	if (cdent == NULL)
+	if ((h = gethandle(s, dh)) == NULL || !h->isdir)
+		return NULL;
+	if ((dent = nextdirent(s, h)) == NULL)
 		return NULL;
-	smbc_dirent2Smbdirent(cdent, &dent);
-	return &dent;
+
+	memset(st, 0, sizeof *st);
+	if (dent->mode != 0) {
+		st->st_mode = dent->mode;
+		st->st_size = dent->size;
+		st->st_mtime = dent->mtime;
+		return dent;
+	}
+
+	if (strlen(h->path) + 1 + strlen(dent->name) > SMB_PATH_MAXLEN) {
+		errno = ENAMETOOLONG;
+		return dent;
+	}
+	strcpy(path, h->path);
+	strcat(path, streql(h->path, "/") ? "" : "/");
+	strcat(path, dent->name);
+	if (smbs_stat(s, path, st) != 0)
+		memset(st, 0, sizeof *st);
+	return dent;
 }
 
 
@@ -385,9 +1019,17 @@ smb_readdir(int dh)
  * Possible errno values: any of smbc_telldir.
  */
 off_t
-smb_telldir(int dh)
+smbs_telldir(SmbSession *s, int dh)
 {
-	return smbc_telldir(dh);
+	Handle *h;
+
+	if ((h = gethandle(s, dh)) == NULL || !h->isdir) {
+		errno = EBADF;
+		return -1;
+	}
+	if (h->list != NULL)
+		return (off_t)h->pos;
+	return smbc_getFunctionTelldir(s->ctx)(s->ctx, h->f);
 }
 
 
@@ -396,29 +1038,253 @@ smb_telldir(int dh)
  * Possible errno values: any of smbc_lseekdir.
  */
 int
-smb_lseekdir(int dh, off_t offset)
+smbs_lseekdir(SmbSession *s, int dh, off_t offset)
 {
-	return smbc_lseekdir(dh, offset);
-}
-
+	Handle *h;
 
-/*
- * Like closedir(2).
+	if ((h = gethandle(s, dh)) == NULL || !h->isdir) {
+		errno = EBADF;
+		return -1;
+	}
+	if (h->list != NULL) {
+		if (offset < 0 || offset > h->list->list->count) {
+			errno = EINVAL;
+			return -1;
+		}
+		h->pos = (int)offset;
+		return 0;
+	}
+
+	/* entries may be skipped or repeated, the listing is unusable */
+	dirlisting_free(h->fill);
+	h->fill = NULL;
+	return smbc_getFunctionLseekdir(s->ctx)(s->ctx, h->f, offset);
+}
+
+
+/*
+ * Like closedir(2).
  * Possible errno values: any of smbc_closedir.
  */
+int
+smbs_closedir(SmbSession *s, int dh)
+{
+	Handle *h;
+	int r;
+
+	if ((h = gethandle(s, dh)) == NULL || !h->isdir) {
+		errno = EBADF;
+		return -1;
+	}
+	r = 0;
+	if (h->f != NULL)
+		r = smbc_getFunctionClosedir(s->ctx)(s->ctx, h->f);
+	releasehandle(s, dh);
+	return r;
+}
+
+
+/*
+ * The functions below are the smbs_* functions for the session of the
+ * calling thread, see cursession.
+ */
+
+char *
+smb_connect(const char *host, const char *share, const char *user,
+    const char *pass, const char *path)
+{
+	char   *errmsg;
+
+	errmsg = smbs_connect(defsession, host, share, user, pass, path);
+	connected = defsession->connected;
+	return errmsg;
+}
+
+
+int
+smb_disconnect(void)
+{
+	(void)smbs_disconnect(defsession);
+	connected = 0;
+	return 0;
+}
+
+
+int
+smb_chdir(const char *path)
+{
+	return smbs_chdir(cursession(), path);
+}
+
+
+const char *
+smb_getcwd(void)
+{
+	return smbs_getcwd(cursession());
+}
+
+
+int
+smb_mkdir(const char *path, mode_t mode)
+{
+	return smbs_mkdir(cursession(), path, mode);
+}
+
+
+int
+smb_rmdir(const char *path)
+{
+	return smbs_rmdir(cursession(), path);
+}
+
+
+int
+smb_open(const char *path, int flags, mode_t mode)
+{
+	return smbs_open(cursession(), path, flags, mode);
+}
+
+
+ssize_t
+smb_read(int fh, void *buf, size_t bufsize)
+{
+	return smbs_read(cursession(), fh, buf, bufsize);
+}
+
+
+ssize_t
+smb_write(int fh, const void *buf, size_t bufsize)
+{
+	return smbs_write(cursession(), fh, buf, bufsize);
+}
+
+
+int
+smb_ftruncate(int fh, off_t length)
+{
+	return smbs_ftruncate(cursession(), fh, length);
+}
+
+
+off_t
+smb_splice(int from, int to, off_t count, int (*cb)(off_t, void *),
+    void *priv)
+{
+	return smbs_splice(cursession(), from, to, count, cb, priv);
+}
+
+
+off_t
+smb_lseek(int fh, off_t offset, int base)
+{
+	return smbs_lseek(cursession(), fh, offset, base);
+}
+
+
+int
+smb_close(int fh)
+{
+	return smbs_close(cursession(), fh);
+}
+
+
+int
+smb_stat(const char *path, struct stat *st)
+{
+	return smbs_stat(cursession(), path, st);
+}
+
+
+int
+smb_fstat(int fh, struct stat *st)
+{
+	return smbs_fstat(cursession(), fh, st);
+}
+
+
+int
+smb_rename(const char *frompath, const char *topath)
+{
+	return smbs_rename(cursession(), frompath, topath);
+}
+
+
+int
+smb_unlink(const char *path)
+{
+	return smbs_unlink(cursession(), path);
+}
+
+
+int
+smb_utimes(const char *path, struct timeval *tv)
+{
+	return smbs_utimes(cursession(), path, tv);
+}
+
+
+int
+smb_opendir(const char *path)
+{
+	return smbs_opendir(cursession(), path);
+}
+
+
+const Smbdirent *
+smb_readdir(int dh)
+{
+	return smbs_readdir(cursession(), dh);
+}
+
+
+const Smbdirent *
+smb_readdirplus(int dh, struct stat *st)
+{
+	return smbs_readdirplus(cursession(), dh, st);
+}
+
+
+off_t
+smb_telldir(int dh)
+{
+	return smbs_telldir(cursession(), dh);
+}
+
+
+int
+smb_lseekdir(int dh, off_t offset)
+{
+	return smbs_lseekdir(cursession(), dh, offset);
+}
+
+
 int
 smb_closedir(int dh)
 {
-	return smbc_closedir(dh);
+	return smbs_closedir(cursession(), dh);
+}
+
+
+int
+smb_refresh(const char *path)
+{
+	return smbs_refresh(cursession(), path);
+}
+
+
+int
+smb_listed(const char *path)
+{
+	return smbs_listed(cursession(), path);
 }
 
 
 const char *
-smb_workgroups(List *list)
+smb_workgroups(Smblisting **list)
 {
 	int	r;
 
-	switch (r = listuri("smb://", list)) {
+	switch (r = listuri(defsession, "smb://", list)) {
 	case 0:		return NULL;
 	default:	return strerror(r);
 	}
@@ -426,7 +1292,7 @@ smb_workgroups(List *list)
 
 
 const char *
-smb_hosts(const char *workgroup, List *list)
+smb_hosts(const char *workgroup, Smblisting **list)
 {
 	char	uribuf[SMB_URI_MAXLEN + 1];
 	int	r;
@@ -435,15 +1301,15 @@ smb_hosts(const char *workgroup, List *list)
 		return "Invalid arguments";
 
 	/* clear username and password */
-	strcpy(list_user, "");
-	strcpy(list_pass, "");
+	strcpy(defsession->list_user, "");
+	strcpy(defsession->list_pass, "");
 
 	/* create uri */
 	strcpy(uribuf, "smb://");
 	if (workgroup != NULL)
 		strcat(uribuf, workgroup);
 
-	switch (r = listuri(uribuf, list)) {
+	switch (r = listuri(defsession, uribuf, list)) {
 	case 0:		return NULL;
 	case ENODEV:    return "No such workgroup";
 	case ENOENT:    return "No such workgroup";
@@ -453,7 +1319,8 @@ smb_hosts(const char *workgroup, List *list)
 
 
 const char *
-smb_shares(const char *user, const char *pass, const char *host, List *list)
+smb_shares(const char *user, const char *pass, const char *host,
+    Smblisting **list)
 {
 	char	uribuf[SMB_URI_MAXLEN + 1];
 	int	r;
@@ -466,21 +1333,21 @@ smb_shares(const char *user, const char *pass, const char *host, List *list)
 
 	/* create the uri */
 	strcpy(uribuf, "smb://");
-	if (user != NULL && !streql(smb_user, "")) {
-		strcat(uribuf, smb_user);
-		if (pass != NULL && !streql(smb_pass, "")) {
+	if (user != NULL && !streql(defsession->user, "")) {
+		strcat(uribuf, defsession->user);
+		if (pass != NULL && !streql(defsession->pass, "")) {
 			strcat(uribuf, ":");
-			strcat(uribuf, smb_pass);
+			strcat(uribuf, defsession->pass);
 		}
 		strcat(uribuf, "@");
 	}
 	strcat(uribuf, host);
 
 	/* set list_user and list_pass for use in auth_callback */
-	strcpy(list_user, (user != NULL) ? user : "");
-	strcpy(list_pass, (pass != NULL) ? pass : "");
+	strcpy(defsession->list_user, (user != NULL) ? user : "");
+	strcpy(defsession->list_pass, (pass != NULL) ? pass : "");
 
-	switch (r = listuri(uribuf, list)) {
+	switch (r = listuri(defsession, uribuf, list)) {
 	case 0:		return NULL;
 	case ENODEV:    return "No such host";
 	case ENOENT:    return "No such host";
@@ -490,80 +1357,190 @@ smb_shares(const char *user, const char *pass, const char *host, List *list)
 
 
 /*
- * Retrieves contents the directory denoted by uri.  Results are
- * stored in argv, the count in argc.  On success, true is returned,
- * false otherwise.  The contents of argv must be freed when the call
- * succeeds, on failure all allocated memory is freed automatically.
+ * Retrieves the contents of the directory denoted by uri, without "." and
+ * "..", and stores them in a new listing in *list.  On success 0 is
+ * returned and the caller must free the listing, otherwise an errno value
+ * is returned.
  */
 static int
-listuri(const char *uri, List *list)
+listuri(SmbSession *s, const char *uri, Smblisting **list)
 {
-	int	dh;
-	Smbdirent      *dirent;
+	SMBCFILE       *dh;
+	Smbdirent	dirent;
 	const struct smbc_dirent *dent;
 
-	doing_listing = 1;
+	s->doing_listing = 1;
 
-	dh = smbc_opendir(uri);
-	if (dh < 0)
+	if ((*list = smblisting_new()) == NULL)
+		goto error;
+
+	dh = smbc_getFunctionOpendir(s->ctx)(s->ctx, uri);
+	if (dh == NULL)
 		goto error;
 
-	while ((dent = smbc_readdir(dh)) != NULL) {
+	memset(&dirent, 0, sizeof dirent);
+	while ((dent = smbc_getFunctionReaddir(s->ctx)(s->ctx, dh)) != NULL) {
 		/* skip "." and ".." */
 		if (streql(dent->name, ".") || streql(dent->name, ".."))
 			continue;
 
-		dirent = malloc(sizeof (Smbdirent));
-		if (dirent == NULL)
+		dirent.type = dent->smbc_type;
+		dirent.name = dent->name;
+		dirent.comment = dent->comment;
+		if (!smblisting_add(*list, &dirent)) {
+			(void)smbc_getFunctionClosedir(s->ctx)(s->ctx, dh);
+			errno = ENOMEM;
 			goto error;
-		smbc_dirent2Smbdirent(dent, dirent);
-		list_add(list, dirent);
+		}
 	}
 
-	if (smbc_closedir(dh) != 0)
+	if (smbc_getFunctionClosedir(s->ctx)(s->ctx, dh) != 0)
 		goto error;
 
-	doing_listing = 0;
+	s->doing_listing = 0;
 	return 0;
 
 error:
-	list_free(list); list = NULL;
+	smblisting_free(*list); *list = NULL;
 
 	/* TODO remove this when libsmbclient is fixed */
 	if (errno == 0)
 		errno = ENOSYS;
 
-	doing_listing = 0;
+	s->doing_listing = 0;
 	return errno;
 
 }
 
 
-static void
-smbc_dirent2Smbdirent(const struct smbc_dirent *from, Smbdirent *to)
+/* Returns the number of entries in list. */
+int
+smblisting_count(const Smblisting *list)
 {
-	assert(strlen(from->name) < sizeof to->name);
-	assert(strlen(from->comment) < sizeof to->comment);
+	return list->count;
+}
+
 
-	to->type = from->smbc_type;
-	strcpy(to->name, from->name);
-	strcpy(to->comment, from->comment);
+/* Returns entry i of list, valid until list is freed. */
+const Smbdirent *
+smblisting_entry(const Smblisting *list, int i)
+{
+	assert(i >= 0 && i < list->count);
+	return &list->ents[i];
 }
 
 
+/* Frees list.  list may be NULL. */
+void
+smblisting_free(Smblisting *list)
+{
+	Arenablock     *b, *next;
+
+	if (list == NULL)
+		return;
+
+	for (b = list->arena; b != NULL; b = next) {
+		next = b->next;
+		free(b);
+	}
+	free(list->ents);
+	free(list);
+}
+
+
+/* Creates an empty listing, NULL when out of memory. */
+static Smblisting *
+smblisting_new(void)
+{
+	Smblisting     *list;
+
+	if ((list = calloc(1, sizeof (Smblisting))) == NULL)
+		return NULL;
+	list->bytes = sizeof (Smblisting);
+	return list;
+}
+
+
+/*
+ * Appends a copy of dent to list, its name and comment are copied into the
+ * arena.  Returns 0 when out of memory.
+ */
+static int
+smblisting_add(Smblisting *list, const Smbdirent *dent)
+{
+	Smbdirent      *ents, *e;
+	int	max;
+
+	if (list->count == list->max) {
+		max = (list->max == 0) ? LISTING_MINENTRIES : list->max * 2;
+		ents = realloc(list->ents, max * sizeof (Smbdirent));
+		if (ents == NULL)
+			return 0;
+		list->bytes += (max - list->max) * sizeof (Smbdirent);
+		list->ents = ents;
+		list->max = max;
+	}
+
+	e = &list->ents[list->count];
+	*e = *dent;
+	if ((e->name = smblisting_strdup(list, dent->name)) == NULL ||
+	    (e->comment = smblisting_strdup(list, dent->comment)) == NULL)
+		return 0;
+	++list->count;
+	return 1;
+}
+
+
+/*
+ * Returns a copy of str in the arena of list, NULL when out of memory.  The
+ * empty string is not copied.
+ */
+static const char *
+smblisting_strdup(Smblisting *list, const char *str)
+{
+	Arenablock     *b;
+	size_t	len, size;
+	char   *p;
+
+	if (*str == '\0')
+		return "";
+
+	len = strlen(str) + 1;
+	b = list->arena;
+	if (b == NULL || b->size - b->used < len) {
+		size = (len > ARENA_BLOCKSIZE) ? len : ARENA_BLOCKSIZE;
+		if ((b = malloc(sizeof (Arenablock) + size)) == NULL)
+			return NULL;
+		b->used = 0;
+		b->size = size;
+		b->next = list->arena;
+		list->arena = b;
+		list->bytes += sizeof (Arenablock) + size;
+	}
+
+	p = (char *)(b + 1) + b->used;
+	memcpy(p, str, len);
+	b->used += len;
+	return p;
+}
+
+
+/* Provides the credentials of the session ctx belongs to. */
 /* ARGSUSED */
 static void
-auth_callback(const char *host, const char *share, char *wg, int wglen,
-    char *user, int userlen, char *pass, int passlen)
+auth_callback(SMBCCTX *ctx, const char *host, const char *share, char *wg,
+    int wglen, char *user, int userlen, char *pass, int passlen)
 {
+	SmbSession     *s;
 	char *connuser, *connpass;
 
-	if (doing_listing) {
-		connuser = list_user;
-		connpass = list_pass;
+	s = (SmbSession *)smbc_getOptionUserData(ctx);
+	if (s->doing_listing) {
+		connuser = s->list_user;
+		connpass = s->list_pass;
 	} else {
-		connuser = smb_user;
-		connpass = smb_pass;
+		connuser = s->user;
+		connpass = s->pass;
 	}
 
 	if (userlen > strlen(connuser) + 1 || *connuser != '\0')
@@ -576,137 +1553,718 @@ auth_callback(const char *host, const char *share, char *wg, int wglen,
 }
 
 
-static void
-makecwduri(char *uribuf)
+/* Returns the session of the calling thread. */
+static SmbSession *
+cursession(void)
 {
-	makeuri_generic(uribuf, 1);
+	SmbSession     *s;
+
+	s = (SmbSession *)pthread_getspecific(workerkey);
+	return (s != NULL) ? s : defsession;
 }
 
 
+/*
+ * Returns a free handle of s for path, or -1 with errno set when the table
+ * is full or memory is exhausted.
+ */
+static int
+addhandle(SmbSession *s, const char *path)
+{
+	Handle *h;
+	int	fh;
+
+	for (fh = 0; fh < SESSION_MAXFILES; ++fh)
+		if (!s->files[fh].used)
+			break;
+	if (fh == SESSION_MAXFILES) {
+		errno = EMFILE;
+		return -1;
+	}
+
+	h = &s->files[fh];
+	memset(h, 0, sizeof *h);
+	if ((h->path = strdup(path)) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	h->used = 1;
+	return fh;
+}
+
+
+/*
+ * Stores f, as returned by a libsmbclient open or opendir function for path,
+ * in the file table of s and returns its handle.  When f is NULL (the
+ * function failed), -1 is returned and errno left untouched.
+ */
+static int
+addfile(SmbSession *s, SMBCFILE *f, const char *path, int isdir,
+    int writable)
+{
+	int	fh;
+
+	if (f == NULL)
+		return -1;
+
+	if ((fh = addhandle(s, path)) < 0) {
+		if (isdir)
+			(void)smbc_getFunctionClosedir(s->ctx)(s->ctx, f);
+		else
+			(void)smbc_getFunctionClose(s->ctx)(s->ctx, f);
+		return -1;
+	}
+	s->files[fh].f = f;
+	s->files[fh].isdir = isdir;
+	s->files[fh].writable = writable;
+	return fh;
+}
+
+
+/* Returns handle fh of s, NULL with errno set if invalid. */
+static Handle *
+gethandle(SmbSession *s, int fh)
+{
+	if (fh < 0 || fh >= SESSION_MAXFILES || !s->files[fh].used) {
+		errno = EBADF;
+		return NULL;
+	}
+	return &s->files[fh];
+}
+
+
+/* Returns the file for handle fh of s, NULL with errno set if invalid. */
+static SMBCFILE *
+getfile(SmbSession *s, int fh)
+{
+	if (fh < 0 || fh >= SESSION_MAXFILES || !s->files[fh].used ||
+	    s->files[fh].isdir) {
+		errno = EBADF;
+		return NULL;
+	}
+	return s->files[fh].f;
+}
+
+
+/* Frees handle fh of s, its file or directory must be closed already. */
 static void
-makeuri(char *uribuf)
+releasehandle(SmbSession *s, int fh)
 {
-	makeuri_generic(uribuf, 0);
+	Handle *h;
+
+	h = &s->files[fh];
+	dirlisting_release(s->cache, h->list);
+	dirlisting_free(h->fill);
+	free(h->path);
+	memset(h, 0, sizeof *h);
 }
 
 
+/* Closes the files and directories still open in s. */
 static void
-makeuri_generic(char *uribuf, int cwd)
+closeall(SmbSession *s)
 {
-	strcpy(uribuf, "smb://");
-	if (!streql(smb_user, "")) {
-		strcat(uribuf, smb_user);
-		if (!streql(smb_pass, "")) {
-			strcat(uribuf, ":");
-			strcat(uribuf, (cwd ? "PASSWORD" : smb_pass));
-		}
-		strcat(uribuf, "@");
+	Handle *h;
+	int	fh;
+
+	for (fh = 0; fh < SESSION_MAXFILES; ++fh) {
+		h = &s->files[fh];
+		if (!h->used)
+			continue;
+		if (h->isdir && h->f != NULL)
+			(void)smbc_getFunctionClosedir(s->ctx)(s->ctx, h->f);
+		else if (!h->isdir)
+			(void)smbc_getFunctionClose(s->ctx)(s->ctx, h->f);
+		releasehandle(s, fh);
 	}
-	strcat(uribuf, smb_host);
-	strcat(uribuf, "/");
-	strcat(uribuf, smb_share);
-	strcat(uribuf, smb_path);
 }
 
 
+/* Creates an empty cache used by one session, NULL when out of memory. */
+static Cache *
+cache_new(void)
+{
+	Cache  *c;
+
+	if ((c = calloc(1, sizeof (Cache))) == NULL)
+		return NULL;
+	(void)pthread_mutex_init(&c->lock, NULL);
+	c->refs = 1;
+	return c;
+}
+
+
+/* Drops a reference to c, frees it when it was the last.  c may be NULL. */
+static void
+cache_release(Cache *c)
+{
+	int	refs;
+
+	if (c == NULL)
+		return;
+
+	(void)pthread_mutex_lock(&c->lock);
+	refs = --c->refs;
+	(void)pthread_mutex_unlock(&c->lock);
+	if (refs > 0)
+		return;
+
+	statcache_clear(c);
+	dircache_clear(c);
+	(void)pthread_mutex_destroy(&c->lock);
+	free(c);
+}
+
+
+static unsigned int
+hashpath(const char *path)
+{
+	unsigned int	h;
+
+	for (h = 5381; *path != '\0'; ++path)
+		h = h * 33 + (unsigned char)*path;
+	return h;
+}
+
+
+/* Returns non-zero when path is dir or below it. */
 static int
-evaluri(char *uribuf, const char *npath)
+insubtree(const char *path, const char *dir)
 {
-	char save[SMB_PATH_MAXLEN + 1];
+	size_t	len;
 
-	if (strlen(smb_path) + 1 + strlen(npath) > SMB_PATH_MAXLEN) {
-		errno = ENAMETOOLONG;
+	len = strlen(dir);
+	return streql(dir, "/") || (strncmp(path, dir, len) == 0 &&
+	    (path[len] == '\0' || path[len] == '/'));
+}
+
+
+/*
+ * Looks up path in c and stores its attributes in st.  Returns non-zero on
+ * a hit.  c may be NULL.
+ */
+static int
+statcache_get(Cache *c, const char *path, struct stat *st)
+{
+	Statentry      *e;
+	int	hit;
+
+	if (c == NULL || cachettl == 0)
 		return 0;
+
+	hit = 0;
+	(void)pthread_mutex_lock(&c->lock);
+	e = c->statbuckets[hashpath(path) % STATCACHE_BUCKETS];
+	for (; e != NULL; e = e->next)
+		if (streql(e->path, path)) {
+			if (e->expires > time(NULL)) {
+				*st = e->st;
+				hit = 1;
+			}
+			break;
+		}
+	if (hit)
+		++c->stathits;
+	else
+		++c->statmisses;
+	(void)pthread_mutex_unlock(&c->lock);
+	return hit;
+}
+
+
+/* Stores the attributes st of path in c.  c may be NULL. */
+static void
+statcache_put(Cache *c, const char *path, const struct stat *st)
+{
+	Statentry      *e;
+	unsigned int	h;
+
+	if (c == NULL || cachettl == 0)
+		return;
+
+	h = hashpath(path) % STATCACHE_BUCKETS;
+	(void)pthread_mutex_lock(&c->lock);
+	for (e = c->statbuckets[h]; e != NULL; e = e->next)
+		if (streql(e->path, path))
+			break;
+
+	if (e == NULL) {
+		if (c->stats >= STATCACHE_MAXENTRIES)
+			statcache_clear(c);
+		if ((e = malloc(sizeof (Statentry))) == NULL ||
+		    (e->path = strdup(path)) == NULL) {
+			free(e);
+			(void)pthread_mutex_unlock(&c->lock);
+			return;
+		}
+		e->next = c->statbuckets[h];
+		c->statbuckets[h] = e;
+		++c->stats;
 	}
+	e->st = *st;
+	e->expires = time(NULL) + cachettl;
+	(void)pthread_mutex_unlock(&c->lock);
+}
 
-	/* save current path */
-	strcpy(save, smb_path);
 
-	/* use smb_path to create the new path */
-	if (!evalpath(smb_path, npath))
-		return 0;       /* errno set by evalpath */
+/*
+ * Removes the attributes of path from c and, when subtree is set, those of
+ * everything below it.  c may be NULL.
+ */
+static void
+statcache_remove(Cache *c, const char *path, int subtree)
+{
+	Statentry      *e, **ep;
+	unsigned int	h, pathh;
 
-	/* create the uri in our buffer */
-	makeuri(uribuf);
+	if (c == NULL)
+		return;
 
-	/* restore our path */
-	strcpy(smb_path, save);
+	pathh = hashpath(path) % STATCACHE_BUCKETS;
+	(void)pthread_mutex_lock(&c->lock);
+	for (h = 0; h < STATCACHE_BUCKETS; ++h) {
+		/* without subtree, only the bucket of path can match */
+		if (!subtree && h != pathh)
+			continue;
 
-	return 1;
+		for (ep = &c->statbuckets[h]; (e = *ep) != NULL;) {
+			if (subtree ? insubtree(e->path, path) :
+			    streql(e->path, path)) {
+				*ep = e->next;
+				free(e->path);
+				free(e);
+				--c->stats;
+			} else
+				ep = &e->next;
+		}
+	}
+	(void)pthread_mutex_unlock(&c->lock);
+}
+
+
+/* Removes all attributes from c, c->lock must be held or c unused. */
+static void
+statcache_clear(Cache *c)
+{
+	Statentry      *e, *next;
+	int	h;
+
+	for (h = 0; h < STATCACHE_BUCKETS; ++h) {
+		for (e = c->statbuckets[h]; e != NULL; e = next) {
+			next = e->next;
+			free(e->path);
+			free(e);
+		}
+		c->statbuckets[h] = NULL;
+	}
+	c->stats = 0;
+}
+
+
+/* Creates an empty listing of path, NULL when out of memory. */
+static Dirlisting *
+dirlisting_new(const char *path)
+{
+	Dirlisting     *l;
+
+	if ((l = calloc(1, sizeof (Dirlisting))) == NULL)
+		return NULL;
+	if ((l->path = strdup(path)) == NULL ||
+	    (l->list = smblisting_new()) == NULL) {
+		free(l->path);
+		free(l);
+		return NULL;
+	}
+	return l;
+}
+
+
+/* Frees l, which is not in a cache.  l may be NULL. */
+static void
+dirlisting_free(Dirlisting *l)
+{
+	if (l == NULL)
+		return;
+	free(l->path);
+	smblisting_free(l->list);
+	free(l);
+}
+
+
+/* Drops a reference to l from cache c.  l may be NULL. */
+static void
+dirlisting_release(Cache *c, Dirlisting *l)
+{
+	int	refs;
+
+	if (l == NULL)
+		return;
+
+	(void)pthread_mutex_lock(&c->lock);
+	refs = --l->refs;
+	(void)pthread_mutex_unlock(&c->lock);
+	if (refs == 0)
+		dirlisting_free(l);
 }
 
 
 /*
- * Combine opath and npath and write it to opath.  If it does not
- * fit, zero is returned and path remains unchanged.  On success
- * non-zero is returned.
+ * Returns the listing of path from c with a reference added, release it
+ * with dirlisting_release.  NULL when not cached.  c may be NULL.
  */
-static int
-evalpath(char *opath, const char *npath)
+static Dirlisting *
+dircache_get(Cache *c, const char *path)
 {
-	char buf[SMB_PATH_MAXLEN * 2 + 2];
-	char *ptr, *slashptr;
+	Dirlisting     *l;
 
-	/* copy path to buf in which we will work */
-	strcpy(buf, opath);
+	if (c == NULL || cachettl == 0)
+		return NULL;
 
-	if (*npath == '/') {
-		strcpy(buf, npath);
-	} else {
-		strcat(buf, "/");
-		strcat(buf, npath);
+	(void)pthread_mutex_lock(&c->lock);
+	l = dircache_find(c, path);
+	if (l != NULL) {
+		++l->refs;
+		++c->dirhits;
+	} else
+		++c->dirmisses;
+	(void)pthread_mutex_unlock(&c->lock);
+	return l;
+}
+
+
+/* Returns the fresh listing of path in c, with c->lock held. */
+static Dirlisting *
+dircache_find(Cache *c, const char *path)
+{
+	Dirlisting     *l;
+
+	l = c->dirbuckets[hashpath(path) % DIRCACHE_BUCKETS];
+	for (; l != NULL; l = l->next)
+		if (streql(l->path, path))
+			break;
+	if (l != NULL && l->expires <= time(NULL))
+		l = NULL;
+	return l;
+}
+
+
+/*
+ * Stores the complete listing l in c, replacing an older listing of the
+ * same directory.  generation is that of c when reading the directory
+ * started, when something was invalidated meanwhile l may be outdated and
+ * is freed instead.  c may be NULL.
+ */
+static void
+dircache_put(Cache *c, Dirlisting *l, unsigned long generation)
+{
+	Dirlisting     *old, **lp;
+	unsigned int	h;
+
+	if (c == NULL || cachettl == 0) {
+		dirlisting_free(l);
+		return;
+	}
+
+	(void)pthread_mutex_lock(&c->lock);
+	if (generation != c->generation || l->list->bytes > DIRCACHE_MAXBYTES) {
+		(void)pthread_mutex_unlock(&c->lock);
+		dirlisting_free(l);
+		return;
 	}
 
-	while ((ptr = strstr(buf, "//")) != NULL)
-		memmove(ptr, ptr + 1, strlen(ptr + 1) + 1);
+	h = hashpath(l->path) % DIRCACHE_BUCKETS;
+	for (lp = &c->dirbuckets[h]; (old = *lp) != NULL; lp = &old->next)
+		if (streql(old->path, l->path)) {
+			*lp = old->next;
+			--c->listings;
+			c->listingbytes -= old->list->bytes;
+			if (--old->refs == 0)
+				dirlisting_free(old);
+			break;
+		}
 
-	while ((ptr = strstr(buf, "/./")) != NULL)
-		memmove(ptr, ptr + 2, strlen(ptr + 2) + 1);
+	if (c->listings >= DIRCACHE_MAXLISTINGS ||
+	    c->listingbytes + l->list->bytes > DIRCACHE_MAXBYTES)
+		dircache_clear(c);
+
+	l->refs = 1;
+	l->expires = time(NULL) + cachettl;
+	l->next = c->dirbuckets[h];
+	c->dirbuckets[h] = l;
+	++c->listings;
+	c->listingbytes += l->list->bytes;
+	(void)pthread_mutex_unlock(&c->lock);
+}
 
-	if (streql(buf + strlen(buf) - 2, "/."))
-		*(buf + strlen(buf) - 1) = '\0';
 
-	while ((ptr = strstr(buf, "/../")) != NULL) {
-		slashptr = strrslash(buf, ptr);
-		memmove((slashptr != NULL ? slashptr : buf), ptr + 3,
-		    strlen(ptr + 3) + 1);
+/*
+ * Removes the listing of path from c and, when subtree is set, those of
+ * all directories below it.  When names is set, names may have come or
+ * gone and listings still being read from the server are not stored
+ * afterwards.  c may be NULL.
+ */
+static void
+dircache_remove(Cache *c, const char *path, int subtree, int names)
+{
+	Dirlisting     *l, **lp;
+	unsigned int	h, pathh;
+
+	if (c == NULL)
+		return;
+
+	pathh = hashpath(path) % DIRCACHE_BUCKETS;
+	(void)pthread_mutex_lock(&c->lock);
+	if (names)
+		++c->generation;
+	for (h = 0; h < DIRCACHE_BUCKETS; ++h) {
+		if (!subtree && h != pathh)
+			continue;
+
+		for (lp = &c->dirbuckets[h]; (l = *lp) != NULL;) {
+			if (subtree ? insubtree(l->path, path) :
+			    streql(l->path, path)) {
+				*lp = l->next;
+				--c->listings;
+				c->listingbytes -= l->list->bytes;
+				if (--l->refs == 0)
+					dirlisting_free(l);
+			} else
+				lp = &l->next;
+		}
+	}
+	(void)pthread_mutex_unlock(&c->lock);
+}
+
+
+/* Removes all listings from c, c->lock must be held or c unused. */
+static void
+dircache_clear(Cache *c)
+{
+	Dirlisting     *l, *next;
+	int	h;
+
+	for (h = 0; h < DIRCACHE_BUCKETS; ++h) {
+		for (l = c->dirbuckets[h]; l != NULL; l = next) {
+			next = l->next;
+			if (--l->refs == 0)
+				dirlisting_free(l);
+		}
+		c->dirbuckets[h] = NULL;
 	}
+	c->listings = 0;
+	c->listingbytes = 0;
+}
+
+
+/*
+ * Returns the next entry of directory h of s, see smbs_readdir.  Entries
+ * read from the server are added to the listing being filled and their
+ * attributes to the stat cache.
+ */
+static const Smbdirent *
+nextdirent(SmbSession *s, Handle *h)
+{
+	const struct libsmb_file_info *info;
+	char	path[SMB_PATH_MAXLEN + 1];
+	struct stat	st;
 
-	if (streql(buf + strlen(buf) - 3, "/..")) {
-		slashptr = strrslash(buf, buf + strlen(buf) - 3);
-		if (slashptr == NULL)
-			strcpy(buf, "/");
+	if (h->list != NULL) {
+		if (h->pos >= h->list->list->count)
+			return NULL;
+		return &h->list->list->ents[h->pos++];
+	}
+
+	errno = 0;
+	memset(&st, 0, sizeof st);
+	info = smbc_getFunctionReaddirPlus2(s->ctx)(s->ctx, h->f, &st);
+	if (info == NULL) {
+		/* on the end of the directory, the listing is complete */
+		if (h->fill != NULL && errno == 0)
+			dircache_put(s->cache, h->fill, h->generation);
 		else
-			*(slashptr + 1) = '\0';
+			dirlisting_free(h->fill);
+		h->fill = NULL;
+		return NULL;
 	}
 
-	if (strlen(buf) != 1 && *(buf + strlen(buf) - 1) == '/')
-		*(buf + strlen(buf) - 1) = '\0';
+	s->dent.type = (info->attrs & FILE_ATTRIBUTE_DIRECTORY) ?
+	    SMB_DIR : SMB_FILE;
+	s->dent.name = info->name;
+	s->dent.comment = "";
+	s->dent.mode = st.st_mode;
+	s->dent.size = st.st_size;
+	s->dent.mtime = st.st_mtime;
+
+	if (h->fill != NULL && !smblisting_add(h->fill->list, &s->dent)) {
+		dirlisting_free(h->fill);
+		h->fill = NULL;
+	}
 
-	if (strlen(buf) > SMB_PATH_MAXLEN) {
-		errno = ENAMETOOLONG;
-		return 0;
+	if (st.st_mode != 0 && !streql(info->name, ".") &&
+	    !streql(info->name, "..") &&
+	    strlen(h->path) + 1 + strlen(info->name) <= SMB_PATH_MAXLEN) {
+		strcpy(path, h->path);
+		strcat(path, streql(h->path, "/") ? "" : "/");
+		strcat(path, info->name);
+		statcache_put(s->cache, path, &st);
 	}
+	return &s->dent;
+}
 
-	/* copy the new and updated path */
-	strcpy(opath, buf);
 
-	return 1;
+/*
+ * Forgets the attributes of path, which was changed through s, and of the
+ * directory it is in, and the listings of both.  When subtree is set, also
+ * those of everything below path.  path may be NULL.
+ */
+static void
+invalidate(SmbSession *s, const char *path, int subtree)
+{
+	char	parent[SMB_PATH_MAXLEN + 1];
+	char   *slash;
+
+	if (path == NULL)
+		return;
+
+	statcache_remove(s->cache, path, subtree);
+	dircache_remove(s->cache, path, subtree, 1);
+
+	strcpy(parent, path);
+	if ((slash = strrchr(parent, '/')) != NULL) {
+		slash[slash == parent ? 1 : 0] = '\0';
+		statcache_remove(s->cache, parent, 0);
+		dircache_remove(s->cache, parent, 0, 1);
+	}
 }
 
 
-static char *
-strrslash(char *begin, char *end)
+/*
+ * Forgets the attributes of file path, whose contents were changed through
+ * s, and the listing of its directory which shows its size.  Its name and
+ * the directory itself did not change, so listings being read meanwhile
+ * are still stored.  path may be NULL.
+ */
+static void
+invalidate_contents(SmbSession *s, const char *path)
 {
-	char *last, *curr;
+	char	parent[SMB_PATH_MAXLEN + 1];
+	char   *slash;
 
-	last = NULL;
-	curr = begin - 1;
+	if (path == NULL)
+		return;
 
-	while ((curr = strchr(curr + 1, '/')) < end)
-		last = curr;
+	statcache_remove(s->cache, path, 0);
 
-	return last;
+	strcpy(parent, path);
+	if ((slash = strrchr(parent, '/')) != NULL) {
+		slash[slash == parent ? 1 : 0] = '\0';
+		dircache_remove(s->cache, parent, 0, 0);
+	}
+}
+
+
+/*
+ * Writes the uri of the share of s to buf, with pass as password, and
+ * returns its length.
+ */
+static size_t
+makeprefix(SmbSession *s, char *buf, const char *pass)
+{
+	char   *p;
+
+	p = buf;
+	p += sprintf(p, "smb://");
+	if (!streql(s->user, "")) {
+		p += sprintf(p, "%s", s->user);
+		if (!streql(s->pass, ""))
+			p += sprintf(p, ":%s", pass);
+		p += sprintf(p, "@");
+	}
+	p += sprintf(p, "%s/%s", s->host, s->share);
+	return p - buf;
+}
+
+
+/* Sets the uri of the working directory of s, as shown by smbs_getcwd. */
+static void
+makecwduri(SmbSession *s)
+{
+	size_t	len;
+
+	len = makeprefix(s, s->cwdbuf, "PASSWORD");
+	strcpy(s->cwdbuf + len, s->path);
+}
+
+
+/*
+ * Writes the uri of npath, relative to the working directory of s, to
+ * uribuf and returns a pointer to the path within the share in it.  On
+ * failure NULL is returned and errno is set.
+ */
+static const char *
+evaluri(SmbSession *s, char *uribuf, const char *npath)
+{
+	memcpy(uribuf, s->prefix, s->prefixlen);
+	if (!canonpath(uribuf + s->prefixlen, s->path, npath))
+		return NULL;
+	return uribuf + s->prefixlen;
+}
+
+
+/*
+ * Writes the canonical form of npath, relative to the absolute and
+ * canonical path base, to buf which must hold SMB_PATH_MAXLEN + 1 bytes.
+ * Double slashes, `.' and `..' (which stops at the root) are resolved in
+ * a single pass: each component is appended and `..' removes the last
+ * one.  The result starts with a slash and has no trailing slash unless
+ * it is the root.  buf and base must not overlap.  If it does not fit,
+ * zero is returned and errno set.  On success non-zero is returned.
+ */
+static int
+canonpath(char *buf, const char *base, const char *npath)
+{
+	const char *p, *end;
+	size_t	len, n;
+
+	/* buf holds the result without the trailing '\0', "" is the root */
+	len = 0;
+	if (*npath != '/') {
+		len = strlen(base);
+		memcpy(buf, base, len);
+		if (len == 1)
+			len = 0;
+	}
+
+	for (p = npath; *p != '\0'; p = end) {
+		while (*p == '/')
+			++p;
+		if ((end = strchr(p, '/')) == NULL)
+			end = p + strlen(p);
+		n = end - p;
+
+		if (n == 0 || (n == 1 && p[0] == '.'))
+			continue;
+		if (n == 2 && p[0] == '.' && p[1] == '.') {
+			while (len > 0 && buf[len - 1] != '/')
+				--len;
+			if (len > 0)
+				--len;
+			continue;
+		}
+
+		if (len + 1 + n > SMB_PATH_MAXLEN) {
+			errno = ENAMETOOLONG;
+			return 0;
+		}
+		buf[len++] = '/';
+		memcpy(buf + len, p, n);
+		len += n;
+	}
+
+	if (len == 0)
+		buf[len++] = '/';
+	buf[len] = '\0';
+	return 1;
 }
 
 
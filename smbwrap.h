@@ -7,8 +7,7 @@ enum {
 	SMB_SHARE_MAXLEN      =  127,
 	SMB_PATH_MAXLEN       = 1023,
 	SMB_WORKGROUP_MAXLEN  =  127,
-	SMB_URI_MAXLEN        =  6 + SMB_USER_MAXLEN + 1 + SMB_PASS_MAXLEN + 1 + SMB_HOST_MAXLEN + 1 + SMB_SHARE_MAXLEN + 1 + SMB_PATH_MAXLEN,
-	SMB_COMMENT_MAXLEN    = 1023
+	SMB_URI_MAXLEN        =  6 + SMB_USER_MAXLEN + 1 + SMB_PASS_MAXLEN + 1 + SMB_HOST_MAXLEN + 1 + SMB_SHARE_MAXLEN + 1 + SMB_PATH_MAXLEN
 };
 
 enum {
@@ -29,11 +28,29 @@ enum {
 
 
 typedef struct Smbdirent Smbdirent;
+typedef struct Smblisting Smblisting;
+typedef struct Smbcachestats Smbcachestats;
+typedef struct SmbSession SmbSession;
 
+/*
+ * An entry of a directory or of a listing of workgroups, hosts or shares.
+ * name and comment point into the listing it belongs to.  The attributes
+ * are only known for entries of a directory, mode is 0 otherwise.
+ */
 struct Smbdirent {
 	unsigned int    type;
-	char            comment[SMB_COMMENT_MAXLEN];
-	char            name[SMB_PATH_MAXLEN];
+	const char     *name;
+	const char     *comment;
+	mode_t	mode;
+	off_t	size;
+	time_t	mtime;
+};
+
+struct Smbcachestats {
+	int	stats;			/* cached attributes */
+	unsigned long	stathits, statmisses;
+	int	listings;		/* cached directory listings */
+	unsigned long	dirhits, dirmisses;
 };
 
 
@@ -41,6 +58,48 @@ extern int connected;
 
 
 int     smb_init(void);
+int     smb_worker_attach(void);
+void    smb_worker_detach(void);
+void    smb_setcachettl(int);
+SmbSession     *smb_getsession(void);
+SmbSession     *smb_setsession(SmbSession *);
+
+SmbSession     *smbs_new(void);
+SmbSession     *smbs_clone(const SmbSession *);
+void    smbs_free(SmbSession *);
+char   *smbs_connect(SmbSession *, const char *, const char *, const char *, const char *, const char *);
+int     smbs_disconnect(SmbSession *);
+int     smbs_connected(const SmbSession *);
+void    smbs_cachestats(SmbSession *, Smbcachestats *);
+int     smbs_refresh(SmbSession *, const char *);
+int     smbs_listed(SmbSession *, const char *);
+int     smbs_samecache(const SmbSession *, const SmbSession *);
+int     smbs_chdir(SmbSession *, const char *);
+const char     *smbs_getcwd(SmbSession *);
+const char     *smbs_gethost(SmbSession *);
+const char     *smbs_getshare(SmbSession *);
+int     smbs_abspath(SmbSession *, const char *, char [SMB_PATH_MAXLEN + 1]);
+int     smbs_mkdir(SmbSession *, const char *, mode_t);
+int     smbs_rmdir(SmbSession *, const char *);
+int     smbs_open(SmbSession *, const char *, int, mode_t);
+ssize_t smbs_read(SmbSession *, int, void *, size_t);
+ssize_t smbs_write(SmbSession *, int, const void *, size_t);
+int     smbs_ftruncate(SmbSession *, int, off_t);
+off_t   smbs_splice(SmbSession *, int, int, off_t, int (*)(off_t, void *), void *);
+off_t   smbs_lseek(SmbSession *, int, off_t, int);
+int     smbs_close(SmbSession *, int);
+int     smbs_stat(SmbSession *, const char *, struct stat *);
+int     smbs_fstat(SmbSession *, int, struct stat *);
+int     smbs_rename(SmbSession *, const char *, const char *);
+int     smbs_unlink(SmbSession *, const char *);
+int     smbs_utimes(SmbSession *, const char *, struct timeval *);
+int     smbs_opendir(SmbSession *, const char *);
+const Smbdirent        *smbs_readdir(SmbSession *, int);
+const Smbdirent        *smbs_readdirplus(SmbSession *, int, struct stat *);
+off_t   smbs_telldir(SmbSession *, int);
+int     smbs_lseekdir(SmbSession *, int, off_t);
+int     smbs_closedir(SmbSession *, int);
+
 char   *smb_connect(const char *, const char *, const char *, const char *, const char *);
 int     smb_disconnect(void);
 int     smb_chdir(const char *);
@@ -50,18 +109,27 @@ int     smb_rmdir(const char *);
 int     smb_open(const char *, int, mode_t);
 ssize_t smb_read(int, void *, size_t);
 ssize_t smb_write(int, const void *, size_t);
+int     smb_ftruncate(int, off_t);
+off_t   smb_splice(int, int, off_t, int (*)(off_t, void *), void *);
 off_t   smb_lseek(int, off_t, int);
 int     smb_close(int);
 int     smb_stat(const char *, struct stat *);
 int     smb_fstat(int, struct stat *);
 int     smb_rename(const char *, const char *);
 int     smb_unlink(const char *);
+int     smb_utimes(const char *, struct timeval *);
 int     smb_opendir(const char *);
-Smbdirent      *smb_readdir(int);
+const Smbdirent        *smb_readdir(int);
+const Smbdirent        *smb_readdirplus(int, struct stat *);
 off_t   smb_telldir(int);
 int     smb_lseekdir(int, off_t);
 int     smb_closedir(int);
+int     smb_refresh(const char *);
+int     smb_listed(const char *);
 int     validconn(const char *, const char *, const char *, const char *, const char *);
-const char     *smb_workgroups(List *);
-const char     *smb_hosts(const char *, List *);
-const char     *smb_shares(const char *, const char *, const char *, List *);
+const char     *smb_workgroups(Smblisting **);
+const char     *smb_hosts(const char *, Smblisting **);
+const char     *smb_shares(const char *, const char *, const char *, Smblisting **);
+int     smblisting_count(const Smblisting *);
+const Smbdirent        *smblisting_entry(const Smblisting *, int);
+void    smblisting_free(Smblisting *);
@@ -3,8 +3,214 @@
 #include "samblah.h"
 
 enum {
-	TRANSFER_BUFSIZE     = 32768,	/* size of buffer for `get' */
-	PROGRESSLINE_MAXLEN  =  1024	/* length of line, used for buffer */
+	PROGRESSLINE_MAXLEN  =  1024,	/* length of line, used for buffer */
+	QUEUE_MAXJOBS        =  1024,	/* files queued for workers at most */
+	SEGMENT_MINSIZE      = 4 * 1024 * 1024,	/* smallest segment of a download */
+	PIPE_WAITMSEC        =   100,	/* int_signal is checked this often */
+	BLOCKSIZE_WINDOW     =     8,	/* blocks measured at each size */
+	BLOCKSIZE_SETTLE     =    32,	/* windows to wait before growing */
+	BLOCKSIZE_MAXUSEC    = 1000000	/* a block should not take longer */
+};
+
+#define SEGSTATE_SUFFIX	".samblah"	/* appended to name of state file */
+#define SEGSTATE_MAGIC	"samblahS"
+
+
+/* A file to be transferred by a worker of a parallel transfer. */
+typedef struct Job Job;
+
+struct Job {
+	int	remotesource;
+	int	remotedest;
+	char   *spath;
+	char   *dpath;
+	int    *dexist;
+	SmbSession     *dest;		/* see destkey */
+	Job    *next;
+};
+
+/*
+ * State of a parallel transfer, see transfer_pool_start.  The producer (the
+ * thread walking the directories) queues jobs, the workers transfer them.
+ * Lock protects the queue and the counters, promptlock is held while writing
+ * to the terminal or asking the user a question, so only one worker at a
+ * time does so.
+ */
+typedef struct Pool Pool;
+
+struct Pool {
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;		/* signalled on every change of the queue */
+	pthread_mutex_t promptlock;
+	Job    *head, *tail;		/* queue of jobs */
+	int	queued;			/* number of jobs in queue */
+	int	closing;		/* no more jobs will be queued */
+	int	nworkers;		/* workers still running */
+	int	nthreads;		/* threads in threads */
+	pthread_t      *threads;
+	int	showprogress;
+	int	files;			/* files transferred */
+	off_t	bytes;			/* bytes transferred by all workers */
+	struct timeval	begintime;
+	struct timeval	lastprint;	/* time progress was last printed */
+};
+
+/* Non-NULL while a parallel transfer is in progress. */
+static Pool    *pool;
+
+/*
+ * During a copy between two sessions, the session of the calling thread on
+ * which the destination files are: the sessions of the files cannot be
+ * shared between threads, so each worker and each helper thread of a pipe
+ * has its own.  NULL when the destination is on the current session.
+ */
+static pthread_key_t	destkey;
+static pthread_once_t	destkey_once = PTHREAD_ONCE_INIT;
+
+
+/*
+ * A segmented transfer copies disjoint ranges (segments) of one large file
+ * over several connections at once, one thread with a session of its own per
+ * segment.  A download writes each segment to its place in the local file.
+ * The position of each segment is kept in a state file next to the local
+ * file: a Segheader followed by an off_t for each segment.  Each segment
+ * thread only writes its own position, so an interrupted download can be
+ * resumed per segment.  An upload writes to a partial remote file which only
+ * replaces the destination when all segments have landed.
+ */
+typedef struct Segheader Segheader;
+typedef struct Segmented Segmented;
+typedef struct Segment Segment;
+
+struct Segheader {
+	char	magic[8];		/* SEGSTATE_MAGIC */
+	off_t	size;			/* size of source */
+	time_t	mtime;			/* modification time of source */
+	int	count;			/* number of segments */
+};
+
+struct Segmented {
+	int	remotesource;
+	const char     *rpath;		/* remote source or partial destination */
+	int	lfd;			/* local destination or source */
+	int	statefd;		/* state file of a download, or -1 */
+	off_t	size;			/* of the file */
+	pthread_mutex_t lock;		/* protects copied and failed */
+	off_t	copied;			/* bytes copied by all segments */
+	int	failed;			/* a segment failed with errno save_errno */
+	int	save_errno;
+};
+
+struct Segment {
+	Segmented      *sd;
+	int	index;
+	off_t	pos;			/* next offset to copy */
+	off_t	end;			/* end of the range, exclusive */
+	size_t	blocksize;		/* size of the last block */
+	pthread_t	thread;
+};
+
+
+/*
+ * Size of the blocks in which a file is copied, see variable `blocksize'.
+ * Unless fixed, the throughput is measured over windows of BLOCKSIZE_WINDOW
+ * blocks: the size is doubled as long as that improves the throughput by
+ * more than a tenth, halved when it got worse by more than that or when
+ * blocks take too long, and then kept for BLOCKSIZE_SETTLE windows.
+ */
+typedef struct Blocksize Blocksize;
+
+struct Blocksize {
+	size_t	size;			/* size of the next block */
+	int	fixed;
+	int	blocks;			/* blocks in current window */
+	size_t	bytes;			/* bytes in current window */
+	unsigned long	usec;		/* duration of current window */
+	double	baseline;		/* throughput before doubling, or 0 */
+	int	settle;			/* windows to wait */
+	struct timeval	last;		/* end of previous block */
+};
+
+
+/*
+ * A ring of buffers through which copybyfd passes the file from the thread
+ * reading it to the thread writing it, see variable `buffers'.  Lock protects
+ * head, filled, eof and failed.  The buffer at head is being written, the
+ * buffer after the filled ones is being read into.
+ */
+typedef struct Pipe Pipe;
+
+struct Pipe {
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;		/* signalled on every change */
+	int	nbufs;
+	char  **bufs;
+	ssize_t        *lens;		/* number of bytes in each buffer */
+	int	head;			/* oldest filled buffer */
+	int	filled;			/* number of filled buffers */
+	int	eof;			/* reader is done */
+	size_t *bufsizes;		/* allocated size of each buffer */
+	Blocksize      *bs;
+	int	failed;			/* reader or writer failed, see save_errno */
+	int	save_errno;
+	int	remotesource;
+	SmbSession     *dest;		/* for the helper, see destkey */
+	int	from, to;
+	ssize_t (*readfrom)(int, void *, size_t);
+	ssize_t (*writeto)(int, const void *, size_t);
+	size_t  copied;			/* number of bytes written */
+};
+
+
+/* What splicecb needs to turn the count of smb_splice into progress. */
+typedef struct SpliceProgress SpliceProgress;
+
+struct SpliceProgress {
+	size_t *copied;
+	size_t	start;			/* value of *copied before splicing */
+};
+
+
+/*
+ * A fan-out upload, see transfer_put_many: the local file is read once
+ * into a ring of nbufs blocks, a writer thread per destination writes them
+ * on its session.  Block seq is in buffer seq % nbufs, which is only read
+ * into again when every writer still running is done with it, so a slow
+ * destination holds the others back by at most nbufs blocks.  Lock protects
+ * everything but the contents of the buffers.
+ */
+typedef struct Fanout Fanout;
+typedef struct Fantarget Fantarget;
+
+struct Fantarget {
+	Fanout *f;
+	SmbSession     *s;
+	char	label[SESSION_NAME_MAXLEN + 1 + SMB_PATH_MAXLEN + 1];
+	int	fd;			/* destination file, -1 when not written */
+	int	skipped;		/* left alone as onexist told */
+	off_t	offset;			/* where writing starts */
+	off_t	written;		/* bytes written from offset on */
+	long	next;			/* next block to write */
+	int	done;
+	int	failed;			/* failed with errno save_errno */
+	int	save_errno;
+	struct timeval	endtime;
+	pthread_t	thread;
+	int	started;		/* thread is running */
+};
+
+struct Fanout {
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;		/* signalled on every change */
+	int	nbufs;
+	char  **bufs;
+	size_t *bufsizes;		/* allocated size of each buffer */
+	ssize_t        *lens;		/* number of bytes in each buffer */
+	off_t  *offsets;		/* offset in the file of each buffer */
+	long	nread;			/* number of blocks read */
+	int	eof;			/* reader is done */
+	Fantarget      *targets;
+	int	ntargets;
 };
 
 
@@ -21,16 +227,69 @@ static int      progresslen;
 
 
 static void     alarm_handler(int);
+static int      startprogress(const char *, off_t, off_t);
+static void     stopprogress(void);
 static int      mkpath(const char *, mode_t, int (*)(const char *, mode_t));
-static void     transfer(int, const char *, const char *, int *, int);
-static void     transferfile(int, const char *, const char *, int *);
-static int      copybyfd(int, int, int, off_t, off_t, const char *);
+static void     transfer(int, int, const char *, const char *, int *, int);
+static void     transferfile(int, int, const char *, const char *, int *);
+static void     queuefile(int, int, const char *, const char *, int *);
+static void    *worker(void *);
+static void     jobfree(Job *);
+static void     destkey_init(void);
+static SmbSession      *destsession(void);
+static void     lockprompt(void);
+static void     unlockprompt(void);
+static void     pool_progress(size_t);
+static void     pool_completed(const char *, off_t, double, size_t);
+static int      segmentcount(off_t);
+static char    *segstatepath(const char *);
+static int      hassegstate(const char *);
+static int      getsegmented(const char *, const char *, int, struct stat, int);
+static int      putsegmented(const char *, int, const char *, struct stat);
+static int      runsegments(Segmented *, Segment *, int, const char *, off_t, off_t);
+static void    *segment(void *);
+static int      copybyfd(int, int, int, int, off_t, off_t, const char *, int);
+static void     deltafile(int, int, const char *, const char *, struct stat,
+		    struct stat);
+static ssize_t  readfull(int, ssize_t (*)(int, void *, size_t), char *,
+		    size_t);
+static int      writefull(int, ssize_t (*)(int, const void *, size_t),
+		    const char *, size_t);
+static int      copyspliced(int, int, off_t, size_t *);
+static int      splicecb(off_t, void *);
+static int      copyserial(int, int, ssize_t (*)(int, void *, size_t),
+		    ssize_t (*)(int, const void *, size_t), Blocksize *,
+		    size_t *);
+static int      copypiped(int, int, int, ssize_t (*)(int, void *, size_t),
+		    ssize_t (*)(int, const void *, size_t), int, Blocksize *,
+		    size_t *);
+static void    *pipehelper(void *);
+static void     pipe_read(Pipe *);
+static void     pipe_write(Pipe *);
+static void     pipe_fail(Pipe *, int);
+static void     waitbriefly(pthread_cond_t *, pthread_mutex_t *);
+static int      fanopen(Fantarget *, const char *, struct stat, int *);
+static int      fanread(Fanout *, int, off_t, Blocksize *);
+static long     fanslowest(Fanout *, Fantarget **);
+static void    *fanwriter(void *);
+static void     addprogress(size_t, size_t *);
+static void     blocksize_init(Blocksize *);
+static void     blocksize_update(Blocksize *, size_t);
 static int      askonexist(const char *, struct stat, struct stat, int *, int *);
 static int      open_wrap(const char *, int, mode_t);
-static void     makeprogress(const char *, double, off_t);
+static int      dest_open(const char *, int, mode_t);
+static int      dest_close(int);
+static int      dest_stat(const char *, struct stat *);
+static off_t    dest_lseek(int, off_t, int);
+static ssize_t  dest_read(int, void *, size_t);
+static ssize_t  dest_write(int, const void *, size_t);
+static int      dest_mkdir(const char *, mode_t);
+static int      dest_ftruncate(int, off_t);
+static void     makeprogress(const char *, double, off_t, int);
 static void     makesize(char [10], off_t);
+static void     makespeed(char [13], double);
 static void     printprogress(void);
-static void     printcompleted(double);
+static void     printcompleted(const char *, off_t, double, size_t);
 static unsigned long    timediff(struct timeval, struct timeval);
 
 
@@ -42,11 +301,12 @@ static unsigned long    timediff(struct timeval, struct timeval);
 void
 transfer_get(const char *rpath, const char *lpath, int *exist, int ropt)
 {
-	int remotesource;
+	int remotesource, remotedest;
 
 	/* use the generic transfer for retrieving */
 	remotesource = 1;
-	transfer(remotesource, rpath, lpath, exist, ropt);
+	remotedest = 0;
+	transfer(remotesource, remotedest, rpath, lpath, exist, ropt);
 }
 
 
@@ -58,74 +318,445 @@ transfer_get(const char *rpath, const char *lpath, int *exist, int ropt)
 void
 transfer_put(const char *lpath, const char *rpath, int *exist, int ropt)
 {
-	int	remotesource;
+	int	remotesource, remotedest;
 
 	/* use the generic transfer for uploading */
 	remotesource = 0;
-	transfer(remotesource, lpath, rpath, exist, ropt);
+	remotedest = 1;
+	transfer(remotesource, remotedest, lpath, rpath, exist, ropt);
+}
+
+
+/*
+ * Copies the remote spath to the remote dpath, possibly recursive.  dpath
+ * is on session dest, or on the current session when dest is NULL.  On one
+ * session, files are copied on the server when it can, see copyspliced.
+ * Between two sessions they stream through memory, one thread reading
+ * while another writes, see copypiped.  exist tells what to do when dpath
+ * already exists.  Note that the user will be prompted for input when
+ * exist is `ask'.
+ */
+void
+transfer_copy(const char *spath, SmbSession *dest, const char *dpath,
+    int *exist, int ropt)
+{
+	int	remotesource, remotedest;
+
+	(void)pthread_once(&destkey_once, destkey_init);
+	(void)pthread_setspecific(destkey, dest);
+
+	remotesource = 1;
+	remotedest = 1;
+	transfer(remotesource, remotedest, spath, dpath, exist, ropt);
+
+	(void)pthread_setspecific(destkey, NULL);
+}
+
+
+/*
+ * Uploads local file lpath to the working directory of each of the ndests
+ * sessions in dests, called names.  The file is read once and written to
+ * all of them at the same time: one that fails does not stop the others,
+ * one that is slow only holds them back when it is `buffers' blocks behind.
+ * Each destination is resumed, overwritten or skipped as exist tells.  Note
+ * that the user will be prompted for input when exist is `ask'.
+ */
+void
+transfer_put_many(const char *lpath, SmbSession **dests, char **names,
+    int ndests, int *exist)
+{
+	Fanout	f;
+	Fantarget      *t;
+	Blocksize	bs;
+	struct stat	sst;
+	struct timeval	begintime;
+	sigset_t	set, oset;
+	const char     *rpath;
+	char	sizebuf[10];
+	off_t	cur;
+	int	sfd, i, ok, save_errno, showprogress;
+
+	if (stat(lpath, &sst) != 0) {
+		cmdwarn("%s", lpath);
+		return;
+	}
+	if (S_ISDIR(sst.st_mode)) {
+		cmdwarnx("%s: cannot put directory to several sessions", lpath);
+		return;
+	}
+	if ((sfd = open(lpath, O_RDONLY)) < 0) {
+		cmdwarn("opening %s", lpath);
+		return;
+	}
+
+	/* files do not need directory part */
+	rpath = (strrchr(lpath, '/') != NULL) ? strrchr(lpath, '/') + 1 : lpath;
+
+	/* open the destinations, reading starts where the first resumes */
+	f.targets = xmalloc(sizeof f.targets[0] * ndests);
+	f.ntargets = ndests;
+	cur = -1;
+	for (i = 0; i < ndests; ++i) {
+		t = &f.targets[i];
+		t->f = &f;
+		t->s = dests[i];
+		(void)xsnprintf(t->label, sizeof t->label, "%s:%s", names[i],
+		    rpath);
+		t->offset = t->written = 0;
+		t->next = 0;
+		t->done = t->failed = t->started = t->skipped = 0;
+		t->fd = int_signal ? -1 : fanopen(t, rpath, sst, exist);
+		if (t->fd >= 0 && (cur == -1 || t->offset < cur))
+			cur = t->offset;
+	}
+	if (cur == -1 || (cur > 0 && lseek(sfd, cur, SEEK_SET) == -1)) {
+		if (cur != -1)
+			cmdwarn("seeking %s", lpath);
+		for (i = 0; i < ndests; ++i) {
+			t = &f.targets[i];
+			if (t->fd >= 0)
+				(void)smbs_close(t->s, t->fd);
+			else if (t->skipped && !int_signal)
+				(void)printf("%s: skipped\n", t->label);
+		}
+		free(f.targets);
+		(void)close(sfd);
+		return;
+	}
+
+	blocksize_init(&bs);
+	(void)pthread_mutex_init(&f.lock, NULL);
+	(void)pthread_cond_init(&f.cond, NULL);
+	f.nbufs = getvariable_int("buffers");
+	f.bufs = xmalloc(sizeof f.bufs[0] * f.nbufs);
+	f.bufsizes = xmalloc(sizeof f.bufsizes[0] * f.nbufs);
+	for (i = 0; i < f.nbufs; ++i) {
+		f.bufs[i] = xmalloc(bs.size);
+		f.bufsizes[i] = bs.size;
+	}
+	f.lens = xmalloc(sizeof f.lens[0] * f.nbufs);
+	f.offsets = xmalloc(sizeof f.offsets[0] * f.nbufs);
+	f.nread = 0;
+	f.eof = 0;
+
+	/* signals are handled by this thread, the writers inherit the mask */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGWINCH);
+	sigaddset(&set, SIGALRM);
+	(void)pthread_sigmask(SIG_BLOCK, &set, &oset);
+	for (i = 0; i < ndests; ++i) {
+		t = &f.targets[i];
+		if (t->fd < 0)
+			continue;
+		if ((errno = pthread_create(&t->thread, NULL, fanwriter,
+		    t)) != 0) {
+			t->failed = 1;
+			t->save_errno = errno;
+		} else
+			t->started = 1;
+	}
+	(void)pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+	(void)gettimeofday(&begintime, NULL);
+	showprogress = startprogress(rpath, cur, sst.st_size);
+	ok = fanread(&f, sfd, cur, &bs);
+	save_errno = errno;
+	for (i = 0; i < ndests; ++i)
+		if (f.targets[i].started)
+			(void)pthread_join(f.targets[i].thread, NULL);
+	if (showprogress)
+		stopprogress();
+	(void)close(sfd);
+
+	if (!ok && !int_signal) {
+		errno = save_errno;
+		cmdwarn("reading %s", lpath);
+	}
+
+	/*
+	 * report each destination with how far it got, unless interrupted.
+	 * failures to open it have been reported by fanopen.
+	 */
+	for (i = 0; i < ndests; ++i) {
+		t = &f.targets[i];
+		if (t->fd < 0) {
+			if (t->skipped && !int_signal)
+				(void)printf("%s: skipped\n", t->label);
+			continue;
+		}
+		if (smbs_close(t->s, t->fd) != 0 && !t->failed) {
+			t->failed = 1;
+			t->save_errno = errno;
+		}
+		if (int_signal)
+			continue;
+		makesize(sizebuf, t->offset + t->written);
+		if (t->failed) {
+			errno = t->save_errno;
+			cmdwarn("transferring %s, failed at %s", t->label,
+			    sizebuf);
+		} else if (ok)
+			printcompleted(t->label, t->offset + t->written,
+			    (timediff(t->endtime, begintime) == 0) ? 0.0 :
+			    (double)1e6 * (double)t->written /
+			    (double)timediff(t->endtime, begintime), bs.size);
+		else
+			cmdwarnx("transferring %s, stopped at %s", t->label,
+			    sizebuf);
+	}
+
+	for (i = 0; i < f.nbufs; ++i)
+		free(f.bufs[i]);
+	free(f.bufs);
+	free(f.bufsizes);
+	free(f.lens);
+	free(f.offsets);
+	free(f.targets);
+	(void)pthread_cond_destroy(&f.cond);
+	(void)pthread_mutex_destroy(&f.lock);
+}
+
+
+/*
+ * Starts a parallel transfer when variable `parallel' is larger than one:
+ * until transfer_pool_finish is called, transfer_get and transfer_put only
+ * walk the source directories and queue the files they find.  That many
+ * worker threads, each with a session of its own, transfer the
+ * queued files.  Questions about existing files are asked one at a time.
+ * When no worker can be started, files are transferred the usual way.
+ */
+void
+transfer_pool_start(void)
+{
+	int	n;
+	sigset_t	set, oset;
+
+	assert(pool == NULL);
+
+	n = getvariable_int("parallel");
+	if (n <= 1)
+		return;
+
+	pool = xmalloc(sizeof (Pool));
+	(void)pthread_mutex_init(&pool->lock, NULL);
+	(void)pthread_cond_init(&pool->cond, NULL);
+	(void)pthread_mutex_init(&pool->promptlock, NULL);
+	pool->head = pool->tail = NULL;
+	pool->queued = 0;
+	pool->closing = 0;
+	pool->nworkers = 0;
+	pool->nthreads = 0;
+	pool->threads = xmalloc(sizeof pool->threads[0] * n);
+	pool->showprogress = getvariable_bool("showprogress");
+	pool->files = 0;
+	pool->bytes = 0;
+	(void)gettimeofday(&pool->begintime, NULL);
+	pool->lastprint = pool->begintime;
+
+	/* signals are handled by this thread, workers inherit the mask */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGWINCH);
+	sigaddset(&set, SIGALRM);
+	(void)pthread_sigmask(SIG_BLOCK, &set, &oset);
+
+	(void)pthread_mutex_lock(&pool->lock);
+	while (pool->nthreads < n) {
+		if (pthread_create(&pool->threads[pool->nthreads], NULL,
+		    worker, NULL) != 0)
+			break;
+		++pool->nthreads;
+		++pool->nworkers;
+	}
+	(void)pthread_mutex_unlock(&pool->lock);
+
+	(void)pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+	if (pool->nthreads == 0) {
+		cmdwarnx("could not start workers, transferring serially");
+		transfer_pool_finish();
+	}
+}
+
+
+/*
+ * Waits for the workers of the parallel transfer to finish the queued files
+ * and stops them.  Does nothing when no parallel transfer is in progress.
+ */
+void
+transfer_pool_finish(void)
+{
+	int	i;
+	Pool   *p;
+	Job    *job;
+	char	sizebuf[10];
+	char	speedbuf[13];
+	struct timeval	endtime;
+
+	if (pool == NULL)
+		return;
+
+	(void)pthread_mutex_lock(&pool->lock);
+	pool->closing = 1;
+	(void)pthread_cond_broadcast(&pool->cond);
+	(void)pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; ++i)
+		(void)pthread_join(pool->threads[i], NULL);
+
+	/* from here on, transfers are not parallel anymore */
+	p = pool;
+	pool = NULL;
+
+	/* jobs are left when no worker could attach */
+	while ((job = p->head) != NULL) {
+		p->head = job->next;
+		if (job->dest != NULL)
+			(void)pthread_setspecific(destkey, job->dest);
+		if (!int_signal)
+			transferfile(job->remotesource, job->remotedest,
+			    job->spath, job->dpath, job->dexist);
+		if (job->dest != NULL)
+			(void)pthread_setspecific(destkey, NULL);
+		jobfree(job);
+	}
+
+	if (p->files > 1 && !int_signal) {
+		(void)gettimeofday(&endtime, NULL);
+		makesize(sizebuf, p->bytes);
+		makespeed(speedbuf, (timediff(endtime, p->begintime) == 0) ? 0.0 :
+		    (double)1e6 * (double)p->bytes /
+		    (double)timediff(endtime, p->begintime));
+		printf("%d files, %s, %s\n", p->files, sizebuf,
+		    speedbuf + strspn(speedbuf, " "));
+	}
+
+	(void)pthread_mutex_destroy(&p->lock);
+	(void)pthread_cond_destroy(&p->cond);
+	(void)pthread_mutex_destroy(&p->promptlock);
+	free(p->threads);
+	free(p);
 }
 
 
 /*
- * Like transfer_get, but retrieve rpath and write it to fd.  rpath
- * cannot be transferred recursively.  The user will not be prompted.
- * On success non-zero is returned, otherwise zero is returned and
- * errno set.
+ * Like transfer_get, but retrieve rpath and write it to destfd as it
+ * arrives, destfd may be a pipe or the terminal.  rpath cannot be
+ * transferred recursively, the user will not be prompted and no progress
+ * is printed.  destfd is always closed.  When destfd is a pipe whose
+ * reader went away, e.g. a pager the user quit, retrieving stops without
+ * an error.  On success non-zero is returned, otherwise zero is returned
+ * and a message printed.
  */
 int
 transfer_get_fd(const char *rpath, int destfd)
 {
 	int	sourcefd;
-	int	save_errno;		
 	int	remotesource;
+	int	ok;
 	struct stat st;
+	struct sigaction ignact, pipeact;
 
 	sourcefd = smb_open(rpath, O_RDONLY, (mode_t)0);
 	if (sourcefd < 0) {
 		cmdwarn("opening %s", rpath);
+		(void)close(destfd);
 		return 0;
 	}
 
 	/* get size of remote file */
-	if (smb_stat(rpath, &st) != 0) {
-		save_errno = errno;
-
+	if (globmatch(rpath, &st) != GLM_ATTRS && smb_stat(rpath, &st) != 0) {
 		cmdwarn("%s", rpath);
 		(void)smb_close(sourcefd);
-
-		errno = save_errno;
+		(void)close(destfd);
 		return 0;
 	}
 
+	/* a closed pipe should be an error from write, not kill samblah */
+	ignact.sa_handler = SIG_IGN;
+	ignact.sa_flags = 0;
+	sigemptyset(&ignact.sa_mask);
+	(void)sigaction(SIGPIPE, &ignact, &pipeact);
+
 	/* do the copying, copybyfd closes the file handles */
 	remotesource = 1;
-	if (!copybyfd(sourcefd, destfd, remotesource, (off_t)0, st.st_size, rpath)) {
+	ok = copybyfd(sourcefd, destfd, remotesource, 0, (off_t)0, st.st_size,
+	    rpath, 1);
+	if (!ok && errno == EPIPE)
+		ok = 1;
+	else if (!ok && !int_signal)    /* on SIGINT, just stop */
+		cmdwarn("retrieving %s", rpath);
+
+	(void)sigaction(SIGPIPE, &pipeact, NULL);
+	return ok;
+}
+
+
+/*
+ * Like transfer_put, but upload what is read from srcfd until end of file,
+ * which may be a pipe or standard input, to rpath.  Its size is not known
+ * in advance, so progress only shows the amount uploaded and an existing
+ * rpath cannot be resumed: it is overwritten when exist is `overwrite',
+ * skipped when it is `skip' and otherwise an error, the user is not asked
+ * since srcfd may be what the user types.  srcfd is always closed.  On
+ * success non-zero is returned, otherwise zero is returned and a message
+ * printed.
+ */
+int
+transfer_put_fd(int srcfd, const char *rpath, int exist)
+{
+	int	destfd;
+	int	flags;
+	int	remotesource;
+
+	flags = O_WRONLY | O_CREAT;
+	flags |= (exist == VAR_OVERWRITE) ? O_TRUNC : O_EXCL;
+	destfd = smb_open(rpath, flags,
+	    (mode_t)(S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH));
+	if (destfd < 0) {
+		if (errno == EEXIST && exist == VAR_SKIP) {
+			(void)close(srcfd);
+			return 1;
+		}
+		if (errno == EEXIST)
+			cmdwarnx("%s exists, use -f to overwrite it", rpath);
+		else
+			cmdwarn("opening %s", rpath);
+		(void)close(srcfd);
+		return 0;
+	}
+
+	/* do the copying, copybyfd closes the file handles */
+	remotesource = 0;
+	if (!copybyfd(srcfd, destfd, remotesource, 1, (off_t)0, (off_t)-1,
+	    rpath, 0)) {
 		/* on SIGINT, do not say anything, just stop */
 		if (!int_signal)
-			cmdwarn("retrieving %s", rpath);
+			cmdwarn("transferring %s", rpath);
 		return 0;
 	}
-
 	return 1;
 }
 
 
 /*
  * Transfers spath (source path) which is remote or local (remotesource), to
- * dpath (destination path) which resides at the opposite side (remote or
- * local), when ropt is true spath is retrieved recursively.  dexist what to do
+ * dpath (destination path) which is remote or local (remotedest), when ropt
+ * is true spath is retrieved recursively.  dexist what to do
  * when dpath exists, note that this must be a pointer so the value can be save
  * when the user selects `overwrite all', `resume all' or `skip all'.
  */
 static void
-transfer(int remotesource, const char *spath, const char *dpath,
-    int *dexist, int ropt)
+transfer(int remotesource, int remotedest, const char *spath,
+    const char *dpath, int *dexist, int ropt)
 {
 	int len;                /* for length of spath */
 	int dh = -1;            /* for remote directory handle */
 	DIR *dp = NULL;         /* for local directory stream */
 
 	struct stat st;		/* for information of spath */
+	struct stat rst;	/* for information of entries on remote */
 	const Smbdirent *rdent = NULL;		/* for recursion on remote */
 	const struct dirent *ldent = NULL;	/* for recursion on local */
 
@@ -133,17 +764,17 @@ transfer(int remotesource, const char *spath, const char *dpath,
 	int (*dmkdir)(const char *, mode_t);    /* for mkdir of destination */
 
 	sstat = remotesource ? smb_stat : stat;
-	dmkdir = remotesource ? mkdir : smb_mkdir;
+	dmkdir = remotedest ? dest_mkdir : mkdir;
 
 	/* have to find out if argument is file or directory */
-	if (sstat(spath, &st) != 0) {
+	if (globmatch(spath, &st) == GLM_NONE && sstat(spath, &st) != 0) {
 		cmdwarn("%s", spath);
 		return;
 	}
 
 	/* if file, transfer immediately */
 	if (!S_ISDIR(st.st_mode)) {
-		transferfile(remotesource, spath, dpath, dexist);
+		queuefile(remotesource, remotedest, spath, dpath, dexist);
 		return;
 	}
 
@@ -169,7 +800,7 @@ transfer(int remotesource, const char *spath, const char *dpath,
 
 	/* walk through contents of directory */
 	while (!int_signal &&
-	    ((remotesource && (rdent = smb_readdir(dh)) != NULL) ||
+	    ((remotesource && (rdent = smb_readdirplus(dh, &rst)) != NULL) ||
 	    (!remotesource && ((ldent = readdir(dp)) != NULL)))) {
 		char *nspath;                   /* for new source path */
 		char *ndpath;                   /* for new destination path */
@@ -179,12 +810,12 @@ transfer(int remotesource, const char *spath, const char *dpath,
 
 		sdent_name = remotesource ? rdent->name : ldent->d_name;
 		spathmax = remotesource ? SMB_PATH_MAXLEN : pathconf(spath, _PC_PATH_MAX);
-		dpathmax = !remotesource ? SMB_PATH_MAXLEN : pathconf(dpath, _PC_PATH_MAX);
+		dpathmax = remotedest ? SMB_PATH_MAXLEN : pathconf(dpath, _PC_PATH_MAX);
 
 		/* use default PATH_MAXLEN when pathconf returns infinite */
 		if (!remotesource && spathmax == -1)
 			spathmax = FALLBACK_PATH_MAXLEN;
-		if (remotesource && dpathmax == -1)
+		if (!remotedest && dpathmax == -1)
 			dpathmax = FALLBACK_PATH_MAXLEN;
 
 		/* make sure we do not transfer dot or dot-dot */
@@ -231,8 +862,16 @@ transfer(int remotesource, const char *spath, const char *dpath,
 			strcat(ndpath, "/");
 		strcat(ndpath, sdent_name);
 
-		/* transfer the new file/directory recursively */
-		transfer(remotesource, nspath, ndpath, dexist, ropt);
+		/*
+		 * transfer the new file/directory recursively, remote files
+		 * are known to be files from their entry, saving a stat
+		 */
+		if (remotesource && rst.st_mode != 0 && !S_ISDIR(rst.st_mode))
+			queuefile(remotesource, remotedest, nspath, ndpath,
+			    dexist);
+		else
+			transfer(remotesource, remotedest, nspath, ndpath,
+			    dexist, ropt);
 
 		free(ndpath);
 		free(nspath);
@@ -242,7 +881,7 @@ transfer(int remotesource, const char *spath, const char *dpath,
 		if (remotesource)
 			(void)smb_closedir(dh);
 		else
-			(void)close(dh);
+			(void)closedir(dp);
 		return;
 	}
 
@@ -254,18 +893,20 @@ transfer(int remotesource, const char *spath, const char *dpath,
 
 
 /*
- * Transfers spath which may be remote or local (remotesource), to dpath (which
- * resides at the opposite side (local or remote)).  dexist tells what to do
+ * Transfers spath which may be remote or local (remotesource), to dpath which
+ * may be remote or local (remotedest).  dexist tells what to do
  * when dpath exits.
  */
 static void
-transferfile(int remotesource, const char *spath, const char *dpath, int *dexist)
+transferfile(int remotesource, int remotedest, const char *spath,
+    const char *dpath, int *dexist)
 {
 	/* for calling tranferfile after having asked on destination exist */
 	int tmpexist;
 	int sfd, dfd;   /* source and destination file handle */
 	int flags;      /* flags for opening of file */
 	off_t offset;   /* where to start in file when resuming */
+	int segput;     /* whether an upload is split in segments */
 	struct stat dst, sst;
 
 	int (*dopen)(const char *, int, mode_t);
@@ -278,25 +919,33 @@ transferfile(int remotesource, const char *spath, const char *dpath, int *dexist
 	off_t (*slseek)(int, off_t, int);
 	int (*sfstat)(int, struct stat *);
 
-	dopen  = remotesource ? open_wrap : smb_open;
+	dopen  = remotedest ? dest_open : open_wrap;
 	sopen  = remotesource ? smb_open : open_wrap;
-	dclose = remotesource ? close : smb_close;
+	dclose = remotedest ? dest_close : close;
 	sclose = remotesource ? smb_close : close;
-	dstat  = remotesource ? stat : smb_stat;
+	dstat  = remotedest ? dest_stat : stat;
 	sstat  = remotesource ? smb_stat : stat;
-	dlseek = remotesource ? lseek : smb_lseek;
+	dlseek = remotedest ? dest_lseek : lseek;
 	slseek = remotesource ? smb_lseek : lseek;
 	sfstat = remotesource ? smb_fstat : fstat;
 
 	offset = 0;             /* start at begin by default */
 	dst.st_size = 0;        /* `current position' is begin by default */
 
+	/*
+	 * a large upload is written to a partial file which replaces the
+	 * destination once complete, until then the destination is kept
+	 */
+	segput = !remotesource && remotedest && pool == NULL &&
+	    stat(spath, &sst) == 0 && segmentcount(sst.st_size) > 1;
+
 	/* default is create file and write only */
 	flags = O_WRONLY | O_CREAT;
 
-	if (*dexist == VAR_OVERWRITE)
-		flags |= O_TRUNC;       /* just overwrite */
-	else
+	if (*dexist == VAR_OVERWRITE) {
+		if (!segput)
+			flags |= O_TRUNC;       /* just overwrite */
+	} else
 		/* for checking if file exists (ask or resume) */
 		flags |= O_EXCL;
 
@@ -320,13 +969,39 @@ transferfile(int remotesource, const char *spath, const char *dpath, int *dexist
 			return;
 		}
 
-		if (sstat(spath, &sst) != 0) {
+		/*
+		 * resuming and delta updates go by the size of the source, which
+		 * must be as it is now, not as listed when globbing
+		 */
+		if ((globmatch(spath, &sst) != GLM_ATTRS ||
+		    *dexist == VAR_RESUME || *dexist == VAR_DELTA) &&
+		    sstat(spath, &sst) != 0) {
 			cmdwarn("%s", spath);
 			return;
 		}
 
+		/* only write what differs */
+		if (*dexist == VAR_DELTA) {
+			deltafile(remotesource, remotedest, spath, dpath, sst,
+			    dst);
+			return;
+		}
+
 		/* if we should be resuming, try to open destination */
 		if (*dexist == VAR_RESUME) {
+			/* continue an interrupted segmented download */
+			if (remotesource && !remotedest && hassegstate(dpath)) {
+				dfd = dopen(dpath, O_WRONLY, (mode_t)0);
+				if (dfd < 0) {
+					cmdwarn("opening %s", dpath);
+					return;
+				}
+				if (!getsegmented(spath, dpath, dfd, sst, 1) &&
+				    !int_signal)
+					cmdwarn("transferring %s", spath);
+				return;
+			}
+
 			/* cannot resume beyond file */
 			if (sst.st_size <= dst.st_size) {
 				cmdwarnx("resuming %s: already as large as "
@@ -350,31 +1025,42 @@ transferfile(int remotesource, const char *spath, const char *dpath, int *dexist
 			if (offset > 0) {
 				if (dlseek(dfd, offset, SEEK_SET) == -1) {
 					cmdwarn("seeking %s", dpath);
-					(void)close(dfd);
+					(void)dclose(dfd);
 					return;
 				}
 			}
 
 			/* variable dfd now is valid `destination' */
 		} else {
-			/* ask what to do */
-			if (!askonexist(dpath, sst, dst, &tmpexist,dexist)) {
+			/*
+			 * ask what to do, one worker at a time.  another
+			 * worker may have been answered with `all' meanwhile.
+			 */
+			lockprompt();
+			if (*dexist != VAR_ASK) {
+				tmpexist = *dexist;
+			} else if (batch) {
+				unlockprompt();
+				cmdwarnx("%s exists, set onexist to not be asked",
+				    dpath);
+				return;
+			} else if (!askonexist(dpath, sst, dst, &tmpexist, dexist)) {
+				unlockprompt();
 				if (!int_signal)
 					cmdwarnx("could not read answer");
 				return;
 			}
+			unlockprompt();
 
 			if (tmpexist == VAR_SKIP)
 				return;
 
-			if (tmpexist == VAR_RESUME && sst.st_size <= dst.st_size) {
-				cmdwarnx("resuming %s: already as large as or "
-					"larger than source", spath);
-				return;
-			}
-
-			/* tmpexist is VAR_RESUME or VAR_OVERWRITE */
-			transferfile(remotesource, spath, dpath, &tmpexist);
+			/*
+			 * tmpexist is VAR_RESUME, VAR_OVERWRITE or VAR_DELTA,
+			 * resuming checks the size of the source itself
+			 */
+			transferfile(remotesource, remotedest, spath, dpath,
+			    &tmpexist);
 			return;
 		}
 	}
@@ -397,16 +1083,36 @@ transferfile(int remotesource, const char *spath, const char *dpath, int *dexist
 		}
 	}
 
-	/* retrieve info about file */
-	if (sfstat(sfd, &sst) != 0) {
+	/*
+	 * retrieve info about file, unless globbing found it.  a resumed or
+	 * segmented transfer needs the size as it is now, not as listed.
+	 */
+	if ((globmatch(spath, &sst) != GLM_ATTRS || offset > 0 ||
+	    segmentcount(sst.st_size) > 1) && sfstat(sfd, &sst) != 0) {
 		cmdwarn("%s", spath);
 		(void)dclose(dfd);
 		(void)sclose(sfd);
 		return;
 	}
 
+	/* large files are transferred over several connections at once */
+	if (offset == 0 && remotesource && !remotedest && pool == NULL &&
+	    segmentcount(sst.st_size) > 1) {
+		(void)sclose(sfd);
+		if (!getsegmented(spath, dpath, dfd, sst, 0) && !int_signal)
+			cmdwarn("transferring %s", spath);
+		return;
+	}
+	if (offset == 0 && segput) {
+		(void)dclose(dfd);
+		if (!putsegmented(spath, sfd, dpath, sst) && !int_signal)
+			cmdwarn("transferring %s", spath);
+		return;
+	}
+
 	/* copy the fd's, copybyfd closes file handles */
-	if (!copybyfd(sfd, dfd, remotesource, offset, sst.st_size, spath))
+	if (!copybyfd(sfd, dfd, remotesource, remotedest, offset, sst.st_size,
+	    spath, 0))
 		/* on SIGINT, do not say anything, just stop */
 		if (!int_signal)
 			cmdwarn("transferring %s", spath);
@@ -416,149 +1122,1665 @@ transferfile(int remotesource, const char *spath, const char *dpath, int *dexist
 
 
 /*
- * Copies from from to to.  remotesource denotes if the source is remote or
- * local.  cur is the current offset in from at which the copying starts.  size
- * is the total size of the file to be copied.  frompath is the name that goes
- * with from (the first argument).  On failure 0 is returned and errno is set,
- * otherwise anything but 0 may be returned.
+ * Transfers spath to dpath like transferfile.  During a parallel transfer
+ * the file is queued for the workers instead, waiting while the queue is
+ * full.
+ */
+static void
+queuefile(int remotesource, int remotedest, const char *spath,
+    const char *dpath, int *dexist)
+{
+	Job    *job;
+
+	if (pool == NULL) {
+		transferfile(remotesource, remotedest, spath, dpath, dexist);
+		return;
+	}
+
+	job = xmalloc(sizeof (Job));
+	job->remotesource = remotesource;
+	job->remotedest = remotedest;
+	job->dest = remotedest ? destsession() : NULL;
+	job->spath = xstrdup(spath);
+	job->dpath = xstrdup(dpath);
+	job->dexist = dexist;
+	job->next = NULL;
+
+	(void)pthread_mutex_lock(&pool->lock);
+	while (!int_signal && pool->nworkers > 0 &&
+	    pool->queued >= QUEUE_MAXJOBS)
+		(void)pthread_cond_wait(&pool->cond, &pool->lock);
+
+	if (int_signal || pool->nworkers == 0) {
+		(void)pthread_mutex_unlock(&pool->lock);
+
+		/* all workers are gone, do it ourselves */
+		if (!int_signal)
+			transferfile(remotesource, remotedest, spath, dpath,
+			    dexist);
+		jobfree(job);
+		return;
+	}
+
+	if (pool->tail == NULL)
+		pool->head = job;
+	else
+		pool->tail->next = job;
+	pool->tail = job;
+	++pool->queued;
+	(void)pthread_cond_broadcast(&pool->cond);
+	(void)pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+ * Start routine of the worker threads of a parallel transfer.  Transfers
+ * queued jobs until the queue is empty and closing.  After an interrupt, the
+ * remaining jobs are only removed from the queue.
+ */
+/* ARGSUSED */
+static void *
+worker(void *arg)
+{
+	Job    *job;
+	int	attached;
+	SmbSession     *dest, *clone;
+
+	attached = smb_worker_attach() == 0;
+	if (!attached)
+		cmdwarn("starting worker");
+
+	/* the destination of a copy between sessions needs a clone too */
+	dest = clone = NULL;
+
+	(void)pthread_mutex_lock(&pool->lock);
+	while (attached) {
+		while (pool->head == NULL && !pool->closing)
+			(void)pthread_cond_wait(&pool->cond, &pool->lock);
+		if ((job = pool->head) == NULL)
+			break;
+
+		pool->head = job->next;
+		if (pool->head == NULL)
+			pool->tail = NULL;
+		--pool->queued;
+		(void)pthread_cond_broadcast(&pool->cond);
+		(void)pthread_mutex_unlock(&pool->lock);
+
+		if (job->dest != dest) {
+			(void)pthread_setspecific(destkey, NULL);
+			smbs_free(clone);
+			dest = job->dest;
+			clone = NULL;
+			if (dest != NULL && (clone = smbs_clone(dest)) == NULL)
+				cmdwarn("starting worker");
+			(void)pthread_setspecific(destkey, clone);
+		}
+		if (!int_signal && (dest == NULL || clone != NULL))
+			transferfile(job->remotesource, job->remotedest,
+			    job->spath, job->dpath, job->dexist);
+		jobfree(job);
+
+		(void)pthread_mutex_lock(&pool->lock);
+	}
+	--pool->nworkers;
+	(void)pthread_cond_broadcast(&pool->cond);
+	(void)pthread_mutex_unlock(&pool->lock);
+
+	if (clone != NULL) {
+		(void)pthread_setspecific(destkey, NULL);
+		smbs_free(clone);
+	}
+	smb_worker_detach();
+	return NULL;
+}
+
+
+static void
+jobfree(Job *job)
+{
+	free(job->spath);
+	free(job->dpath);
+	free(job);
+}
+
+
+static void
+destkey_init(void)
+{
+	if (pthread_key_create(&destkey, NULL) != 0)
+		err(1, "creating key for destination sessions");
+}
+
+
+/* Returns the destination session of the calling thread, see destkey. */
+static SmbSession *
+destsession(void)
+{
+	(void)pthread_once(&destkey_once, destkey_init);
+	return pthread_getspecific(destkey);
+}
+
+
+/*
+ * Lockprompt and unlockprompt surround writing to the terminal and asking the
+ * user questions during a parallel transfer.  Without one, they do nothing.
+ */
+static void
+lockprompt(void)
+{
+	if (pool != NULL)
+		(void)pthread_mutex_lock(&pool->promptlock);
+}
+
+
+static void
+unlockprompt(void)
+{
+	if (pool != NULL)
+		(void)pthread_mutex_unlock(&pool->promptlock);
+}
+
+
+/*
+ * Adds count bytes to the total of the parallel transfer.  Once a second, a
+ * line with the number of files and bytes transferred by all workers and the
+ * average speed is printed, unless another worker is busy with the terminal.
+ */
+static void
+pool_progress(size_t count)
+{
+	struct timeval	now;
+	char	line[PROGRESSLINE_MAXLEN + 1];
+	char	sizebuf[10];
+	char	speedbuf[13];
+	int	width;
+
+	(void)gettimeofday(&now, NULL);
+
+	(void)pthread_mutex_lock(&pool->lock);
+	pool->bytes += count;
+	if (!pool->showprogress || timediff(now, pool->lastprint) < 1000000) {
+		(void)pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+	pool->lastprint = now;
+	makesize(sizebuf, pool->bytes);
+	makespeed(speedbuf, (double)1e6 * (double)pool->bytes /
+	    (double)timediff(now, pool->begintime));
+	(void)xsnprintf(line, sizeof line, "%d files done, %d queued: %s %s",
+	    pool->files, pool->queued, sizebuf, speedbuf);
+	(void)pthread_mutex_unlock(&pool->lock);
+
+	if (pthread_mutex_trylock(&pool->promptlock) != 0)
+		return;
+
+	/* pad with spaces to overwrite what was on the line before */
+	width = term_width() - 1;
+	if (width > sizeof line - 1)
+		width = sizeof line - 1;
+	(void)printf("\r%-*.*s", width, width, line);
+	(void)fflush(stdout);
+
+	(void)pthread_mutex_unlock(&pool->promptlock);
+}
+
+
+/*
+ * Prints the completion line for file which has size bytes and was
+ * transferred at average bytes per second in blocks of blocksize bytes by a
+ * worker.
+ */
+static void
+pool_completed(const char *file, off_t size, double average, size_t blocksize)
+{
+	(void)pthread_mutex_lock(&pool->lock);
+	++pool->files;
+	(void)pthread_mutex_unlock(&pool->lock);
+
+	lockprompt();
+	printcompleted(file, size, average, blocksize);
+	unlockprompt();
+}
+
+
+/*
+ * Returns the number of segments a download of size bytes is split in, as
+ * configured with variable `segments' but keeping segments at least
+ * SEGMENT_MINSIZE bytes.
+ */
+static int
+segmentcount(off_t size)
+{
+	int	count;
+
+	count = getvariable_int("segments");
+	if (size / SEGMENT_MINSIZE < count)
+		count = (int)(size / SEGMENT_MINSIZE);
+	return count;
+}
+
+
+/* Returns the path of the state file for dpath, must be freed by the caller. */
+static char *
+segstatepath(const char *dpath)
+{
+	char   *path;
+
+	path = xmalloc(strlen(dpath) + strlen(SEGSTATE_SUFFIX) + 1);
+	strcpy(path, dpath);
+	strcat(path, SEGSTATE_SUFFIX);
+	return path;
+}
+
+
+/* Returns whether an interrupted segmented download to dpath can be resumed. */
+static int
+hassegstate(const char *dpath)
+{
+	char   *path;
+	int	r;
+
+	path = segstatepath(dpath);
+	r = access(path, F_OK) == 0;
+	free(path);
+	return r;
+}
+
+
+/*
+ * Retrieves remote file spath, with attributes sst, to dpath which is open as
+ * dfd.  The file is retrieved in segments by as many threads, see Segheader.
+ * When resume is zero, the state file is created and dfd is sized to the
+ * size of the source, otherwise the positions are read from the state file.
+ * A state file of a source which has changed since is started over.
+ * On success the state file is removed.  Dfd is always closed.  On failure 0
+ * is returned and errno is set, otherwise anything but 0 is returned.
+ */
+static int
+getsegmented(const char *spath, const char *dpath, int dfd, struct stat sst,
+    int resume)
+{
+	Segmented	sd;
+	Segheader	hdr;
+	Segment        *segs;
+	char   *statepath;
+	off_t	done;
+	int	i, count;
+	int	save_errno;
+
+	statepath = segstatepath(dpath);
+	segs = NULL;
+	sd.statefd = -1;
+
+	if (resume) {
+		sd.statefd = open(statepath, O_RDWR, (mode_t)0);
+		if (sd.statefd < 0)
+			goto error;
+		if (read(sd.statefd, &hdr, sizeof hdr) != sizeof hdr ||
+		    memcmp(hdr.magic, SEGSTATE_MAGIC, sizeof hdr.magic) != 0 ||
+		    hdr.count < 1 || hdr.count > SEGMENTS_MAX) {
+			errno = EINVAL;
+			goto error;
+		}
+		if (hdr.size != sst.st_size || hdr.mtime != sst.st_mtime) {
+			/* the remote file has changed, retrieve it again */
+			(void)close(sd.statefd);
+			sd.statefd = -1;
+			if (ftruncate(dfd, (off_t)0) != 0)
+				goto error;
+			resume = 0;
+		} else
+			count = hdr.count;
+	}
+	if (!resume) {
+		/* a changed file may have become too small to split */
+		count = segmentcount(sst.st_size);
+		if (count < 1)
+			count = 1;
+
+		sd.statefd = open(statepath, O_RDWR|O_CREAT|O_TRUNC,
+		    (mode_t)(S_IRUSR|S_IWUSR));
+		if (sd.statefd < 0)
+			goto error;
+		memset(&hdr, 0, sizeof hdr);
+		memcpy(hdr.magic, SEGSTATE_MAGIC, sizeof hdr.magic);
+		hdr.size = sst.st_size;
+		hdr.mtime = sst.st_mtime;
+		hdr.count = count;
+		if (write(sd.statefd, &hdr, sizeof hdr) != sizeof hdr)
+			goto error;
+
+		/* make room for the entire file, segments arrive out of order */
+		if ((errno = posix_fallocate(dfd, (off_t)0, sst.st_size)) != 0 &&
+		    ftruncate(dfd, sst.st_size) != 0)
+			goto error;
+	}
+
+	segs = xmalloc(sizeof segs[0] * count);
+	done = 0;
+	for (i = 0; i < count; ++i) {
+		segs[i].pos = sst.st_size / count * i;
+		segs[i].end = (i == count - 1) ? sst.st_size :
+		    sst.st_size / count * (i + 1);
+
+		if (resume) {
+			if (pread(sd.statefd, &segs[i].pos, sizeof segs[i].pos,
+			    (off_t)(sizeof hdr + sizeof (off_t) * i)) !=
+			    sizeof segs[i].pos) {
+				errno = EINVAL;
+				goto error;
+			}
+			if (segs[i].pos < sst.st_size / count * i ||
+			    segs[i].pos > segs[i].end) {
+				errno = EINVAL;
+				goto error;
+			}
+			done += segs[i].pos - sst.st_size / count * i;
+		} else if (pwrite(sd.statefd, &segs[i].pos, sizeof segs[i].pos,
+		    (off_t)(sizeof hdr + sizeof (off_t) * i)) != sizeof segs[i].pos)
+			goto error;
+	}
+
+	sd.remotesource = 1;
+	sd.rpath = spath;
+	sd.lfd = dfd;
+	if (!runsegments(&sd, segs, count, spath, done, sst.st_size))
+		goto error;
+
+	if (close(dfd) != 0) {
+		dfd = -1;
+		goto error;
+	}
+	(void)close(sd.statefd);
+	(void)unlink(statepath);
+
+	free(segs);
+	free(statepath);
+	return 1;
+
+error:
+	/* the state file is kept, so the download can be resumed */
+	save_errno = errno;
+	if (dfd >= 0)
+		(void)close(dfd);
+	if (sd.statefd >= 0)
+		(void)close(sd.statefd);
+	free(segs);
+	free(statepath);
+	errno = save_errno;
+	return 0;
+}
+
+
+/*
+ * Uploads local file spath, open as sfd and with attributes sst, to remote
+ * dpath.  The file is written in segments by as many threads to a partial
+ * file named like a state file.  Only when all segments have landed and its
+ * size is right, the partial file gets the modification time of spath and
+ * replaces dpath, on failure it is removed.  Sfd is always closed.  On
+ * failure 0 is returned and errno is set, otherwise anything but 0 is
+ * returned.
+ */
+static int
+putsegmented(const char *spath, int sfd, const char *dpath, struct stat sst)
+{
+	Segmented	sd;
+	Segment        *segs;
+	struct stat	st;
+	struct timeval	tv[2];
+	char   *partpath;
+	int	i, count;
+	int	fd;
+	int	save_errno;
+
+	partpath = segstatepath(dpath);
+	segs = NULL;
+
+	/* this handle is kept open until the partial file is complete */
+	fd = smb_open(partpath, O_WRONLY|O_CREAT|O_TRUNC,
+	    (mode_t)(S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH));
+	if (fd < 0)
+		goto error;
+
+	/* the file may have shrunk since it was chosen to be split */
+	count = segmentcount(sst.st_size);
+	if (count < 1)
+		count = 1;
+	segs = xmalloc(sizeof segs[0] * count);
+	for (i = 0; i < count; ++i) {
+		segs[i].pos = sst.st_size / count * i;
+		segs[i].end = (i == count - 1) ? sst.st_size :
+		    sst.st_size / count * (i + 1);
+	}
+
+	sd.remotesource = 0;
+	sd.rpath = partpath;
+	sd.lfd = sfd;
+	sd.statefd = -1;
+	if (!runsegments(&sd, segs, count, spath, (off_t)0, sst.st_size))
+		goto error;
+
+	/* all segments have landed, check before finalizing */
+	if (smb_fstat(fd, &st) != 0)
+		goto error;
+	if (st.st_size != sst.st_size) {
+		errno = EIO;
+		goto error;
+	}
+	i = smb_close(fd);
+	fd = -1;
+	if (i != 0)
+		goto error;
+
+	/* like the local file, the server would show when it was written */
+	tv[0].tv_sec = tv[1].tv_sec = sst.st_mtime;
+	tv[0].tv_usec = tv[1].tv_usec = 0;
+	if (smb_utimes(partpath, tv) != 0)
+		goto error;
+
+	/* transferfile left the destination as it was, or created it empty */
+	if ((smb_unlink(dpath) != 0 && errno != ENOENT) ||
+	    smb_rename(partpath, dpath) != 0)
+		goto error;
+
+	(void)close(sfd);
+	free(segs);
+	free(partpath);
+	return 1;
+
+error:
+	/* unlike a download, an upload is started over */
+	save_errno = errno;
+	if (fd >= 0)
+		(void)smb_close(fd);
+	(void)smb_unlink(partpath);
+	(void)close(sfd);
+	free(segs);
+	free(partpath);
+	errno = save_errno;
+	return 0;
+}
+
+
+/*
+ * Copies the count segs of sd, each by a thread of its own, and prints the
+ * progress of file which is at offset done of size bytes, or adds it to that
+ * of the pool when run by a worker of a parallel transfer.  On failure 0 is
+ * returned and errno is set, otherwise anything but 0 is returned.
+ */
+static int
+runsegments(Segmented *sd, Segment *segs, int count, const char *file,
+    off_t done, off_t size)
+{
+	int	i, started;
+	int	showprogress;
+	size_t	blocksize;
+	double	average;
+	struct timeval	begintime, endtime;
+	sigset_t	set, oset;
+
+	sd->size = size;
+	sd->copied = 0;
+	sd->failed = 0;
+	(void)pthread_mutex_init(&sd->lock, NULL);
+
+	/* a worker of a parallel transfer adds to the progress of the pool */
+	(void)gettimeofday(&begintime, NULL);
+	showprogress = (pool == NULL) ? startprogress(file, done, size) : 0;
+
+	/* signals are handled by this thread, segment threads inherit the mask */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGWINCH);
+	sigaddset(&set, SIGALRM);
+	(void)pthread_sigmask(SIG_BLOCK, &set, &oset);
+
+	for (started = 0; started < count; ++started) {
+		segs[started].sd = sd;
+		segs[started].index = started;
+		if ((errno = pthread_create(&segs[started].thread, NULL,
+		    segment, &segs[started])) != 0) {
+			/* the segments not started can be resumed later */
+			(void)pthread_mutex_lock(&sd->lock);
+			sd->failed = 1;
+			sd->save_errno = errno;
+			(void)pthread_mutex_unlock(&sd->lock);
+			break;
+		}
+	}
+
+	(void)pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+	/* the largest block size of the segments is shown */
+	blocksize = 0;
+	for (i = 0; i < started; ++i) {
+		(void)pthread_join(segs[i].thread, NULL);
+		if (segs[i].blocksize > blocksize)
+			blocksize = segs[i].blocksize;
+	}
+
+	if (showprogress)
+		stopprogress();
+	(void)pthread_mutex_destroy(&sd->lock);
+
+	if (int_signal) {
+		errno = EINTR;
+		return 0;
+	}
+	if (sd->failed) {
+		errno = sd->save_errno;
+		return 0;
+	}
+
+	(void)gettimeofday(&endtime, NULL);
+	average = (timediff(endtime, begintime) == 0) ? 0.0 :
+	    (double)1e6 * (double)sd->copied /
+	    (double)timediff(endtime, begintime);
+	if (pool != NULL)
+		pool_completed(file, size, average, blocksize);
+	else
+		printcompleted(file, size, average, blocksize);
+	return 1;
+}
+
+
+/*
+ * Start routine of the threads of a segmented transfer, copies the range of
+ * one Segment with a session of its own.  For a download, its
+ * position is written to the state file after each write to the local file.
+ */
+static void *
+segment(void *arg)
+{
+	Segment        *seg;
+	Segmented      *sd;
+	Blocksize	bs;
+	char   *buf;
+	size_t	bufsize;
+	ssize_t	count, written, n;
+	size_t	want;
+	int	fd;
+
+	seg = (Segment *)arg;
+	sd = seg->sd;
+	fd = -1;
+	blocksize_init(&bs);
+	bufsize = bs.size;
+	buf = xmalloc(bufsize);
+
+	if (smb_worker_attach() != 0)
+		goto error;
+
+	fd = smb_open(sd->rpath, sd->remotesource ? O_RDONLY : O_WRONLY,
+	    (mode_t)0);
+	if (fd < 0 || smb_lseek(fd, seg->pos, SEEK_SET) == (off_t)-1)
+		goto error;
+
+	while (!int_signal && seg->pos < seg->end) {
+		if (bs.size > bufsize) {
+			free(buf);
+			bufsize = bs.size;
+			buf = xmalloc(bufsize);
+		}
+		want = bs.size;
+		if (seg->end - seg->pos < (off_t)want)
+			want = (size_t)(seg->end - seg->pos);
+
+		if (sd->remotesource)
+			count = smb_read(fd, buf, want);
+		else
+			count = pread(sd->lfd, buf, want, seg->pos);
+		if (count <= 0) {
+			/* the file shrunk if it ends early */
+			if (count == 0)
+				errno = EIO;
+			goto error;
+		}
+
+		for (written = 0; written < count; written += n) {
+			if (sd->remotesource)
+				n = pwrite(sd->lfd, buf + written,
+				    count - written, seg->pos + written);
+			else
+				n = smb_write(fd, buf + written,
+				    count - written);
+			if (n == -1)
+				goto error;
+		}
+
+		seg->pos += count;
+		if (sd->statefd >= 0 && pwrite(sd->statefd, &seg->pos,
+		    sizeof seg->pos, (off_t)(sizeof (Segheader) +
+		    sizeof (off_t) * seg->index)) != sizeof seg->pos)
+			goto error;
+
+		(void)pthread_mutex_lock(&sd->lock);
+		sd->copied += count;
+		if (pool == NULL)
+			transferred += count;
+		(void)pthread_mutex_unlock(&sd->lock);
+		if (pool != NULL)
+			pool_progress((size_t)count);
+
+		blocksize_update(&bs, (size_t)count);
+	}
+	seg->blocksize = bs.size;
+
+	/* the last segment of a download checks the file has not grown */
+	if (!int_signal && sd->remotesource && seg->end == sd->size &&
+	    (count = smb_read(fd, buf, (size_t)1)) != 0) {
+		if (count > 0)
+			errno = EIO;
+		goto error;
+	}
+	free(buf);
+
+	if (smb_close(fd) != 0) {
+		fd = -1;
+		goto error;
+	}
+	smb_worker_detach();
+	return NULL;
+
+error:
+	(void)pthread_mutex_lock(&sd->lock);
+	if (!sd->failed) {
+		sd->failed = 1;
+		sd->save_errno = errno;
+	}
+	(void)pthread_mutex_unlock(&sd->lock);
+
+	seg->blocksize = bs.size;
+	free(buf);
+	if (fd >= 0)
+		(void)smb_close(fd);
+	smb_worker_detach();
+	return NULL;
+}
+
+
+/*
+ * Copies from from to to.  remotesource and remotedest denote if the source
+ * and destination are remote or local.  cur is the current offset in from
+ * at which the copying starts.  size is the total size of the file to be
+ * copied, -1 when it is not known in advance (reading a pipe).  frompath is
+ * the name that goes with from (the first argument).  On failure 0 is
+ * returned and errno is set, otherwise anything but 0 may be returned.
+ * During a parallel transfer, the progress is added to that of the pool
+ * instead of printed, when quiet it is not printed at all, as when to is
+ * the terminal.
+ */
+static int
+copybyfd(int from, int to, int remotesource, int remotedest, off_t cur,
+    off_t size, const char *frompath, int quiet)
+{
+	size_t copied;                  /* number of bytes copied so far */
+	struct timeval begintime, endtime;
+	Blocksize bs;
+	int nbufs;
+	int showprogress;
+	int ok;
+	int save_errno;
+	double completedaverage;
+	ssize_t (*readfrom)(int, void *, size_t);
+	ssize_t (*writeto)(int, const void *, size_t);
+	int (*closefrom)(int);
+	int (*closeto)(int);
+
+	/* safe default values */
+	copied = 0;
+
+	/* determine which functions to use */
+	if (remotesource && remotedest) {
+		readfrom = smb_read;
+		writeto = dest_write;
+		closefrom = smb_close;
+		closeto = dest_close;
+	} else if (remotesource) {
+		readfrom = smb_read;
+		writeto = write;
+		closefrom = smb_close;
+		closeto = close;
+	} else {
+		readfrom = read;
+		writeto = smb_write;
+		closefrom = close;
+		closeto = smb_close;
+	}
+
+	/* set the time at which the transfer started */
+	(void)gettimeofday(&begintime, NULL);
+
+	/* print initial line, workers of a parallel transfer never do */
+	showprogress = (pool == NULL && !quiet) ?
+	    startprogress(frompath, cur, size) : 0;
+
+	/*
+	 * overlap reading and writing when more than one buffer may be used.
+	 * both files of a copy on one session belong to the same session,
+	 * which cannot be used by two threads, so that is done serially after
+	 * the server had the chance to copy the data itself.
+	 */
+	blocksize_init(&bs);
+	nbufs = getvariable_int("buffers");
+	if (remotesource && remotedest && destsession() == NULL) {
+		ok = copyspliced(from, to, size - cur, &copied);
+		if (ok && !int_signal)
+			ok = copyserial(from, to, readfrom, writeto, &bs,
+			    &copied);
+	} else if (nbufs > 1)
+		ok = copypiped(from, to, remotesource, readfrom, writeto,
+		    nbufs, &bs, &copied);
+	else
+		ok = copyserial(from, to, readfrom, writeto, &bs, &copied);
+	save_errno = errno;
+
+	if (showprogress)
+		stopprogress();
+
+	/* when interrupted, cleanup and set errno */
+	if (int_signal) {
+		(void)(*closefrom)(from);
+		(void)(*closeto)(to);
+
+		errno = EINTR;
+		return 0;
+	}
+
+	/* binary OR since from and to must always be closed */
+	if (!ok | ((*closefrom)(from) != 0) | ((*closeto)(to) != 0)) {
+		if (!ok)
+			errno = save_errno;
+		return 0;       /* error while copying or closing */
+	}
+
+	(void)gettimeofday(&endtime, NULL);
+
+	completedaverage = 0.0;
+	if (timediff(endtime, begintime) != 0)
+		completedaverage = (double)1e6 * (double)copied /
+		    (double)timediff(endtime, begintime);
+
+	/*
+	 * use cur + copied here because we could have read from something
+	 * which has an incorrect size (/dev/zero has 0)
+	 */
+	if (pool != NULL)
+		pool_completed(frompath, cur + copied, completedaverage,
+		    bs.size);
+	else if (!quiet)
+		printcompleted(frompath, cur + copied, completedaverage,
+		    bs.size);
+
+	return 1;
+}
+
+
+/*
+ * Updates the existing dpath, with attributes dst, to be a copy of spath,
+ * with attributes sst, by reading both block by block and writing only
+ * the runs of DELTA_CHUNK bytes that differ, then truncating dpath to the
+ * size of spath.  There is nothing on the server to compute checksums, so
+ * the remote file is read completely either way; what is saved is writing
+ * the unchanged parts, for a put the slower direction of most links.  See
+ * transferfile for remotesource and remotedest.
+ */
+static void
+deltafile(int remotesource, int remotedest, const char *spath,
+    const char *dpath, struct stat sst, struct stat dst)
+{
+	int	sfd, dfd;
+	char   *sbuf, *dbuf;
+	size_t	bufsize, copied, c;
+	ssize_t	n, m, i, j;
+	off_t	pos, dpos, changed;
+	Blocksize	bs;
+	struct timeval	begintime, endtime;
+	int	showprogress, ok, save_errno;
+	double	completedaverage;
+	char	sizebuf[10];
+	ssize_t (*sread)(int, void *, size_t);
+	ssize_t (*dread)(int, void *, size_t);
+	ssize_t (*dwrite)(int, const void *, size_t);
+	off_t (*dlseek)(int, off_t, int);
+	int (*sclose)(int);
+	int (*dclose)(int);
+	int (*dftruncate)(int, off_t);
+
+	sread  = remotesource ? smb_read : read;
+	sclose = remotesource ? smb_close : close;
+	dread  = remotedest ? dest_read : read;
+	dwrite = remotedest ? dest_write : write;
+	dlseek = remotedest ? dest_lseek : lseek;
+	dclose = remotedest ? dest_close : close;
+	dftruncate = remotedest ? dest_ftruncate : ftruncate;
+
+	if ((sfd = remotesource ? smb_open(spath, O_RDONLY, (mode_t)0) :
+	    open(spath, O_RDONLY)) < 0) {
+		cmdwarn("opening %s", spath);
+		return;
+	}
+	if ((dfd = remotedest ? dest_open(dpath, O_RDWR, (mode_t)0) :
+	    open(dpath, O_RDWR)) < 0) {
+		cmdwarn("opening %s", dpath);
+		(void)sclose(sfd);
+		return;
+	}
+
+	(void)gettimeofday(&begintime, NULL);
+	showprogress = (pool == NULL) ?
+	    startprogress(spath, (off_t)0, sst.st_size) : 0;
+
+	blocksize_init(&bs);
+	bufsize = bs.size;
+	sbuf = xmalloc(bufsize);
+	dbuf = xmalloc(bufsize);
+	copied = 0;
+	pos = dpos = changed = 0;
+	ok = 1;
+	while (ok && !int_signal) {
+		if (bs.size > bufsize) {
+			free(sbuf);
+			free(dbuf);
+			bufsize = bs.size;
+			sbuf = xmalloc(bufsize);
+			dbuf = xmalloc(bufsize);
+		}
+
+		if ((n = readfull(sfd, sread, sbuf, bs.size)) <= 0) {
+			ok = n == 0;
+			break;
+		}
+		if (dpos != pos && dlseek(dfd, pos, SEEK_SET) == -1) {
+			ok = 0;
+			break;
+		}
+		if ((m = readfull(dfd, dread, dbuf, (size_t)n)) == -1) {
+			ok = 0;
+			break;
+		}
+		dpos = pos + m;
+
+		/* write each run of chunks which differ */
+		for (i = 0; ok && i < n; i = j) {
+			c = (n - i < DELTA_CHUNK) ? (size_t)(n - i) :
+			    DELTA_CHUNK;
+			if (i + (ssize_t)c <= m &&
+			    memcmp(sbuf + i, dbuf + i, c) == 0) {
+				j = i + c;
+				continue;
+			}
+			for (j = i + c; j < n; j += c) {
+				c = (n - j < DELTA_CHUNK) ? (size_t)(n - j) :
+				    DELTA_CHUNK;
+				if (j + (ssize_t)c <= m &&
+				    memcmp(sbuf + j, dbuf + j, c) == 0)
+					break;
+			}
+			ok = dlseek(dfd, pos + i, SEEK_SET) != -1 &&
+			    writefull(dfd, dwrite, sbuf + i, (size_t)(j - i));
+			dpos = pos + j;
+			changed += j - i;
+		}
+
+		pos += n;
+		addprogress((size_t)n, &copied);
+		blocksize_update(&bs, (size_t)n);
+	}
+	save_errno = errno;
+
+	/* whatever lies beyond the source goes */
+	if (ok && !int_signal && dst.st_size > pos &&
+	    dftruncate(dfd, pos) != 0) {
+		ok = 0;
+		save_errno = errno;
+	}
+
+	if (showprogress)
+		stopprogress();
+	free(sbuf);
+	free(dbuf);
+
+	/* binary OR since both must always be closed */
+	if (((sclose(sfd) != 0) | (dclose(dfd) != 0)) && ok) {
+		ok = 0;
+		save_errno = errno;
+	}
+	if (int_signal)
+		return;
+	if (!ok) {
+		errno = save_errno;
+		cmdwarn("transferring %s", spath);
+		return;
+	}
+
+	(void)gettimeofday(&endtime, NULL);
+	completedaverage = (timediff(endtime, begintime) == 0) ? 0.0 :
+	    (double)1e6 * (double)copied / (double)timediff(endtime, begintime);
+	if (pool != NULL) {
+		pool_completed(spath, pos, completedaverage, bs.size);
+	} else {
+		printcompleted(spath, pos, completedaverage, bs.size);
+		makesize(sizebuf, changed);
+		printf("%s: %s differed\n", spath,
+		    sizebuf + strspn(sizebuf, " "));
+	}
+}
+
+
+/*
+ * Reads from fd with readfrom until buf holds count bytes or the end of
+ * file.  Returns the number of bytes read, -1 on failure with errno set.
+ */
+static ssize_t
+readfull(int fd, ssize_t (*readfrom)(int, void *, size_t), char *buf,
+    size_t count)
+{
+	size_t	done;
+	ssize_t	n;
+
+	for (done = 0; done < count; done += n) {
+		if ((n = (*readfrom)(fd, buf + done, count - done)) == -1)
+			return -1;
+		if (n == 0)
+			break;
+	}
+	return (ssize_t)done;
+}
+
+
+/*
+ * Writes count bytes of buf to fd with writeto.  On failure 0 is returned
+ * and errno is set, otherwise anything but 0 is returned.
+ */
+static int
+writefull(int fd, ssize_t (*writeto)(int, const void *, size_t),
+    const char *buf, size_t count)
+{
+	ssize_t	n;
+
+	for (; count != 0; buf += n, count -= n)
+		if ((n = (*writeto)(fd, buf, count)) <= 0) {
+			if (n == 0)
+				errno = EIO;
+			return 0;
+		}
+	return 1;
+}
+
+
+/*
+ * Has the server copy count bytes from remote file from to remote file to,
+ * both on the current session, so the data does not pass through samblah.
+ * The number of bytes copied is kept in copied.  When the server cannot
+ * copy, nothing is copied and still success is returned: the caller copies
+ * whatever is left by reading and writing.  On failure 0 is returned and
+ * errno is set, otherwise anything but 0 is returned.
+ */
+static int
+copyspliced(int from, int to, off_t count, size_t *copied)
+{
+	SpliceProgress sp;
+	off_t	n;
+
+	if (count <= 0)
+		return 1;
+
+	sp.copied = copied;
+	sp.start = *copied;
+	n = smb_splice(from, to, count, splicecb, &sp);
+	if (n != -1)
+		return 1;
+
+	/* not supported by the server or between these files, read and write */
+	if (*copied == sp.start && (errno == ENOSYS || errno == EOPNOTSUPP ||
+	    errno == ENOTSUP || errno == EINVAL || errno == EXDEV))
+		return 1;
+	return 0;
+}
+
+
+/*
+ * Called by smb_splice with the number of bytes n it copied so far, adds
+ * the new ones to the progress.  Returns 0, which stops the copy, when
+ * interrupted.
+ */
+static int
+splicecb(off_t n, void *priv)
+{
+	SpliceProgress *sp;
+
+	sp = priv;
+	addprogress((size_t)n - (*sp->copied - sp->start), sp->copied);
+	return !int_signal;
+}
+
+
+/*
+ * Copies from from to to with readfrom and writeto, reading a block and
+ * writing it before reading the next.  The size of the blocks is taken from
+ * bs, the number of bytes written is kept in copied.  Stops when int_signal
+ * is set.  On failure 0 is returned and errno is set, otherwise anything but
+ * 0 is returned.
+ */
+static int
+copyserial(int from, int to, ssize_t (*readfrom)(int, void *, size_t),
+    ssize_t (*writeto)(int, const void *, size_t), Blocksize *bs,
+    size_t *copied)
+{
+	char *buf;                      /* transfer buffer */
+	size_t bufsize;                 /* allocated size of buf */
+	ssize_t count;                  /* number of bytes read */
+	ssize_t written;                /* number of bytes written */
+	size_t countleft;               /* number of read bytes to write */
+	int save_errno;
+
+	bufsize = bs->size;
+	buf = xmalloc(bufsize);
+
+	/* keep reading and writing till finished or error */
+	written = -1;
+	while (!int_signal) {
+		if (bs->size > bufsize) {
+			free(buf);
+			bufsize = bs->size;
+			buf = xmalloc(bufsize);
+		}
+
+		count = (*readfrom)(from, buf, bs->size);
+		if (count == -1)
+			goto error;
+		if (count == 0)
+			break;
+
+		countleft = (size_t)count;
+		while (!int_signal && countleft != 0) {
+			written = (*writeto)(to,
+			    buf + ((size_t)count - countleft), countleft);
+			if (written == -1)
+				goto error;
+			if (written == 0)
+				break;
+
+			countleft -= written;
+		}
+
+		addprogress(count - countleft, copied);
+		blocksize_update(bs, count - countleft);
+
+		if (written == 0)
+			break;
+	}
+
+	free(buf);
+	return 1;
+
+error:
+	save_errno = errno;
+	free(buf);
+	errno = save_errno;
+	return 0;
+}
+
+
+/*
+ * Same as copyserial, but with a ring of nbufs buffers so the next buffer is
+ * read while the previous one is written.  A helper thread does the local
+ * side of the copy, this thread the remote side since the file handle belongs
+ * to its session.  Of a copy between two sessions, the helper writes on the
+ * destination session of this thread.  When the helper cannot be started,
+ * the copy is done serially.
+ */
+static int
+copypiped(int from, int to, int remotesource,
+    ssize_t (*readfrom)(int, void *, size_t),
+    ssize_t (*writeto)(int, const void *, size_t), int nbufs, Blocksize *bs,
+    size_t *copied)
+{
+	Pipe	p;
+	pthread_t	helper;
+	sigset_t	set, oset;
+	int	i;
+	int	error;
+
+	(void)pthread_mutex_init(&p.lock, NULL);
+	(void)pthread_cond_init(&p.cond, NULL);
+	p.nbufs = nbufs;
+	p.bufs = xmalloc(sizeof p.bufs[0] * nbufs);
+	p.bufsizes = xmalloc(sizeof p.bufsizes[0] * nbufs);
+	for (i = 0; i < nbufs; ++i) {
+		p.bufs[i] = xmalloc(bs->size);
+		p.bufsizes[i] = bs->size;
+	}
+	p.lens = xmalloc(sizeof p.lens[0] * nbufs);
+	p.bs = bs;
+	p.head = p.filled = 0;
+	p.eof = p.failed = 0;
+	p.save_errno = 0;
+	p.remotesource = remotesource;
+	p.dest = destsession();
+	p.from = from;
+	p.to = to;
+	p.readfrom = readfrom;
+	p.writeto = writeto;
+	p.copied = *copied;
+
+	/* signals are handled by this thread, the helper inherits the mask */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGWINCH);
+	sigaddset(&set, SIGALRM);
+	(void)pthread_sigmask(SIG_BLOCK, &set, &oset);
+	error = pthread_create(&helper, NULL, pipehelper, &p);
+	(void)pthread_sigmask(SIG_SETMASK, &oset, NULL);
+
+	if (error != 0) {
+		if (!copyserial(from, to, readfrom, writeto, bs, &p.copied))
+			pipe_fail(&p, errno);
+	} else {
+		/* the helper reads for put, and writes for get */
+		if (remotesource)
+			pipe_read(&p);
+		else
+			pipe_write(&p);
+		(void)pthread_join(helper, NULL);
+	}
+
+	for (i = 0; i < nbufs; ++i)
+		free(p.bufs[i]);
+	free(p.bufs);
+	free(p.bufsizes);
+	free(p.lens);
+	(void)pthread_cond_destroy(&p.cond);
+	(void)pthread_mutex_destroy(&p.lock);
+
+	*copied = p.copied;
+	if (p.failed) {
+		errno = p.save_errno;
+		return 0;
+	}
+	return 1;
+}
+
+
+/*
+ * Start routine of the helper thread of copypiped, does the local side of
+ * the copy or the destination side of a copy between sessions.
+ */
+static void *
+pipehelper(void *arg)
+{
+	Pipe   *p;
+
+	p = (Pipe *)arg;
+	if (p->dest != NULL)
+		(void)pthread_setspecific(destkey, p->dest);
+	if (p->remotesource)
+		pipe_write(p);
+	else
+		pipe_read(p);
+	return NULL;
+}
+
+
+/*
+ * Reads from p->from into the free buffers of p until the end of file, a
+ * failure or int_signal.
+ */
+static void
+pipe_read(Pipe *p)
+{
+	ssize_t	count;
+	size_t	size;
+	int	i;
+
+	for (;;) {
+		(void)pthread_mutex_lock(&p->lock);
+		while (!p->failed && !int_signal && p->filled == p->nbufs)
+			waitbriefly(&p->cond, &p->lock);
+		if (p->failed || int_signal) {
+			(void)pthread_mutex_unlock(&p->lock);
+			break;
+		}
+		i = (p->head + p->filled) % p->nbufs;
+		size = p->bs->size;
+		(void)pthread_mutex_unlock(&p->lock);
+
+		/* buffer i is not used by the writer until it is filled */
+		if (size > p->bufsizes[i]) {
+			free(p->bufs[i]);
+			p->bufs[i] = xmalloc(size);
+			p->bufsizes[i] = size;
+		}
+		count = (*p->readfrom)(p->from, p->bufs[i], size);
+		if (count == -1) {
+			pipe_fail(p, errno);
+			break;
+		}
+
+		(void)pthread_mutex_lock(&p->lock);
+		if (count == 0)
+			p->eof = 1;
+		else {
+			p->lens[i] = count;
+			++p->filled;
+		}
+		(void)pthread_cond_broadcast(&p->cond);
+		(void)pthread_mutex_unlock(&p->lock);
+
+		if (count == 0)
+			break;
+	}
+}
+
+
+/*
+ * Writes the filled buffers of p to p->to until the reader is done, a
+ * failure or int_signal.
+ */
+static void
+pipe_write(Pipe *p)
+{
+	ssize_t	written;
+	size_t	countleft;
+	int	i;
+
+	for (;;) {
+		(void)pthread_mutex_lock(&p->lock);
+		while (!p->failed && !int_signal && p->filled == 0 && !p->eof)
+			waitbriefly(&p->cond, &p->lock);
+		if (p->failed || int_signal || p->filled == 0) {
+			(void)pthread_mutex_unlock(&p->lock);
+			break;
+		}
+		i = p->head;
+		(void)pthread_mutex_unlock(&p->lock);
+
+		countleft = (size_t)p->lens[i];
+		while (!int_signal && countleft != 0) {
+			written = (*p->writeto)(p->to,
+			    p->bufs[i] + ((size_t)p->lens[i] - countleft),
+			    countleft);
+			if (written <= 0) {
+				/* nothing written, the destination is full */
+				pipe_fail(p, (written == 0) ? EIO : errno);
+				return;
+			}
+			countleft -= written;
+		}
+
+		addprogress(p->lens[i] - countleft, &p->copied);
+
+		(void)pthread_mutex_lock(&p->lock);
+		blocksize_update(p->bs, p->lens[i] - countleft);
+		p->head = (p->head + 1) % p->nbufs;
+		--p->filled;
+		(void)pthread_cond_broadcast(&p->cond);
+		(void)pthread_mutex_unlock(&p->lock);
+	}
+}
+
+
+/*
+ * Marks the copy through p as failed with errno error, unless it failed
+ * already, and wakes up the other thread.
  */
-static int
-copybyfd(int from, int to, int remotesource, off_t cur, off_t size, const char *frompath)
+static void
+pipe_fail(Pipe *p, int error)
 {
-	char buf[TRANSFER_BUFSIZE];     /* transfer buffer */
-	ssize_t count;                  /* number of bytes read */
-	ssize_t written;                /* number of bytes written */
-	size_t countleft;               /* number of read bytes to write */
-	struct timeval begintime, endtime;
-	int showprogress;
-	int save_errno;
-	double completedaverage;
-	ssize_t (*readfrom)(int, void *, size_t);
-	ssize_t (*writeto)(int, const void *, size_t);
-	int (*closefrom)(int);
-	int (*closeto)(int);
-	struct sigaction alarmact;
-
-	/* safe default values */
-	count = -1;
-	written = -1;
-
-	/* determine which functions to use */
-	if (remotesource) {
-		readfrom = smb_read;
-		writeto = write;
-		closefrom = smb_close;
-		closeto = close;
-	} else {
-		readfrom = read;
-		writeto = smb_write;
-		closefrom = close;
-		closeto = smb_close;
+	(void)pthread_mutex_lock(&p->lock);
+	if (!p->failed) {
+		p->failed = 1;
+		p->save_errno = error;
 	}
+	(void)pthread_cond_broadcast(&p->cond);
+	(void)pthread_mutex_unlock(&p->lock);
+}
 
-	/* determine if we should print progress */
-	showprogress = getvariable_bool("showprogress");
 
-	start_offset = cur;
-	end_offset = size;
-	file = frompath;
-	previoustransferred  = transferred = 0;
-	previoustime.tv_sec = 0;
-	previoustime.tv_usec = 0;
-	average = 0;
+/*
+ * Waits for cond to be signalled, with lock held.  Returns after
+ * PIPE_WAITMSEC at the latest, since setting int_signal does not signal it.
+ */
+static void
+waitbriefly(pthread_cond_t *cond, pthread_mutex_t *lock)
+{
+	struct timeval	now;
+	struct timespec	ts;
 
-	alarmact.sa_handler = alarm_handler;
-	alarmact.sa_flags = SA_RESTART;
-	sigemptyset(&alarmact.sa_mask);
+	(void)gettimeofday(&now, NULL);
+	ts.tv_sec = now.tv_sec;
+	ts.tv_nsec = now.tv_usec * 1000 + PIPE_WAITMSEC * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+	}
+	(void)pthread_cond_timedwait(cond, lock, &ts);
+}
 
-	/* set the time at which the transfer started */
-	(void)gettimeofday(&begintime, NULL);
 
-	/* print initial line */
-	if (showprogress) {
-		if (sigaction(SIGALRM, &alarmact, NULL) != 0) {
-			/* could set signal, simply do not print progress */
-			showprogress = 0;
-		} else {
-			printprogress();
-			(void)alarm(1);
+/*
+ * Opens the file of t (its label without the session name) for writing on
+ * the session of t, for a source with attributes sst.  Sets the offset of
+ * t when resuming, and marks t skipped when it is left alone.  exist tells
+ * what to do when the file exists, as for transferfile.  Returns the file
+ * handle, or -1 when the destination is skipped or on failure, after
+ * printing a message.
+ */
+static int
+fanopen(Fantarget *t, const char *rpath, struct stat sst, int *exist)
+{
+	int	fd, localexist;
+	struct stat dst;
+
+	t->offset = 0;
+	localexist = *exist;
+	fd = smbs_open(t->s, rpath, O_WRONLY | O_CREAT |
+	    ((localexist == VAR_OVERWRITE) ? O_TRUNC : O_EXCL),
+	    (mode_t)(S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH));
+	if (fd >= 0)
+		return fd;
+	if (errno != EEXIST) {
+		cmdwarn("opening %s", t->label);
+		return -1;
+	}
+
+	/* O_CREAT and O_EXCL were specified and the file exists */
+	if (localexist == VAR_SKIP) {
+		t->skipped = 1;
+		return -1;
+	}
+	if (smbs_stat(t->s, rpath, &dst) != 0) {
+		cmdwarn("%s", t->label);
+		return -1;
+	}
+	if (localexist == VAR_ASK) {
+		if (batch) {
+			cmdwarnx("%s exists, set onexist to not be asked",
+			    t->label);
+			return -1;
+		}
+		if (!askonexist(t->label, sst, dst, &localexist, exist)) {
+			if (!int_signal)
+				cmdwarnx("could not read answer");
+			return -1;
+		}
+		if (localexist == VAR_SKIP) {
+			t->skipped = 1;
+			return -1;
 		}
 	}
 
-	/* keep reading and writing till finished or error */
-	while (!int_signal) {
-		count = (*readfrom)(from, buf, sizeof buf);
-		if (count == -1) {
-			save_errno = errno;
+	if (localexist == VAR_DELTA) {
+		cmdwarnx("%s exists, cannot update several sessions by delta",
+		    t->label);
+		return -1;
+	}
+	if (localexist == VAR_OVERWRITE) {
+		if ((fd = smbs_open(t->s, rpath, O_WRONLY | O_TRUNC,
+		    (mode_t)0)) < 0)
+			cmdwarn("opening %s", t->label);
+		return fd;
+	}
 
-			(void)(*closefrom)(from);
-			(void)(*closeto)(to);
+	/* resume */
+	if (sst.st_size <= dst.st_size) {
+		cmdwarnx("resuming %s: already as large as or larger than "
+		    "source", t->label);
+		return -1;
+	}
+	if ((fd = smbs_open(t->s, rpath, O_WRONLY, (mode_t)0)) < 0) {
+		cmdwarn("opening %s", t->label);
+		return -1;
+	}
+	if (dst.st_size > RESUME_ROLLBACK)
+		t->offset = dst.st_size - RESUME_ROLLBACK;
+	if (t->offset > 0 && smbs_lseek(t->s, fd, t->offset, SEEK_SET) == -1) {
+		cmdwarn("seeking %s", t->label);
+		(void)smbs_close(t->s, fd);
+		return -1;
+	}
+	return fd;
+}
 
-			(void)alarm(0);
-			alarmact.sa_handler = SIG_DFL;
-			(void)sigaction(SIGALRM, &alarmact, NULL);
 
-			errno = save_errno;
-			return 0;
+/*
+ * Reads local file sfd from offset cur into the ring of f until the end of
+ * file, a failure or int_signal, waiting for the slowest writer.  The
+ * progress is that of the slowest writer, whose label is printed with it.
+ * Returns 0 when reading failed with errno set, otherwise non-zero.
+ */
+static int
+fanread(Fanout *f, int sfd, off_t cur, Blocksize *bs)
+{
+	Fantarget      *slowest;
+	ssize_t	count;
+	size_t	size;
+	long	seq;
+	off_t	pos;
+	int	i, room;
+
+	pos = cur;
+	for (seq = 0; ; ++seq) {
+		(void)pthread_mutex_lock(&f->lock);
+		for (;;) {
+			room = seq - fanslowest(f, &slowest) < f->nbufs;
+			if (slowest != NULL) {
+				transferred = (size_t)(slowest->offset +
+				    slowest->written - cur);
+				file = slowest->label;
+			}
+			if (int_signal || slowest == NULL || room)
+				break;
+			waitbriefly(&f->cond, &f->lock);
 		}
-		if (count == 0)
-			break;
+		if (int_signal || slowest == NULL) {
+			/* interrupted, or every writer failed */
+			f->eof = 1;
+			(void)pthread_cond_broadcast(&f->cond);
+			(void)pthread_mutex_unlock(&f->lock);
+			return 1;
+		}
+		i = seq % f->nbufs;
+		size = bs->size;
+		(void)pthread_mutex_unlock(&f->lock);
+
+		/* buffer i is not used by the writers until it is read */
+		if (size > f->bufsizes[i]) {
+			free(f->bufs[i]);
+			f->bufs[i] = xmalloc(size);
+			f->bufsizes[i] = size;
+		}
+		count = read(sfd, f->bufs[i], size);
+
+		(void)pthread_mutex_lock(&f->lock);
+		if (count <= 0) {
+			f->eof = 1;
+			(void)pthread_cond_broadcast(&f->cond);
+			(void)pthread_mutex_unlock(&f->lock);
+			return count == 0;
+		}
+		f->lens[i] = count;
+		f->offsets[i] = pos;
+		f->nread = seq + 1;
+		(void)pthread_cond_broadcast(&f->cond);
+		(void)pthread_mutex_unlock(&f->lock);
+
+		pos += count;
+		blocksize_update(bs, (size_t)count);
+	}
+}
 
-		countleft = (size_t)count;
-		while (!int_signal && countleft != 0) {
-			written = (*writeto)(to,
-			    buf + ((size_t)count - countleft), countleft);
-			if (written == -1) {
-				save_errno = errno;
 
-				(void)(*closefrom)(from);
-				(void)(*closeto)(to);
+/*
+ * Returns the next block of the writer of f that is furthest behind and
+ * stores it in slowest, or f->nread and NULL when all writers finished or
+ * failed.  f->lock must be held.
+ */
+static long
+fanslowest(Fanout *f, Fantarget **slowest)
+{
+	int	i;
+	long	next;
+
+	next = f->nread;
+	*slowest = NULL;
+	for (i = 0; i < f->ntargets; ++i) {
+		if (f->targets[i].fd < 0 || f->targets[i].done ||
+		    f->targets[i].failed)
+			continue;
+		if (*slowest == NULL || f->targets[i].next < next) {
+			next = f->targets[i].next;
+			*slowest = &f->targets[i];
+		}
+	}
+	return next;
+}
 
-				(void)alarm(0);
-				alarmact.sa_handler = SIG_DFL;
-				(void)sigaction(SIGALRM, &alarmact, NULL);
 
-				errno = save_errno;
-				return 0;
-			}
-			if (written == 0)
+/*
+ * Start routine of the writer thread of a destination of a fan-out,
+ * writes the blocks in the ring to its file on its session.  Only the part
+ * of a block from the offset of the target on is written.
+ */
+static void *
+fanwriter(void *arg)
+{
+	Fantarget      *t;
+	Fanout *f;
+	ssize_t	len, n;
+	off_t	off, skip, start;
+	char   *buf;
+
+	t = (Fantarget *)arg;
+	f = t->f;
+	for (;;) {
+		(void)pthread_mutex_lock(&f->lock);
+		while (!int_signal && t->next == f->nread && !f->eof)
+			waitbriefly(&f->cond, &f->lock);
+		if (int_signal || t->next == f->nread) {
+			t->done = !int_signal;
+			(void)gettimeofday(&t->endtime, NULL);
+			(void)pthread_cond_broadcast(&f->cond);
+			(void)pthread_mutex_unlock(&f->lock);
+			return NULL;
+		}
+		buf = f->bufs[t->next % f->nbufs];
+		len = f->lens[t->next % f->nbufs];
+		off = f->offsets[t->next % f->nbufs];
+		(void)pthread_mutex_unlock(&f->lock);
+
+		/* blocks read for destinations which resume further back */
+		start = skip = (t->offset > off) ? t->offset - off : 0;
+		for (n = 0; skip < len && !int_signal; skip += n) {
+			n = smbs_write(t->s, t->fd, buf + skip,
+			    (size_t)(len - skip));
+			if (n <= 0)
 				break;
+		}
 
-			countleft -= written;
+		(void)pthread_mutex_lock(&f->lock);
+		if (skip > start)
+			t->written += skip - start;
+		if (!int_signal && (n == -1 || (n == 0 && skip < len))) {
+			t->failed = 1;
+			t->save_errno = (n == -1) ? errno : EIO;
+			(void)pthread_cond_broadcast(&f->cond);
+			(void)pthread_mutex_unlock(&f->lock);
+			return NULL;
 		}
+		++t->next;
+		(void)pthread_cond_broadcast(&f->cond);
+		(void)pthread_mutex_unlock(&f->lock);
+	}
+}
 
-		transferred += count - countleft;
 
-		if (written == 0)
-			break;
-	}
+/*
+ * Initializes bs with the size of variable `blocksize', or the smallest size
+ * when the size is to be chosen automatically.
+ */
+static void
+blocksize_init(Blocksize *bs)
+{
+	int	kb;
+
+	kb = getvariable_int("blocksize");
+	bs->fixed = kb != 0;
+	bs->size = (size_t)(bs->fixed ? kb : BLOCKSIZE_MIN) * 1024;
+	bs->blocks = 0;
+	bs->bytes = 0;
+	bs->usec = 0;
+	bs->baseline = 0.0;
+	bs->settle = 0;
+	(void)gettimeofday(&bs->last, NULL);
+}
 
-	(void)alarm(0);
-	alarmact.sa_handler = SIG_DFL;
-	(void)sigaction(SIGALRM, &alarmact, NULL);
 
-	/* when interrupted, cleanup and set errno */
-	if (int_signal) {
-		(void)(*closefrom)(from);
-		(void)(*closeto)(to);
+/*
+ * Accounts a block of n bytes which has just been copied and, at the end of
+ * each window, adjusts the size of the next blocks.
+ */
+static void
+blocksize_update(Blocksize *bs, size_t n)
+{
+	struct timeval	now;
+	double	rate;
 
-		errno = EINTR;
-		return 0;
-	}
+	(void)gettimeofday(&now, NULL);
+	bs->usec += timediff(now, bs->last);
+	bs->last = now;
+	if (bs->fixed)
+		return;
 
-	/* binary OR since from and to must always be closed */
-	if ((count == -1) | ((*closefrom)(from) != 0) | ((*closeto)(to) != 0))
-		return 0;       /* error while reading or closing */
+	bs->bytes += n;
+	if (++bs->blocks < BLOCKSIZE_WINDOW)
+		return;
 
-	(void)gettimeofday(&endtime, NULL);
+	rate = (bs->usec == 0) ? 0.0 : (double)bs->bytes / (double)bs->usec;
+
+	if (bs->usec / bs->blocks > BLOCKSIZE_MAXUSEC) {
+		/* blocks take too long, progress and interrupts would lag */
+		if (bs->size > BLOCKSIZE_MIN * 1024)
+			bs->size /= 2;
+		bs->baseline = 0.0;
+		bs->settle = BLOCKSIZE_SETTLE;
+	} else if (bs->settle > 0) {
+		--bs->settle;
+	} else if (bs->baseline != 0.0 && rate < bs->baseline * 1.1) {
+		/* doubling did not pay off, go back when it made things worse */
+		if (rate < bs->baseline * 0.9)
+			bs->size /= 2;
+		bs->baseline = 0.0;
+		bs->settle = BLOCKSIZE_SETTLE;
+	} else if (bs->size < BLOCKSIZE_MAX * 1024 &&
+	    bs->usec / bs->blocks * 2 <= BLOCKSIZE_MAXUSEC) {
+		bs->baseline = rate;
+		bs->size *= 2;
+	} else {
+		bs->baseline = 0.0;
+		bs->settle = BLOCKSIZE_SETTLE;
+	}
 
-	completedaverage = 0.0;
-	if (timediff(endtime, begintime) != 0)
-		completedaverage = (double)1e6 * (double)transferred /
-		    (double)timediff(endtime, begintime);
-	printcompleted(completedaverage);
+	bs->blocks = 0;
+	bs->bytes = 0;
+	bs->usec = 0;
+}
 
-	return 1;
+
+/*
+ * Adds n bytes to copied, the number of bytes copied of the current file,
+ * and to the progress of the transfer.
+ */
+static void
+addprogress(size_t n, size_t *copied)
+{
+	*copied += n;
+	if (pool != NULL)
+		pool_progress(n);
+	else
+		transferred = *copied;
 }
 
 
@@ -589,7 +2811,7 @@ askonexist(const char *dpath, struct stat sst, struct stat dst,
 	while (!int_signal && !ready) {
 		/* print the options */
 		printf("[O]verwrite [O!] all  [R]esume [R!] all  "
-		    "[S]kip [S!] all  [C]ancel > ");
+		    "[D]elta [D!] all  [S]kip [S!] all  [C]ancel > ");
 		fflush(stdout);
 
 		/* read answer, remove line on error */
@@ -622,6 +2844,10 @@ askonexist(const char *dpath, struct stat sst, struct stat dst,
 			*localexist = VAR_RESUME;
 		else if (strcasecmp(buf, "R!") == 0)
 			*localexist = *exist = VAR_RESUME;
+		else if (strcasecmp(buf, "D") == 0)
+			*localexist = VAR_DELTA;
+		else if (strcasecmp(buf, "D!") == 0)
+			*localexist = *exist = VAR_DELTA;
 		else if (strcasecmp(buf, "S") == 0)
 			*localexist = VAR_SKIP;
 		else if (strcasecmp(buf, "S!") == 0)
@@ -659,6 +2885,96 @@ open_wrap(const char *path, int flags, mode_t mode)
 }
 
 
+/*
+ * The dest_ functions are the smb_ functions for remote destinations: on
+ * the destination session of the calling thread during a copy between two
+ * sessions (see destkey), on the current session otherwise.
+ */
+static int
+dest_open(const char *path, int flags, mode_t mode)
+{
+	SmbSession     *s;
+
+	s = destsession();
+	return (s != NULL) ? smbs_open(s, path, flags, mode) :
+	    smb_open(path, flags, mode);
+}
+
+
+static int
+dest_close(int fh)
+{
+	SmbSession     *s;
+
+	s = destsession();
+	return (s != NULL) ? smbs_close(s, fh) : smb_close(fh);
+}
+
+
+static int
+dest_stat(const char *path, struct stat *st)
+{
+	SmbSession     *s;
+
+	s = destsession();
+	return (s != NULL) ? smbs_stat(s, path, st) : smb_stat(path, st);
+}
+
+
+static off_t
+dest_lseek(int fh, off_t offset, int base)
+{
+	SmbSession     *s;
+
+	s = destsession();
+	return (s != NULL) ? smbs_lseek(s, fh, offset, base) :
+	    smb_lseek(fh, offset, base);
+}
+
+
+static ssize_t
+dest_read(int fh, void *buf, size_t bufsize)
+{
+	SmbSession     *s;
+
+	s = destsession();
+	return (s != NULL) ? smbs_read(s, fh, buf, bufsize) :
+	    smb_read(fh, buf, bufsize);
+}
+
+
+static ssize_t
+dest_write(int fh, const void *buf, size_t bufsize)
+{
+	SmbSession     *s;
+
+	s = destsession();
+	return (s != NULL) ? smbs_write(s, fh, buf, bufsize) :
+	    smb_write(fh, buf, bufsize);
+}
+
+
+static int
+dest_mkdir(const char *path, mode_t mode)
+{
+	SmbSession     *s;
+
+	s = destsession();
+	return (s != NULL) ? smbs_mkdir(s, path, mode) : smb_mkdir(path, mode);
+}
+
+
+static int
+dest_ftruncate(int fh, off_t length)
+{
+	SmbSession     *s;
+
+	s = destsession();
+	return (s != NULL) ? smbs_ftruncate(s, fh, length) :
+	    smb_ftruncate(fh, length);
+}
+
+
 /*
  * Creates a path like `mkdir -p', that is, creating every part of the path
  * if it does not exist.  On success 0 is returned, -1 indicates an error with
@@ -701,6 +3017,57 @@ mkpath(const char *path, mode_t mode, int (*lmkdir)(const char *, mode_t))
 }
 
 
+/*
+ * Prepares for printing the progress of the transfer of frompath, starting at
+ * offset cur of size bytes.  The progress is printed now and then once a
+ * second by alarm_handler.  Returns non-zero when progress is printed, zero
+ * when it is not (as configured by variable showprogress, or the signal
+ * handler could not be set).
+ */
+static int
+startprogress(const char *frompath, off_t cur, off_t size)
+{
+	struct sigaction alarmact;
+
+	start_offset = cur;
+	end_offset = size;
+	file = frompath;
+	previoustransferred  = transferred = 0;
+	previoustime.tv_sec = 0;
+	previoustime.tv_usec = 0;
+	average = 0;
+
+	if (!getvariable_bool("showprogress"))
+		return 0;
+
+	alarmact.sa_handler = alarm_handler;
+	alarmact.sa_flags = SA_RESTART;
+	sigemptyset(&alarmact.sa_mask);
+
+	/* could not set signal, simply do not print progress */
+	if (sigaction(SIGALRM, &alarmact, NULL) != 0)
+		return 0;
+
+	printprogress();
+	(void)alarm(1);
+	return 1;
+}
+
+
+/* Stops printing progress as started by startprogress. */
+static void
+stopprogress(void)
+{
+	struct sigaction alarmact;
+
+	(void)alarm(0);
+	alarmact.sa_handler = SIG_DFL;
+	alarmact.sa_flags = 0;
+	sigemptyset(&alarmact.sa_mask);
+	(void)sigaction(SIGALRM, &alarmact, NULL);
+}
+
+
 /* ARGSUSED */
 static void
 alarm_handler(int sig)
@@ -725,14 +3092,15 @@ timediff(struct timeval newest, struct timeval oldest)
 
 /*
  * Writes the file and a progress bar to variable `progress', the
- * length of the line is written to progresslen.  The last 13
- * bytes are kept empty, to be filled with an ETA or an average speed.
+ * length of the line is written to progresslen.  The last 13 + reserve
+ * bytes are kept empty, to be filled with an ETA or an average speed and
+ * possibly more.  When that does not fit, only 13 bytes are kept empty.
  * Example lines:
  * file:                      |***************           | 9352 KB  122.2 KB/s
  * file:                      |*******                   |   71 KB   01:49 ETA
  */
 static void
-makeprogress(const char *file, double ratio, off_t size)
+makeprogress(const char *file, double ratio, off_t size, int reserve)
 {
 	int totallen, filelen, barlen, sizelen;
 	int printdots;
@@ -772,6 +3140,8 @@ makeprogress(const char *file, double ratio, off_t size)
 		return;
 	}
 	totallen = progresslen - 13;
+	if (totallen - reserve >= 15)
+		totallen -= reserve;
 
 	barlen = 0;
 	sizelen = 9;
@@ -884,8 +3254,8 @@ printprogress(void)
 	size_t filelen;
 	int filefits;
 
-	/* handle transferring from devices and such, do not print bars */
-	if (start_offset + transferred > end_offset) {
+	/* handle transferring from devices, pipes and such, do not print bars */
+	if (end_offset < 0 || start_offset + transferred > end_offset) {
 		/* print only filename and current offset */
 		makesize(sizebuf, start_offset + transferred);
 		filelen = term_width() - strlen(sizebuf) - 3;
@@ -912,7 +3282,7 @@ printprogress(void)
 		ratio = (double)(start_offset + transferred) /
 		    (double)end_offset;
 
-	makeprogress(file, ratio, start_offset + transferred);
+	makeprogress(file, ratio, start_offset + transferred, 0);
 
 	if (progresslen < 13) {
 		/* do not print anything with a very small terminal */
@@ -975,34 +3345,54 @@ printprogress(void)
 
 
 /*
- * Prints a line showing the completion of the transfer.  makeprogress
- * is used to create a line containing the file name, progressbar
- * (which of course is full) and the final file size.  It then adds
- * the average transfer speed, removes the current line and prints
- * the created line.
+ * Writes average, in bytes per second, in a human readable form to buf,
+ * e.g. "  122.2 KB/s".
  */
 static void
-printcompleted(double average)
+makespeed(char buf[13], double average)
 {
 	char *suffix = " KMGTP";
 	char avgbuf[6];
 
-	/*
-	 * use start_offset + transferred here because we could have read
-	 * from something which has an incorrect size (/dev/zero has 0)
-	 */
-	makeprogress(file, 1.0, start_offset + transferred);
-
-	if (progresslen < 13)
-		return;
-
 	while (average >= 999.9) {
 		++suffix;
 		average /= 1024.0;
 	}
 	(void)xsnprintf(avgbuf, sizeof avgbuf, "%03.1f", average);
+	(void)xsnprintf(buf, 13, "%7s %cB/s", avgbuf, *suffix);
+}
+
+
+/*
+ * Prints a line showing the completion of the transfer of file.  makeprogress
+ * is used to create a line containing the file name, progressbar (which of
+ * course is full) and the final file size.  It then adds the average transfer
+ * speed and, when it fits and is not 0, the size of the blocks, removes the
+ * current line and prints the created line.
+ */
+static void
+printcompleted(const char *file, off_t size, double average, size_t blocksize)
+{
+	char speedbuf[13];
+	char blockbuf[24];
+
+	/* block sizes are multiples of a kilobyte */
+	*blockbuf = '\0';
+	if (blocksize != 0)
+		(void)xsnprintf(blockbuf, sizeof blockbuf, "%lu KB blocks ",
+		    (unsigned long)(blocksize / 1024));
+
+	makeprogress(file, 1.0, size, (int)strlen(blockbuf));
+
+	if (progresslen < 13)
+		return;
+
+	makespeed(speedbuf, average);
 	(void)xsnprintf(progress + strlen(progress), sizeof progress -
-	    strlen(progress), "%7s %cB/s ", avgbuf, *suffix);
+	    strlen(progress), "%s ", speedbuf);
+	if (progresslen - strlen(progress) >= strlen(blockbuf))
+		(void)xsnprintf(progress + strlen(progress), sizeof progress -
+		    strlen(progress), "%s", blockbuf);
 
 	(void)write(STDOUT_FILENO, "\r", 1);
 	(void)write(STDOUT_FILENO, progress, strlen(progress));
@@ -3,14 +3,25 @@
 #include "samblah.h"
 
 /* variables and their default values */
+static int      blocksize = 0;		/* 0 is auto */
+static int      buffers = 4;
+static int      cachettl = 5;
+static int      completewait = 300;	/* milliseconds */
 static int      onexist = VAR_ASK;
 static int      showprogress = 1;
 static char     pager[VAR_STRING_MAXLEN + 1] = DEFAULT_PAGER;
+static int      parallel = 1;
+static int      segments = 1;
+
+
+static int      parsenumber(const char *, int, int, int *);
+
 
 const char **
 listvariables(void)
 {
-	static const char *variables[] = { "onexist", "pager", "showprogress", NULL };
+	static const char *variables[] = { "blocksize", "buffers", "cachettl",
+	    "completewait", "onexist", "pager", "parallel", "segments", "showprogress", NULL };
 
 	return variables;
 }
@@ -22,7 +33,28 @@ listvariables(void)
 const char *
 setvariable(const char *name, const char *valuestr)
 {
-	if (streql(name, "onexist")) {
+	if (streql(name, "blocksize")) {
+		if (streql(valuestr, "auto"))
+			blocksize = 0;
+		else if (!parsenumber(valuestr, BLOCKSIZE_MIN, BLOCKSIZE_MAX,
+		    &blocksize))
+			return "invalid value, must be auto or a number "
+			    "from 64 to 8192";
+		return NULL;
+	} else if (streql(name, "buffers")) {
+		if (!parsenumber(valuestr, 1, BUFFERS_MAX, &buffers))
+			return "invalid value, must be a number from 1 to 16";
+		return NULL;
+	} else if (streql(name, "cachettl")) {
+		if (!parsenumber(valuestr, 0, CACHETTL_MAX, &cachettl))
+			return "invalid value, must be a number from 0 to 3600";
+		smb_setcachettl(cachettl);
+		return NULL;
+	} else if (streql(name, "completewait")) {
+		if (!parsenumber(valuestr, 0, COMPLETEWAIT_MAX, &completewait))
+			return "invalid value, must be a number from 0 to 10000";
+		return NULL;
+	} else if (streql(name, "onexist")) {
 		if (streql(valuestr, "ask"))
 			onexist = VAR_ASK;
 		else if (streql(valuestr, "resume"))
@@ -31,15 +63,25 @@ setvariable(const char *name, const char *valuestr)
 			onexist = VAR_OVERWRITE;
 		else if (streql(valuestr, "skip"))
 			onexist = VAR_SKIP;
+		else if (streql(valuestr, "delta"))
+			onexist = VAR_DELTA;
 		else
 			return "invalid value, must be ask, resume, "
-			    "overwrite or skip";
+			    "overwrite, skip or delta";
 		return NULL;
 	} else if (streql(name, "pager")) {
 		if (strlen(valuestr) + 1 > sizeof pager)
 			return "value too long";
 		strcpy(pager, valuestr);
 		return NULL;
+	} else if (streql(name, "parallel")) {
+		if (!parsenumber(valuestr, 1, PARALLEL_MAX, &parallel))
+			return "invalid value, must be a number from 1 to 32";
+		return NULL;
+	} else if (streql(name, "segments")) {
+		if (!parsenumber(valuestr, 1, SEGMENTS_MAX, &segments))
+			return "invalid value, must be a number from 1 to 16";
+		return NULL;
 	} else if (streql(name, "showprogress")) {
 		if (streql(valuestr, "yes"))
 			showprogress = 1;
@@ -60,16 +102,39 @@ setvariable(const char *name, const char *valuestr)
 char *
 getvariable(const char *name)
 {
-	if (streql(name, "onexist")) {
+	static char numbuf[12];
+
+	if (streql(name, "blocksize")) {
+		if (blocksize == 0)
+			return "auto";
+		(void)xsnprintf(numbuf, sizeof numbuf, "%d", blocksize);
+		return numbuf;
+	} else if (streql(name, "buffers")) {
+		(void)xsnprintf(numbuf, sizeof numbuf, "%d", buffers);
+		return numbuf;
+	} else if (streql(name, "cachettl")) {
+		(void)xsnprintf(numbuf, sizeof numbuf, "%d", cachettl);
+		return numbuf;
+	} else if (streql(name, "completewait")) {
+		(void)xsnprintf(numbuf, sizeof numbuf, "%d", completewait);
+		return numbuf;
+	} else if (streql(name, "onexist")) {
 		switch (onexist) {
 		case VAR_ASK:	        return "ask";
 		case VAR_RESUME:        return "resume";
 		case VAR_OVERWRITE:     return "overwrite";
 		case VAR_SKIP:          return "skip";
+		case VAR_DELTA:         return "delta";
 		default:		return NULL;	/* should not happen */
 		}
 	} else if (streql(name, "pager")) {
 		return pager;
+	} else if (streql(name, "parallel")) {
+		(void)xsnprintf(numbuf, sizeof numbuf, "%d", parallel);
+		return numbuf;
+	} else if (streql(name, "segments")) {
+		(void)xsnprintf(numbuf, sizeof numbuf, "%d", segments);
+		return numbuf;
 	} else if (streql(name, "showprogress")) {
 		return showprogress ? "yes" : "no";
 	} else {
@@ -84,6 +149,23 @@ getvariable_bool(const char *name)
 	return showprogress;
 }
 
+int
+getvariable_int(const char *name)
+{
+	if (streql(name, "blocksize"))
+		return blocksize;
+	if (streql(name, "buffers"))
+		return buffers;
+	if (streql(name, "cachettl"))
+		return cachettl;
+	if (streql(name, "completewait"))
+		return completewait;
+	if (streql(name, "segments"))
+		return segments;
+	assert(streql(name, "parallel"));
+	return parallel;
+}
+
 int
 getvariable_onexist(const char *name)
 {
@@ -97,3 +179,24 @@ getvariable_string(const char *name)
 	assert(streql(name, "pager"));
 	return pager;
 }
+
+/*
+ * Parses the decimal number in valuestr and stores it in value.  Returns zero
+ * when valuestr is not a number between min and max (inclusive), value is
+ * unchanged then.
+ */
+static int
+parsenumber(const char *valuestr, int min, int max, int *value)
+{
+	long	n;
+
+	if (*valuestr == '\0' || strlen(valuestr) > 9 ||
+	    strspn(valuestr, "0123456789") != strlen(valuestr))
+		return 0;
+
+	n = strtol(valuestr, NULL, 10);
+	if (n < min || n > max)
+		return 0;
+	*value = (int)n;
+	return 1;
+}